@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <minivm/aot.hpp>
+#include <minivm/vm.hpp>
+
+// Translates a .mvma program into a C++ translation unit that defines a
+// minivm::aot_module named <symbol>.  --unchecked-memory loads the program
+// with memory checks disabled, which the program the module is registered
+// with has to match.
+//
+// Usage: minivm-aot <input.mvma> <output.cpp> <symbol> [--bind extern=function...]
+//                   [--unchecked-memory]
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr,
+                "Usage: minivm-aot <input.mvma> <output.cpp> <symbol> "
+                "[--bind extern=function...] [--unchecked-memory]\n");
+        return 1;
+    }
+
+    bool checkMemory = true;
+    std::vector<std::pair<std::string_view, std::string_view>> binds;
+    for (int i = 4; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        size_t split = std::string_view::npos;
+        if (arg == "--unchecked-memory")
+        {
+            checkMemory = false;
+            continue;
+        }
+        if (arg == "--bind" && i + 1 < argc)
+        {
+            arg = argv[++i];
+            split = arg.find('=');
+        }
+
+        if (split == std::string_view::npos)
+        {
+            fprintf(stderr, "Unexpected argument %s\n", argv[i]);
+            return 1;
+        }
+        binds.emplace_back(arg.substr(0, split), arg.substr(split + 1));
+    }
+
+    minivm::program program;
+    program.set_memory_checks_enabled(checkMemory);
+    if (!program.load_assembly_from_file(argv[1]))
+    {
+        fprintf(stderr, "Failed to load assembly from file: %s\n",
+                program.get_load_error());
+        return 2;
+    }
+
+    minivm::aot_compiler compiler(program, argv[3]);
+    for (auto& bind : binds)
+    {
+        compiler.bind_extern(bind.first, bind.second);
+    }
+
+    std::string source;
+    if (!compiler.generate(source))
+    {
+        fprintf(stderr, "Failed to translate %s: %s\n", argv[1],
+                compiler.get_error());
+        return 2;
+    }
+
+    std::ofstream stream(argv[2], std::ios_base::binary);
+    stream.write(source.data(), source.size());
+    if (!stream.good())
+    {
+        fprintf(stderr, "Failed to write file %s\n", argv[2]);
+        return 2;
+    }
+    return 0;
+}
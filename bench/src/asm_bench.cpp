@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <minivm/vm.hpp>
+
+#include "source_gen.hpp"
+
+// Measures how long the assembler takes to load synthetic sources of
+// increasing size.  Load time should grow linearly with the input.
+//
+// Usage: minivm_asm_bench [megabytes...]
+int main(int argc, char** argv)
+{
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; ++i)
+    {
+        sizes.push_back(size_t(atoi(argv[i])));
+    }
+
+    if (sizes.empty())
+    {
+        sizes = {1, 4, 16, 64};
+    }
+
+    printf("%10s %10s %10s\n", "megabytes", "seconds", "mb/s");
+
+    for (auto megabytes : sizes)
+    {
+        std::string src =
+            minivm_bench::generate_assembly(megabytes * 1024 * 1024);
+
+        minivm::program program;
+        auto start = std::chrono::steady_clock::now();
+        bool loaded = program.load_assembly(src);
+        auto end = std::chrono::steady_clock::now();
+
+        if (!loaded)
+        {
+            fprintf(stderr, "Failed to load %zu MB source: %s\n", megabytes,
+                    program.get_load_error());
+            return 1;
+        }
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        double mb = double(src.size()) / (1024 * 1024);
+        printf("%10.2f %10.4f %10.2f\n", mb, seconds, mb / seconds);
+    }
+    return 0;
+}
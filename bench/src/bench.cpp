@@ -0,0 +1,705 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <minivm/lanes.hpp>
+#include <minivm/vm.hpp>
+#include <minivm/vm_binding.hpp>
+
+#include "kernels.hpp"
+#include "source_gen.hpp"
+
+// Runs a set of representative kernels and reports how fast the VM gets
+// through them.  Every kernel checks its result, so a broken interpreter
+// change fails loudly instead of reporting a great number.
+//
+// Usage: minivm_bench [--json] [--jit] [--repeat N] [kernel...]
+namespace minivm_bench
+{
+    typedef std::chrono::steady_clock bench_clock;
+
+    struct options
+    {
+        bool json = false;
+        bool jit = false;
+        int repeat = 3;
+        std::vector<std::string_view> filters;
+    };
+
+    // One timed run of a kernel
+    struct sample
+    {
+        double seconds = 0;
+        bool ok = false;
+    };
+
+    struct result
+    {
+        std::string name;
+        double seconds;
+
+        // Instructions the kernel executes per run, counted as written in
+        // the source (a superinstruction counts as the instructions it
+        // replaced).  Zero for benchmarks that don't execute code.
+        uint64_t instructions;
+
+        // Calls, resumes or megabytes per run, reported per second
+        double units;
+        const char* unit;
+    };
+
+    static double elapsed(bench_clock::time_point start)
+    {
+        return std::chrono::duration<double>(bench_clock::now() - start)
+            .count();
+    }
+
+    class kernel_program
+    {
+    public:
+        kernel_program(const options& opts, const char* source,
+                       bool checkMemory = true)
+        {
+            _program.set_jit_enabled(opts.jit);
+            _program.set_memory_checks_enabled(checkMemory);
+            if (!_program.load_assembly(source))
+            {
+                fprintf(stderr, "Failed to load kernel: %s\n",
+                        _program.get_load_error());
+                exit(1);
+            }
+        }
+
+        minivm::program& get()
+        {
+            return _program;
+        }
+
+        void prepare(minivm::execution_context& context, const options& opts)
+        {
+            if (opts.jit)
+            {
+                context.set_execution_mode(minivm::execution_mode::jit);
+            }
+            for (auto& region : _regions)
+            {
+                context.add_memory_region(region.first, region.second, false);
+            }
+        }
+
+        // Read-only host memory every context running the kernel can access
+        void add_memory_region(const void* base, size_t size)
+        {
+            _regions.emplace_back(base, size);
+        }
+
+    private:
+        minivm::program _program;
+        std::vector<std::pair<const void*, size_t>> _regions;
+    };
+
+    // Runs entry with r0 and r1 set and returns the time it took, with the
+    // result left in r0
+    static sample run_entry(kernel_program& kernel, const options& opts,
+                            const char* entry, int64_t r0, int64_t r1,
+                            minivm::vm_word_t& out)
+    {
+        minivm::program_label_id_t label;
+        kernel.get().get_label_id(entry, label);
+
+        minivm::execution_context context(kernel.get());
+        kernel.prepare(context, opts);
+        context.get_registers().registers[0].ireg = r0;
+        context.get_registers().registers[1].ireg = r1;
+
+        sample s;
+        auto start = bench_clock::now();
+        s.ok = context.run_from(label);
+        s.seconds = elapsed(start);
+        out = context.get_registers().registers[0];
+        return s;
+    }
+
+    static uint64_t fibonacci(uint32_t n)
+    {
+        uint64_t a = 0, b = 1;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            uint64_t next = a + b;
+            a = b;
+            b = next;
+        }
+        return a;
+    }
+
+    static sample bench_fib(const options& opts, uint64_t& instructions,
+                            double& calls)
+    {
+        const uint32_t n = 30;
+
+        // Calls with n >= 2 run 10 instructions and the rest run 3, and there
+        // are fib(n + 1) of the latter
+        uint64_t leaves = fibonacci(n + 1);
+        instructions = 10 * (leaves - 1) + 3 * leaves;
+        calls = double(2 * leaves - 1);
+
+        kernel_program kernel(opts, fib_source);
+        minivm::vm_word_t out;
+        auto s = run_entry(kernel, opts, "fib", n, 0, out);
+        s.ok = s.ok && out.ureg == fibonacci(n);
+        return s;
+    }
+
+    static sample bench_nested_loops(const options& opts,
+                                     uint64_t& instructions, double& calls)
+    {
+        const int64_t n = 3000;
+        instructions = uint64_t(4 * n * n + 3 * n + 4);
+        calls = 0;
+
+        kernel_program kernel(opts, nested_loops_source);
+        minivm::vm_word_t out;
+        auto s = run_entry(kernel, opts, "nested_loops", n, 0, out);
+
+        int64_t sum = n * (n - 1) / 2;
+        s.ok = s.ok && out.ireg == sum * sum;
+        return s;
+    }
+
+    // Same computation as nbody_source, for checking its result
+    static double nbody_reference(int64_t steps)
+    {
+        double b[4][4];
+        for (int i = 0; i < 4; ++i)
+        {
+            b[i][0] = i;
+            b[i][1] = double(i) * double(i);
+            b[i][2] = 0;
+            b[i][3] = 0;
+        }
+
+        for (int64_t step = 0; step < steps; ++step)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                double ax = 0, ay = 0;
+                for (int j = 0; j < 4; ++j)
+                {
+                    if (i == j) continue;
+                    double dx = b[j][0] - b[i][0];
+                    double dy = b[j][1] - b[i][1];
+                    double d2 = dx * dx + dy * dy + 0.01;
+                    ax += dx / d2;
+                    ay += dy / d2;
+                }
+                b[i][2] += ax * 0.001;
+                b[i][3] += ay * 0.001;
+            }
+
+            for (int i = 0; i < 4; ++i)
+            {
+                b[i][0] += b[i][2] * 0.001;
+                b[i][1] += b[i][3] * 0.001;
+            }
+        }
+        return b[0][0];
+    }
+
+    static sample bench_nbody(const options& opts, uint64_t& instructions,
+                              double& calls)
+    {
+        const int64_t steps = 100000;
+        instructions = uint64_t(376 * steps + 55);
+        calls = 0;
+
+        kernel_program kernel(opts, nbody_source);
+        minivm::vm_word_t out;
+        auto s = run_entry(kernel, opts, "nbody", steps, 0, out);
+
+        double expected = nbody_reference(steps);
+        s.ok = s.ok && fabs(out.freg - expected) <= 1e-9 * fabs(expected);
+        return s;
+    }
+
+    // Every lane of a particle holds the same values, so one lane is
+    // integrated per particle and summed four times
+    static double particles_reference(int64_t steps)
+    {
+        double sum = 0;
+        for (int i = 0; i < 64; ++i)
+        {
+            double pos = i, vel = 1.0;
+            for (int64_t step = 0; step < steps; ++step)
+            {
+                pos = fma(vel, 0.001, pos);
+                vel = vel + -0.0098;
+            }
+            sum += pos;
+        }
+        return sum + sum + sum + sum;
+    }
+
+    static sample bench_particles(const options& opts,
+                                  uint64_t& instructions, double& calls)
+    {
+        const int64_t steps = 20000;
+        instructions = uint64_t(579 * steps + 794);
+        calls = 0;
+
+        kernel_program kernel(opts, particles_source);
+        minivm::vm_word_t out;
+        auto s = run_entry(kernel, opts, "particles", steps, 0, out);
+
+        double expected = particles_reference(steps);
+        s.ok = s.ok && fabs(out.freg - expected) <= 1e-9 * fabs(expected);
+        return s;
+    }
+
+    static sample bench_stack_sort(const options& opts,
+                                   uint64_t& instructions, double& calls)
+    {
+        const int64_t count = 512;
+        const int64_t rounds = 80;
+        calls = 0;
+
+        // Run the same insertion sort natively to get the checksum and the
+        // number of instructions, which depends on how many shifts it does
+        std::vector<uint64_t> values(count);
+        uint64_t perRound = 2 + 6 * count + 1 + 2;
+        uint64_t state = 12345;
+        for (auto& value : values)
+        {
+            state = state * 1103515245 + 12345;
+            value = state;
+        }
+
+        for (int64_t i = 1; i < count; ++i)
+        {
+            uint64_t key = values[i];
+            int64_t j = i;
+            while (j > 0 && values[j - 1] > key)
+            {
+                values[j] = values[j - 1];
+                --j;
+                perRound += 9;
+            }
+            values[j] = key;
+            perRound += 7 + (j == 0 ? 1 : 5);
+        }
+
+        uint64_t checksum = 0;
+        for (int64_t i = 0; i < count; ++i)
+        {
+            checksum += values[i] * uint64_t(i + 1);
+        }
+        instructions = 2 + perRound * rounds + 2 + 6 * count + 2;
+
+        kernel_program kernel(opts, stack_sort_source);
+        minivm::vm_word_t out;
+        auto s = run_entry(kernel, opts, "stack_sort", count, rounds, out);
+        s.ok = s.ok && out.ureg == checksum;
+        return s;
+    }
+
+    static sample bench_buffer_sum(const options& opts, bool checkMemory,
+                                   uint64_t& instructions)
+    {
+        const int64_t count = 4096;
+        const int64_t rounds = 500;
+
+        std::vector<uint64_t> buffer(count);
+        uint64_t state = 12345;
+        uint64_t sum = 0;
+        for (auto& value : buffer)
+        {
+            state = state * 1103515245 + 12345;
+            value = state;
+            sum += value;
+        }
+        instructions = uint64_t(4 + rounds * (4 + 6 * count / 2));
+
+        kernel_program kernel(opts, buffer_sum_source, checkMemory);
+        kernel.add_memory_region(buffer.data(), count * sizeof(uint64_t));
+        minivm::vm_word_t out;
+        auto s = run_entry(kernel, opts, "buffer_sum",
+                           int64_t(reinterpret_cast<uintptr_t>(buffer.data())),
+                           rounds, out);
+        s.ok = s.ok && out.ureg == sum * uint64_t(rounds);
+        return s;
+    }
+
+    static sample bench_buffer_sum_checked(const options& opts,
+                                           uint64_t& instructions,
+                                           double& calls)
+    {
+        calls = 0;
+        return bench_buffer_sum(opts, true, instructions);
+    }
+
+    static sample bench_buffer_unchecked(const options& opts,
+                                             uint64_t& instructions,
+                                             double& calls)
+    {
+        calls = 0;
+        return bench_buffer_sum(opts, false, instructions);
+    }
+
+    static uint64_t extern_counter = 0;
+
+    static void bench_extern(minivm::vm_execution_registers*)
+    {
+        ++extern_counter;
+    }
+
+    static sample bench_extern_calls(const options& opts,
+                                     uint64_t& instructions, double& calls)
+    {
+        const int64_t n = 5000000;
+        instructions = uint64_t(3 * n + 3);
+        calls = double(n);
+
+        kernel_program kernel(opts, extern_calls_source);
+        kernel.get().set_extern_function_ptr("bench_extern", &bench_extern);
+
+        extern_counter = 0;
+        minivm::vm_word_t out;
+        auto s = run_entry(kernel, opts, "extern_calls", n, 0, out);
+        s.ok = s.ok && out.ireg == n && extern_counter == uint64_t(n);
+        return s;
+    }
+
+    static sample bench_ping_pong(const options& opts,
+                                  uint64_t& instructions, double& calls)
+    {
+        const int64_t n = 1000000;
+        instructions = uint64_t(2 * (3 * n + 3));
+        calls = double(2 * n);
+
+        kernel_program kernel(opts, ping_pong_source);
+        minivm::program_label_id_t label;
+        kernel.get().get_label_id("ping_pong", label);
+
+        minivm::execution_context ping(kernel.get());
+        minivm::execution_context pong(kernel.get());
+        kernel.prepare(ping, opts);
+        kernel.prepare(pong, opts);
+        ping.get_registers().registers[0].ireg = n;
+        pong.get_registers().registers[0].ireg = n;
+
+        sample s;
+        auto start = bench_clock::now();
+        bool ok = ping.run_from(label) && pong.run_from(label);
+        while (ok && (ping.did_yield() || pong.did_yield()))
+        {
+            if (ping.did_yield()) ok = ping.resume();
+            if (ok && pong.did_yield()) ok = pong.resume();
+        }
+        s.seconds = elapsed(start);
+
+        s.ok = ok && ping.get_registers().registers[0].ireg == n &&
+               pong.get_registers().registers[0].ireg == n;
+        return s;
+    }
+
+    static sample bench_short_batch(const options& opts,
+                                    uint64_t& instructions, double& calls)
+    {
+        const size_t n = 1000000;
+        instructions = 3 * n;
+        calls = double(n);
+
+        kernel_program kernel(opts, short_batch_source);
+        minivm::program_label_id_t label;
+        kernel.get().get_label_id("score", label);
+
+        std::vector<minivm::vm_word_t> args(2 * n);
+        std::vector<minivm::vm_word_t> results(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            args[2 * i].ireg = int64_t(i);
+            args[2 * i + 1].ireg = 3;
+        }
+
+        minivm::execution_context context(kernel.get());
+        kernel.prepare(context, opts);
+
+        sample s;
+        auto start = bench_clock::now();
+        size_t done =
+            context.run_batch(label, args.data(), 2, results.data(), 1, n);
+        s.seconds = elapsed(start);
+
+        s.ok = done == n;
+        for (size_t i = 0; s.ok && i < n; ++i)
+        {
+            s.ok = results[i].ireg == int64_t(i) * 3 + 7;
+        }
+        return s;
+    }
+
+    // Same label as short_batch, called one record at a time with call<R>
+    static sample bench_host_calls(const options& opts,
+                                   uint64_t& instructions, double& calls)
+    {
+        const int64_t n = 1000000;
+        instructions = uint64_t(3 * n);
+        calls = double(n);
+
+        kernel_program kernel(opts, short_batch_source);
+        minivm::program_label_id_t label;
+        kernel.get().get_label_id("score", label);
+
+        minivm::execution_context context(kernel.get());
+        kernel.prepare(context, opts);
+
+        sample s;
+        int64_t sum = 0;
+        auto start = bench_clock::now();
+        for (int64_t i = 0; i < n; ++i)
+        {
+            sum += context.call<int64_t>(label, i, int64_t(3));
+        }
+        s.seconds = elapsed(start);
+
+        s.ok = !context.get_error() && sum == 3 * (n * (n - 1) / 2) + 7 * n;
+        return s;
+    }
+
+    static sample bench_poly(const options& opts, bool lanes,
+                             uint64_t& instructions, double& calls)
+    {
+        const size_t n = 1000000;
+        instructions = 11 * n;
+        calls = double(n);
+
+        kernel_program kernel(opts, poly_source);
+        minivm::program_label_id_t label;
+        kernel.get().get_label_id("poly", label);
+
+        std::vector<minivm::vm_word_t> args(n);
+        std::vector<minivm::vm_word_t> results(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            args[i].freg = double(i) * 0.001;
+        }
+
+        minivm::execution_context context(kernel.get());
+        kernel.prepare(context, opts);
+        minivm::lane_executor executor(context);
+
+        sample s;
+        auto start = bench_clock::now();
+        size_t done =
+            lanes ? executor.run(label, args.data(), 1, results.data(), 1, n)
+                  : context.run_batch(label, args.data(), 1, results.data(),
+                                      1, n);
+        s.seconds = elapsed(start);
+
+        s.ok = done == n;
+        for (size_t i = 0; s.ok && i < n; ++i)
+        {
+            double x = args[i].freg;
+            double expected = ((0.25 * x - 1.5) * x + 2.0) * x + 0.5;
+            s.ok = fabs(results[i].freg - expected) <= 1e-9 * fabs(expected);
+        }
+        return s;
+    }
+
+    static sample bench_poly_batch(const options& opts,
+                                   uint64_t& instructions, double& calls)
+    {
+        return bench_poly(opts, false, instructions, calls);
+    }
+
+    static sample bench_poly_lanes(const options& opts,
+                                   uint64_t& instructions, double& calls)
+    {
+        return bench_poly(opts, true, instructions, calls);
+    }
+
+    static sample bench_assembler(size_t megabytes, double& mb)
+    {
+        std::string src = generate_assembly(megabytes * 1024 * 1024);
+        mb = double(src.size()) / (1024 * 1024);
+
+        minivm::program program;
+        sample s;
+        auto start = bench_clock::now();
+        s.ok = program.load_assembly(src);
+        s.seconds = elapsed(start);
+        return s;
+    }
+
+    typedef sample (*kernel_fn)(const options&, uint64_t&, double&);
+
+    struct kernel
+    {
+        const char* name;
+        kernel_fn fn;
+        const char* unit;
+    };
+
+    static const kernel kernels[] = {
+        {"fib", &bench_fib, "calls"},
+        {"nested_loops", &bench_nested_loops, nullptr},
+        {"nbody", &bench_nbody, nullptr},
+        {"particles", &bench_particles, nullptr},
+        {"stack_sort", &bench_stack_sort, nullptr},
+        {"buffer_sum", &bench_buffer_sum_checked, nullptr},
+        {"buffer_unchecked", &bench_buffer_unchecked, nullptr},
+        {"extern_calls", &bench_extern_calls, "calls"},
+        {"ping_pong", &bench_ping_pong, "resumes"},
+        {"short_batch", &bench_short_batch, "calls"},
+        {"host_calls", &bench_host_calls, "calls"},
+        {"poly_batch", &bench_poly_batch, "calls"},
+        {"poly_lanes", &bench_poly_lanes, "calls"},
+    };
+
+    static bool selected(const options& opts, std::string_view name)
+    {
+        if (opts.filters.empty()) return true;
+        return std::find(opts.filters.begin(), opts.filters.end(), name) !=
+               opts.filters.end();
+    }
+
+    // Keeps the fastest of opts.repeat runs
+    template <typename F>
+    static bool best_of(const options& opts, const char* name, double& best,
+                        F&& run)
+    {
+        best = 0;
+        for (int i = 0; i < opts.repeat; ++i)
+        {
+            sample s = run();
+            if (!s.ok)
+            {
+                fprintf(stderr, "%s produced the wrong result\n", name);
+                return false;
+            }
+
+            if (i == 0 || s.seconds < best) best = s.seconds;
+        }
+        return true;
+    }
+
+    static void print_results(const options& opts,
+                              const std::vector<result>& results)
+    {
+        if (opts.json)
+        {
+            printf("{\n  \"mode\": \"%s\",\n  \"results\": [",
+                   opts.jit ? "jit" : "interpreter");
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                auto& r = results[i];
+                printf("%s\n    {\"name\": \"%s\", \"seconds\": %.9f",
+                       i ? "," : "", r.name.c_str(), r.seconds);
+                if (r.instructions)
+                {
+                    printf(", \"instructions\": %llu, \"ns_per_instruction\": "
+                           "%.4f",
+                           (unsigned long long)r.instructions,
+                           r.seconds * 1e9 / double(r.instructions));
+                }
+
+                if (r.unit)
+                {
+                    printf(", \"%s_per_second\": %.2f", r.unit,
+                           r.units / r.seconds);
+                }
+                printf("}");
+            }
+            printf("\n  ]\n}\n");
+            return;
+        }
+
+        printf("%-16s %10s %14s %10s %16s\n", "benchmark", "seconds",
+               "instructions", "ns/instr", "rate");
+        for (auto& r : results)
+        {
+            printf("%-16s %10.4f", r.name.c_str(), r.seconds);
+            if (r.instructions)
+            {
+                printf(" %14llu %10.3f", (unsigned long long)r.instructions,
+                       r.seconds * 1e9 / double(r.instructions));
+            }
+            else
+            {
+                printf(" %14s %10s", "-", "-");
+            }
+
+            if (r.unit)
+            {
+                printf(" %16.0f %s/s", r.units / r.seconds, r.unit);
+            }
+            printf("\n");
+        }
+    }
+
+    static int run(const options& opts)
+    {
+        std::vector<result> results;
+        for (auto& k : kernels)
+        {
+            if (!selected(opts, k.name)) continue;
+
+            uint64_t instructions = 0;
+            double units = 0;
+            double seconds;
+            bool ok = best_of(opts, k.name, seconds,
+                              [&] { return k.fn(opts, instructions, units); });
+            if (!ok) return 2;
+
+            results.push_back({k.name, seconds, instructions, units, k.unit});
+        }
+
+        for (size_t megabytes : {1, 16})
+        {
+            std::string name = "assembler_" + std::to_string(megabytes) + "mb";
+            if (!selected(opts, name) && !selected(opts, "assembler")) continue;
+
+            double mb = 0;
+            double seconds;
+            bool ok = best_of(opts, name.c_str(), seconds,
+                              [&] { return bench_assembler(megabytes, mb); });
+            if (!ok) return 2;
+
+            results.push_back({name, seconds, 0, mb, "mb"});
+        }
+
+        print_results(opts, results);
+        return 0;
+    }
+}  // namespace minivm_bench
+
+int main(int argc, char** argv)
+{
+    minivm_bench::options opts;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "--json")
+        {
+            opts.json = true;
+        }
+        else if (arg == "--jit")
+        {
+            opts.jit = true;
+        }
+        else if (arg == "--repeat" && i + 1 < argc)
+        {
+            opts.repeat = std::max(1, atoi(argv[++i]));
+        }
+        else
+        {
+            opts.filters.push_back(arg);
+        }
+    }
+    return minivm_bench::run(opts);
+}
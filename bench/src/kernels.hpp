@@ -0,0 +1,322 @@
+#pragma once
+
+namespace minivm_bench
+{
+    // fib(r0), recursively.  r8 and r9 are callee-saved, so the save masks
+    // get exercised as well as call and ret.
+    static const char* const fib_source = R"(
+.fib
+    loadc r1 i2
+    jlti r0 r1 .fib_base
+    mov r8 r0
+    subi r0 r8 i1
+    call .fib
+    mov r9 r0
+    subi r0 r8 i2
+    call .fib
+    addi r0 r0 r9
+    ret
+.fib_base
+    ret
+)";
+
+    // Sum of i * j for i, j < r0
+    static const char* const nested_loops_source = R"(
+.nested_loops
+    loadc r1 i0
+    loadc r2 i0
+.outer
+    loadc r3 i0
+.inner
+    muli r4 r2 r3
+    addi r1 r1 r4
+    addi r3 r3 i1
+    jlti r3 r0 .inner
+    addi r2 r2 i1
+    jlti r2 r0 .outer
+    mov r0 r1
+    ret
+)";
+
+    // r0 steps of a 2D n-body simulation of four bodies kept on the stack as
+    // {x, y, vx, vy}.  Returns the final x of the first body.
+    static const char* const nbody_source = R"(
+.nbody 128
+    loadc r2 i4
+    loadc r14 f0.0
+    loadc r1 i0
+.init
+    muli r3 r1 i32
+    itof r4 r1
+    sstore r4 r3
+    addi r3 r3 i8
+    mulf r5 r4 r4
+    sstore r5 r3
+    addi r3 r3 i8
+    sstore r14 r3
+    addi r3 r3 i8
+    sstore r14 r3
+    addi r1 r1 i1
+    jlti r1 r2 .init
+
+    loadc r13 i0
+.step
+    loadc r1 i0
+.body
+    muli r3 r1 i32
+    sload r4 r3
+    addi r5 r3 i8
+    sload r5 r5
+    mov r6 r14
+    mov r7 r14
+    loadc r8 i0
+.pair
+    cmp r8 r1
+    jeq .next_pair
+    muli r9 r8 i32
+    sload r10 r9
+    subf r10 r10 r4
+    addi r9 r9 i8
+    sload r11 r9
+    subf r11 r11 r5
+    mulf r12 r10 r10
+    mulf r9 r11 r11
+    addf r12 r12 r9
+    addf r12 r12 f0.01
+    divf r10 r10 r12
+    divf r11 r11 r12
+    addf r6 r6 r10
+    addf r7 r7 r11
+.next_pair
+    addi r8 r8 i1
+    jlti r8 r2 .pair
+
+    addi r9 r3 i16
+    sload r10 r9
+    mulf r6 r6 f0.001
+    addf r10 r10 r6
+    sstore r10 r9
+    addi r9 r3 i24
+    sload r10 r9
+    mulf r7 r7 f0.001
+    addf r10 r10 r7
+    sstore r10 r9
+    addi r1 r1 i1
+    jlti r1 r2 .body
+
+    loadc r1 i0
+.move
+    muli r3 r1 i32
+    addi r9 r3 i16
+    sload r4 r3
+    sload r10 r9
+    mulf r10 r10 f0.001
+    addf r4 r4 r10
+    sstore r4 r3
+    addi r3 r3 i8
+    addi r9 r9 i8
+    sload r4 r3
+    sload r10 r9
+    mulf r10 r10 f0.001
+    addf r4 r4 r10
+    sstore r4 r3
+    addi r1 r1 i1
+    jlti r1 r2 .move
+
+    addi r13 r13 i1
+    jlti r13 r0 .step
+
+    loadc r3 i0
+    sload r0 r3
+    ret
+)";
+
+    // r1 rounds of filling r0 (at most 512) stack slots from an LCG and
+    // insertion sorting them.  Returns the sum of a[i] * (i + 1) over the
+    // sorted array.
+    static const char* const stack_sort_source = R"(
+.stack_sort 4096
+    loadc r7 i0
+    loadc r12 i0
+.round
+    loadc r2 u12345
+    loadc r3 i0
+.fill
+    mulu r2 r2 u1103515245
+    addu r2 r2 u12345
+    muli r4 r3 i8
+    sstore r2 r4
+    addi r3 r3 i1
+    jlti r3 r0 .fill
+
+    loadc r3 i1
+.sort_outer
+    muli r4 r3 i8
+    sload r5 r4
+    mov r6 r3
+.sort_inner
+    jlei r6 r7 .place
+    subi r8 r6 i1
+    muli r8 r8 i8
+    sload r9 r8
+    jleu r9 r5 .place
+    muli r10 r6 i8
+    sstore r9 r10
+    subi r6 r6 i1
+    jump .sort_inner
+.place
+    muli r10 r6 i8
+    sstore r5 r10
+    addi r3 r3 i1
+    jlti r3 r0 .sort_outer
+
+    addi r12 r12 i1
+    jlti r12 r1 .round
+
+    loadc r11 u0
+    loadc r3 i0
+.checksum
+    muli r4 r3 i8
+    sload r5 r4
+    addi r3 r3 i1
+    mulu r5 r5 r3
+    addu r11 r11 r5
+    jlti r3 r0 .checksum
+    mov r0 r11
+    ret
+)";
+
+    // Sums the 4096 u64s of the host buffer at r0, r1 times, reading it in
+    // place two elements at a time
+    static const char* const buffer_sum_source = R"(
+.buffer_sum
+    loadc r2 u0
+    loadc r3 i0
+.round
+    mov r4 r0
+    addi r5 r0 i32768
+.sum
+    mload r6 r4 i0
+    mload r7 r4 i8
+    addu r2 r2 r6
+    addu r2 r2 r7
+    addi r4 r4 i16
+    jltu r4 r5 .sum
+    addi r3 r3 i1
+    jlti r3 r1 .round
+    mov r0 r2
+    ret
+)";
+
+    // Calls @bench_extern r0 times
+    static const char* const extern_calls_source = R"(
+@bench_extern
+.extern_calls
+    loadc r1 i0
+.loop
+    callext @bench_extern
+    addi r1 r1 i1
+    jlti r1 r0 .loop
+    mov r0 r1
+    ret
+)";
+
+    // r0 steps of 64 particles kept on the stack as a packed f64 position
+    // and velocity each, integrated with vector registers.  Every lane of a
+    // particle starts at its index with a velocity of 1.  Returns the sum of
+    // every lane of every position.
+    static const char* const particles_source = R"(
+.particles 4128
+    loadc r1 i0
+    loadc r2 i64
+    loadc r3 f1.0
+    vbroadcastf64 v1 r3
+.init
+    muli r4 r1 i64
+    itof r5 r1
+    vbroadcastf64 v0 r5
+    vsstore v0 r4
+    addi r4 r4 i32
+    vsstore v1 r4
+    addi r1 r1 i1
+    jlti r1 r2 .init
+
+    loadc r3 f0.001
+    vbroadcastf64 v2 r3
+    loadc r3 f-0.0098
+    vbroadcastf64 v3 r3
+    loadc r6 i0
+    loadc r8 i4096
+.step
+    loadc r4 i0
+.particle
+    vsload v0 r4
+    addi r5 r4 i32
+    vsload v1 r5
+    vfmaf64 v0 v1 v2 v0
+    vaddf64 v1 v1 v3
+    vsstore v0 r4
+    vsstore v1 r5
+    addi r4 r4 i64
+    jlti r4 r8 .particle
+    addi r6 r6 i1
+    jlti r6 r0 .step
+
+    loadc r4 i0
+    loadc r5 f0.0
+    vbroadcastf64 v4 r5
+.sum
+    vsload v0 r4
+    vaddf64 v4 v4 v0
+    addi r4 r4 i64
+    jlti r4 r8 .sum
+    vsstore v4 r8
+    sload r0 r8
+    addi r8 r8 i8
+    sload r1 r8
+    addf r0 r0 r1
+    addi r8 r8 i8
+    sload r1 r8
+    addf r0 r0 r1
+    addi r8 r8 i8
+    sload r1 r8
+    addf r0 r0 r1
+    ret
+)";
+
+    // Yields r0 times.  Two contexts running this are resumed alternately.
+    static const char* const ping_pong_source = R"(
+.ping_pong
+    loadc r1 i0
+.loop
+    yield
+    addi r1 r1 i1
+    jlti r1 r0 .loop
+    mov r0 r1
+    ret
+)";
+    // r0 * r1 + 7.  Run once per record of a batch, so it measures the cost
+    // of getting into and out of a label rather than of running one.
+    static const char* const short_batch_source = R"(
+.score
+    muli r0 r0 r1
+    addi r0 r0 i7
+    ret
+)";
+    // ((0.25x - 1.5)x + 2)x + 0.5 for x in r0.  Run over a batch of records,
+    // both one at a time and in lockstep lanes.
+    static const char* const poly_source = R"(
+.poly
+    loadc r1 f0.25
+    mulf r1 r1 r0
+    loadc r2 f-1.5
+    addf r1 r1 r2
+    mulf r1 r1 r0
+    loadc r2 f2.0
+    addf r1 r1 r2
+    mulf r1 r1 r0
+    loadc r2 f0.5
+    addf r0 r1 r2
+    ret
+)";
+}  // namespace minivm_bench
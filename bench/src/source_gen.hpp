@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace minivm_bench
+{
+    // Builds a synthetic mvma source of roughly targetBytes bytes, shaped
+    // like compiler output: many small functions with forward calls and
+    // jumps, inline constants, string literals and extern accesses.
+    inline std::string generate_assembly(size_t targetBytes)
+    {
+        std::string src;
+        src.reserve(targetBytes + 4096);
+        src += "@counter\n$greeting \"Hello from the generator\"\n";
+        src += ".main\n    call .f0\n    ret\n";
+
+        char buf[512];
+        uint32_t fn = 0;
+        for (; src.size() < targetBytes; ++fn)
+        {
+            // Inline constants are shared by spelling, so keep the number of
+            // distinct values well under the 16 bit constant index
+            uint32_t k = fn % 997;
+            int len = snprintf(
+                buf, sizeof(buf),
+                ".f%u\n"
+                "    loadc r0 i%u\n"
+                "    addi r1 r0 i%u\n"
+                "    mulu r2 r1 u%u\n"
+                "    eload r3 @counter\n"
+                "    addf r3 r3 f1.5\n"
+                "    estore r3 @counter\n"
+                "    loadc r4 \"string %u\"\n"
+                "    jump .f%u_end\n"
+                ".f%u_loop\n"
+                "    subi r0 r0 i1\n"
+                "    cmp r0 i0\n"
+                "    jne .f%u_loop\n"
+                ".f%u_end\n"
+                "    call .f%u\n"
+                "    ret\n",
+                fn, k, k + 3, k * 7 + 100000, k % 64, fn, fn, fn, fn, fn + 1);
+            src.append(buf, len);
+        }
+
+        // Terminates the call chain started by the last function
+        int len = snprintf(buf, sizeof(buf), ".f%u\n    ret\n", fn);
+        src.append(buf, len);
+        return src;
+    }
+}  // namespace minivm_bench
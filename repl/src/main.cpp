@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <iostream>
+#include <string_view>
 
+#include <minivm/profiler.hpp>
 #include <minivm/vm.hpp>
 #include <minivm/vm_binding.hpp>
 
@@ -23,14 +25,48 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // repl <input> [--jit] [--profile | --profile-json]
+    //   --jit           runs the program as native code where possible
+    //   --profile       prints an execution profile once the program ends
+    //   --profile-json  prints the profile as JSON instead
+    bool useJit = false;
+    bool profile = false;
+    bool profileJson = false;
+    for (int i = 2; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        useJit |= arg == "--jit";
+        profile |= arg == "--profile" || arg == "--profile-json";
+        profileJson |= arg == "--profile-json";
+    }
+
     minivm::program program;
-    if (!program.load_assembly_from_file(argv[1]))
+    program.set_jit_enabled(useJit);
+
+    std::string_view input = argv[1];
+    bool isBinary = input.size() > 5 && input.substr(input.size() - 5) == ".mvmb";
+
+    bool loaded = isBinary ? program.load_binary_from_file(input)
+                           : program.load_assembly_from_file(input);
+    if (!loaded)
     {
         fprintf(stderr, "Failed to load assembly from file: %s\n",
                 program.get_load_error());
         return 2;
     }
 
+    // repl <input.mvma> -o <output.mvmb> writes a binary image and exits
+    if (argc >= 4 && std::string_view(argv[2]) == "-o")
+    {
+        if (!program.save_binary(argv[3]))
+        {
+            fprintf(stderr, "Failed to write binary image: %s\n",
+                    program.get_load_error());
+            return 2;
+        }
+        return 0;
+    }
+
     // minivm::vm_execution_registers regs;
     // minivm::program_binding::wrapper_fn_generator<void>::call<test>(&regs);
 
@@ -44,6 +80,17 @@ int main(int argc, char** argv)
     MINIVM_BIND_FUNCTION(program, externIntFunc);
 
     minivm::execution_context executor(program);
+    if (useJit)
+    {
+        executor.set_execution_mode(minivm::execution_mode::jit);
+    }
+
+    if (profile && !executor.set_profiling_enabled(true))
+    {
+        fprintf(stderr, "Profiling requires building with MINIVM_PROFILER\n");
+        profile = false;
+    }
+
     if (!executor.run_from("main"))
     {
         if (executor.get_error())
@@ -67,5 +114,12 @@ int main(int argc, char** argv)
     {
         printf("Final value of external variable was %f\n", *externVar);
     }
+
+    if (profile)
+    {
+        auto report = profileJson ? executor.get_profile()->to_json()
+                                  : executor.get_profile()->to_text();
+        fputs(report.c_str(), stdout);
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "vm.hpp"
+
+// Support for programs translated to C++ ahead of time by minivm-aot.  The
+// generated translation unit defines an aot_module, which is registered with
+// the program it was generated from:
+//
+//   MINIVM_DECLARE_AOT_MODULE(my_script);
+//   program.load_assembly_from_file("my_script.mvma");
+//   program.set_aot_module(my_script);
+//
+// After that, run_from and resume execute the generated code instead of
+// interpreting the program.
+namespace minivm
+{
+    // Bumped whenever generated code has to be regenerated
+    static constexpr uint32_t aot_abi_version = 4;
+
+    enum class aot_exit : uint32_t
+    {
+        done,
+        yield,
+        preempt,
+        error,
+
+        // Entered at a pc the module has no entry point for.  The interpreter
+        // runs the program instead.
+        fallback,
+    };
+
+    // State shared between the runtime and generated code for one run
+    struct aot_frame
+    {
+        execution_context* context;
+        vm_execution_registers* registers;
+        program_extern_value* externs;
+        uint8_t* stack;
+
+        // End of the current frame
+        uint64_t stack_top;
+        const char* data;
+        const std::atomic<bool>* interrupt;
+        int64_t budget;
+
+        // The context's copy of the region the last checked memory access
+        // fell in
+        const memory_region* last_region;
+    };
+
+    typedef aot_exit (*aot_entry_t)(aot_frame* frame);
+
+    struct aot_module
+    {
+        uint32_t abi_version;
+        uint32_t opcode_count;
+
+        // Hash of the program the module was generated from.  Modules can
+        // only be registered with an identical program.
+        uint64_t fingerprint;
+        aot_entry_t entry;
+    };
+
+    // Called from generated code
+    class aot_runtime
+    {
+        friend class execution_context;
+
+    public:
+        // Both return false if the callee's frame doesn't fit on the stack
+        static bool call(aot_frame* frame, vm_execution_registers& registers,
+                         uint32_t label);
+        static bool tailcall(aot_frame* frame,
+                             vm_execution_registers& registers,
+                             uint32_t label);
+
+        // Returns false once the outermost frame has returned
+        static bool ret(aot_frame* frame, vm_execution_registers& registers);
+
+        static void missing_extern(aot_frame* frame, uint32_t ext);
+
+        // False if the access doesn't fit in one of the context's memory
+        // regions or writes to a read-only one.  Only asks the context when it doesn't fit in the region
+        // the last access fell in.
+        static inline bool check_memory(aot_frame* frame, uint64_t address,
+                                        uint32_t width, bool write)
+        {
+            auto& region = *frame->last_region;
+            uint64_t offset = address - region.base;
+            if (offset < region.size && width <= region.size - offset &&
+                (!write || region.writable))
+            {
+                return true;
+            }
+            return find_memory(frame, address, width, write);
+        }
+
+        static bool find_memory(aot_frame* frame, uint64_t address,
+                                uint32_t width, bool write);
+
+        static inline double to_double(uint64_t bits)
+        {
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+    private:
+        // Runs the context's module from its current pc.  Returns false if
+        // the interpreter has to take over, otherwise result holds the value
+        // run() should return.
+        static bool run(execution_context* context, bool& result);
+    };
+
+    // Translates a program into a C++ translation unit that defines an
+    // aot_module.  This is what minivm-aot uses.
+    class aot_compiler
+    {
+    public:
+        // symbol is the name of the aot_module the source defines
+        aot_compiler(const program& program, const std::string_view& symbol);
+
+        // Calls to the extern become direct calls to function instead of
+        // going through the extern table.  function must be a global function
+        // with the signature of extern_program_func_t.
+        void bind_extern(const std::string_view& name,
+                         const std::string_view& function);
+
+        bool generate(std::string& source);
+        const char* get_error();
+
+    private:
+        const program& _program;
+        std::string _symbol;
+        std::vector<std::pair<std::string, std::string>> _bindings;
+        std::string _error;
+    };
+}  // namespace minivm
+
+#define MINIVM_DECLARE_AOT_MODULE(symbol) \
+    extern const minivm::aot_module symbol
@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "vm.hpp"
+
+namespace minivm
+{
+    struct context_pool_config
+    {
+        // Applied to every context the pool creates
+        size_t stack_size = execution_context::default_stack_size;
+        bool guarded_stack = false;
+        execution_mode mode = execution_mode::interpreter;
+    };
+
+    // Keeps execution contexts for one program around between runs, so hosts
+    // that run short entry points over and over don't construct a context
+    // (and allocate its stack and buffers) for each of them.  acquire and
+    // release may be called from any thread.
+    //
+    // Contexts are created from a const program, so each has its own copy of
+    // the extern values, taken when the context is created.  Extern values
+    // and memory regions a context is given survive being released and
+    // acquired again.
+    class context_pool
+    {
+    public:
+        context_pool(const program& program,
+                     const context_pool_config& config = context_pool_config());
+        ~context_pool();
+
+        context_pool(const context_pool&) = delete;
+        context_pool& operator=(const context_pool&) = delete;
+
+    public:
+        // Returns an idle context, creating one if there aren't any.  The
+        // context is ready to run, and belongs to the caller until it is
+        // released.
+        execution_context* acquire();
+
+        // Resets a context from acquire() and makes it available again
+        void release(execution_context* context);
+
+        // Creates contexts until at least count exist
+        void reserve(uint32_t count);
+
+        // Number of contexts the pool has created
+        uint32_t get_context_count();
+
+    private:
+        std::unique_ptr<execution_context> create();
+
+    private:
+        const program& _program;
+        context_pool_config _config;
+
+        std::mutex _mutex;
+        std::vector<std::unique_ptr<execution_context>> _contexts;
+        std::vector<execution_context*> _idle;
+    };
+}  // namespace minivm
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include "vm.hpp"
+
+namespace minivm
+{
+    // Runs one label over many records in lockstep, lane_count records at a
+    // time.  The lanes share a single instruction stream and keep their
+    // registers as structure-of-arrays, so each arithmetic instruction is
+    // dispatched once and applied to every lane with vector instructions
+    // (AVX2 when the host supports it).
+    //
+    // Only instructions without side effects run in lockstep: arithmetic,
+    // conversions, compares, branches and loads of constants and externs.
+    // When the lanes take different sides of a branch, or reach any other
+    // instruction (calls, stack accesses, estore...), each lane is finished
+    // one at a time by the context's scalar interpreter from that point, so
+    // every label gives the same results it would through run_batch.
+    class lane_executor
+    {
+    public:
+        static constexpr uint32_t lane_count = 8;
+
+        // Lanes read the context's externs, and the context runs any lanes
+        // that leave lockstep
+        explicit lane_executor(execution_context& context);
+
+        // Same contract as execution_context::run_batch.  Registers past
+        // argCount start with the values the context's registers had when
+        // run was called.
+        size_t run(program_label_id_t label, const vm_word_t* args,
+                   uint32_t argCount, vm_word_t* results,
+                   uint32_t resultCount, size_t count);
+
+        // Records that returned in lockstep, and records that were finished
+        // by the scalar interpreter
+        uint64_t get_lockstep_count() const;
+        uint64_t get_scalar_count() const;
+
+        // "avx2" or "generic"
+        const char* get_isa() const;
+
+    private:
+        // What the lanes read from the program and context
+        struct lane_code;
+
+        // Runs the lanes from pc until they return (true) or have to leave
+        // lockstep (false, with pc set to where they stopped)
+        typedef bool (*lockstep_fn)(lane_executor& executor,
+                                    const lane_code& code, uint32_t& pc);
+
+        friend struct lane_kernels;
+
+        bool finish_scalar(program_label_id_t label, uint32_t lane,
+                           uint32_t pc);
+
+    private:
+        execution_context& _context;
+        lockstep_fn _lockstep;
+        const char* _isa;
+
+        alignas(32) vm_word_t _registers[16][lane_count];
+        uint32_t _cmp[lane_count];
+
+        uint64_t _lockstepCount;
+        uint64_t _scalarCount;
+    };
+}  // namespace minivm
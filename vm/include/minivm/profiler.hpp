@@ -0,0 +1,94 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "vm.hpp"
+
+namespace minivm
+{
+    struct label_profile
+    {
+        // Times the label was entered through run_from, call or tailcall
+        uint64_t calls = 0;
+
+        // Instructions dispatched between this label and the next one
+        uint64_t instructions = 0;
+
+        // Time spent in the label including and excluding its callees.  Time
+        // spent in externs is excluded from both, and time spent suspended
+        // (yielded or preempted) isn't counted at all.
+        uint64_t inclusive_ns = 0;
+        uint64_t exclusive_ns = 0;
+    };
+
+    struct extern_profile
+    {
+        uint64_t calls = 0;
+        uint64_t ns = 0;
+    };
+
+    // Counts and timings collected while an execution_context runs with
+    // profiling enabled.  Superinstructions are dispatched (and counted) once
+    // rather than once per instruction they replace.
+    class execution_profile
+    {
+        friend class execution_context;
+
+    public:
+        explicit execution_profile(const program& program);
+
+        void reset();
+
+        // Dispatch counts indexed by pc
+        const std::vector<uint64_t>& get_opcode_counts() const;
+        uint64_t get_instruction_count(instruction instr) const;
+
+        // Indexed by label and extern id
+        const std::vector<label_profile>& get_labels() const;
+        const std::vector<extern_profile>& get_externs() const;
+
+        std::string to_text() const;
+        std::string to_json() const;
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct frame
+        {
+            uint32_t label;
+            uint64_t start;
+            uint64_t children;
+        };
+
+        inline void count(uint32_t pc, instruction instr)
+        {
+            ++_opcodeCounts[pc];
+            ++_instructionCounts[static_cast<size_t>(instr)];
+        }
+
+        // Time in nanoseconds that the context has spent executing
+        uint64_t now() const;
+        void resume();
+        void pause();
+
+        void enter(uint32_t label);
+        void leave();
+        void replace(uint32_t label);
+        void record_extern(uint32_t ext, uint64_t start);
+
+        void update_label_instructions() const;
+
+    private:
+        const program& _program;
+        std::vector<uint64_t> _opcodeCounts;
+        std::vector<uint64_t> _instructionCounts;
+        mutable std::vector<label_profile> _labels;
+        std::vector<extern_profile> _externs;
+        std::vector<frame> _frames;
+
+        uint64_t _elapsed;
+        clock::time_point _resumed;
+        bool _running;
+    };
+}  // namespace minivm
@@ -0,0 +1,97 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "vm.hpp"
+
+namespace minivm
+{
+    struct scheduler_config
+    {
+        // 0 uses one worker per hardware thread
+        uint32_t thread_count = 0;
+
+        // Pins worker i to core i (modulo the core count).  Only supported
+        // on Linux, ignored elsewhere.
+        bool pin_threads = false;
+
+        // Instruction budget for each turn a context gets on a worker.
+        // Contexts that use it up are requeued like ones that yield.
+        uint64_t time_slice = execution_context::unlimited_budget;
+    };
+
+    // Runs execution contexts on a pool of worker threads.  Each worker owns
+    // a deque of runnable contexts and takes work from the front of it.
+    // Contexts that yield go to the back of the deque of the worker that ran
+    // them, and idle workers steal half of another worker's deque.
+    //
+    // Contexts are not owned by the scheduler and must outlive it (or at
+    // least wait_idle()).  Contexts that share a program should use
+    // extern_storage::per_context.
+    class scheduler
+    {
+    public:
+        scheduler(const scheduler_config& config = scheduler_config());
+        ~scheduler();
+
+        scheduler(const scheduler&) = delete;
+        scheduler& operator=(const scheduler&) = delete;
+
+    public:
+        // Queues a context to start running at entry.  Any thread may submit.
+        void submit(execution_context* context, program_label_id_t entry);
+
+        // Moves contexts that have returned or failed since the last call
+        // into finished.  Failed contexts have a non-null get_error().
+        void collect(std::vector<execution_context*>& finished);
+
+        // Blocks until every submitted context has finished
+        void wait_idle();
+
+        uint32_t get_thread_count() const;
+
+    private:
+        struct task
+        {
+            execution_context* context;
+            program_label_id_t entry;
+            bool started;
+        };
+
+        struct worker_queue
+        {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        void worker_main(uint32_t index);
+        bool pop_local(uint32_t index, task& out);
+        bool steal(uint32_t index, task& out);
+        void push(uint32_t index, const task& work);
+        void finish(execution_context* context);
+
+    private:
+        std::vector<std::unique_ptr<worker_queue>> _queues;
+        std::vector<std::thread> _threads;
+
+        // Tasks sitting in a deque.  Idle workers sleep until it is non-zero.
+        std::atomic<size_t> _queued;
+        std::mutex _wakeMutex;
+        std::condition_variable _wake;
+        bool _stopping;
+
+        // Tasks submitted but not yet finished
+        size_t _pending;
+        std::vector<execution_context*> _finished;
+        std::mutex _finishedMutex;
+        std::condition_variable _idle;
+
+        std::atomic<uint32_t> _nextQueue;
+        uint64_t _timeSlice;
+    };
+}  // namespace minivm
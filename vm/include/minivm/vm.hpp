@@ -1,5 +1,7 @@
 #pragma once
 #include <stdint.h>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <type_traits>
@@ -38,6 +40,25 @@ namespace minivm
         sloadi8,
         sloadf32,
 
+        // Host memory stores and loads.  The address is a pointer register
+        // plus a signed 16 bit immediate offset.
+        mstore,
+        mstoreu32,
+        mstoreu16,
+        mstoreu8,
+        mstorei32,
+        mstorei16,
+        mstorei8,
+        mstoref32,
+        mload,
+        mloadu32,
+        mloadu16,
+        mloadu8,
+        mloadi32,
+        mloadi16,
+        mloadi8,
+        mloadf32,
+
         // arithmetic
         addi,
         addu,
@@ -52,6 +73,32 @@ namespace minivm
         divu,
         divf,
 
+        // arithmetic with an immediate operand packed into the opcode.  The
+        // assembler selects these when the literal fits in 16 bits.
+        addi_imm,
+        addu_imm,
+        subi_imm,
+        subu_imm,
+        muli_imm,
+        mulu_imm,
+        divi_imm,
+        divu_imm,
+
+        // arithmetic with a constant table operand, used for literals that
+        // don't fit in an immediate and for named constants
+        addi_const,
+        addu_const,
+        addf_const,
+        subi_const,
+        subu_const,
+        subf_const,
+        muli_const,
+        mulu_const,
+        mulf_const,
+        divi_const,
+        divu_const,
+        divf_const,
+
         // register manipulation
         mov,
         utoi,
@@ -69,19 +116,162 @@ namespace minivm
 
         // control flow
         cmp,
+        cmp_imm,
+        cmp_const,
         jump,
         jeq,
         jne,
 
+        // compare two registers and branch if the condition holds
+        jlti,
+        jlei,
+        jgti,
+        jgei,
+        jltu,
+        jleu,
+        jgtu,
+        jgeu,
+        jltf,
+        jlef,
+        jgtf,
+        jgef,
+        jeqf,
+        jnef,
+
         // execution
         call,
+        tailcall,
         callext,
         yield,
         ret,
 
+        // Packed arithmetic on vector registers.  The f32 and i32 forms work
+        // on 8 lanes and the f64 forms on 4.  i32 arithmetic wraps, and i32
+        // lanes divided by zero give 0.  fma computes a * b + c.
+        vaddf32,
+        vsubf32,
+        vmulf32,
+        vdivf32,
+        vfmaf32,
+        vaddf64,
+        vsubf64,
+        vmulf64,
+        vdivf64,
+        vfmaf64,
+        vaddi32,
+        vsubi32,
+        vmuli32,
+        vdivi32,
+        vfmai32,
+
+        // vector register manipulation.  Broadcasts fill every lane from a
+        // register, and shuffles pick a source lane for each destination
+        // lane from a register holding one index per nibble.
+        vmov,
+        vbroadcastf32,
+        vbroadcastf64,
+        vbroadcasti32,
+        vshuf32,
+        vshuf64,
+
+        // Vector stack frame stores and loads, 32 bytes or the low 16 bytes
+        // of the register.  128 bit loads clear the upper half.
+        vsstore,
+        vsstore128,
+        vsload,
+        vsload128,
+
+        // Appended after the last instruction by the loader so that the
+        // dispatch loop never has to bounds check pc.
+        halt,
+
+        // Internal instructions.  These are never produced by the assembler,
+        // only when a program is finalized.
+
+        // loadc of a constant that lives in static data.  The offset is
+        // added to the data base when executed.
+        loadc_data,
+
+        // Stack accesses the verifier couldn't prove stay inside the frame.
+        // Same operands as sstore through sloadf32 and vsstore through
+        // vsload128, plus a bounds check.
+        sstore_checked,
+        sstoreu32_checked,
+        sstoreu16_checked,
+        sstoreu8_checked,
+        sstorei32_checked,
+        sstorei16_checked,
+        sstorei8_checked,
+        sstoref32_checked,
+        sload_checked,
+        sloadu32_checked,
+        sloadu16_checked,
+        sloadu8_checked,
+        sloadi32_checked,
+        sloadi16_checked,
+        sloadi8_checked,
+        sloadf32_checked,
+        vsstore_checked,
+        vsstore128_checked,
+        vsload_checked,
+        vsload128_checked,
+
+        // Host memory accesses checked against the context's memory regions.
+        // Same operands as mstore through mloadf32.
+        mstore_checked,
+        mstoreu32_checked,
+        mstoreu16_checked,
+        mstoreu8_checked,
+        mstorei32_checked,
+        mstorei16_checked,
+        mstorei8_checked,
+        mstoref32_checked,
+        mload_checked,
+        mloadu32_checked,
+        mloadu16_checked,
+        mloadu8_checked,
+        mloadi32_checked,
+        mloadi16_checked,
+        mloadi8_checked,
+        mloadf32_checked,
+
+        // Superinstructions produced by the fusion pass
+        loadc_addi,
+        loadc_addu,
+        loadc_addf,
+        loadc_subi,
+        loadc_subu,
+        loadc_subf,
+        loadc_muli,
+        loadc_mulu,
+        loadc_mulf,
+        eload_addi,
+        eload_addu,
+        eload_addf,
+        eload_subi,
+        eload_subu,
+        eload_subf,
+        eload_muli,
+        eload_mulu,
+        eload_mulf,
+        cmp_jeq,
+        cmp_jne,
+        loadc_cmp_jeq,
+        loadc_cmp_jne,
+        addi_cmp_jeq,
+        addi_cmp_jne,
+        addu_cmp_jeq,
+        addu_cmp_jne,
+        addi_imm_cmp_jeq,
+        addi_imm_cmp_jne,
+        cmp_imm_jeq,
+        cmp_imm_jne,
+
         Count
     };
 
+    const char* get_instruction_name(instruction instr);
+
     struct opcode
     {
         union
@@ -96,7 +286,52 @@ namespace minivm
             uint32_t warg0;
         };
         uint16_t arg1;
-        instruction instruction;
+        minivm::instruction instruction;
+    };
+
+    // Compare-and-branch instructions keep their registers in the low half
+    // of warg0, so their label index is split between arg1 (the low 16
+    // bits) and the high half of warg0
+    inline uint32_t get_branch_label(const opcode& op)
+    {
+        return uint32_t(op.arg1) | (op.warg0 & 0xFFFF0000u);
+    }
+
+    inline void set_branch_label(opcode& op, uint32_t label)
+    {
+        op.arg1 = uint16_t(label);
+        op.warg0 = (op.warg0 & 0xFFFFu) | (label & 0xFFFF0000u);
+    }
+
+    // Execution-ready form of an opcode.  program lowers its opcodes into
+    // these once loading finishes so the interpreter never has to unpack
+    // bitfields or look up labels at runtime.
+    struct decoded_opcode
+    {
+        // Threaded dispatch target, or null when using switch dispatch
+        const void* handler;
+
+        // Constant, extern, or label index depending on the instruction, or
+        // the sign/zero extended value for immediate forms
+        uint32_t arg;
+
+        // Absolute instruction index for jumps and calls
+        uint32_t target;
+
+        uint8_t reg0;
+        uint8_t reg1;
+        uint8_t reg2;
+        uint8_t reg3;
+        uint8_t reg4;
+        minivm::instruction instruction;
+    };
+
+    // Records a superinstruction produced when the program was finalized
+    struct program_fusion
+    {
+        // Index of the first instruction covered by the fused instruction
+        uint32_t pc;
+        minivm::instruction fused;
     };
 
     struct vm_word_t
@@ -109,6 +344,18 @@ namespace minivm
         };
     };
 
+    // Contents of a vector register
+    struct alignas(32) vm_vector_t
+    {
+        union
+        {
+            float f32[8];
+            double f64[4];
+            int32_t i32[8];
+            uint64_t u64[4];
+        };
+    };
+
     struct program_extern_value
     {
         vm_word_t value;
@@ -118,9 +365,11 @@ namespace minivm
     {
         constant_value();
 
+        // When set, value is an offset into the program's static data rather
+        // than a pointer, which keeps programs relocatable.  It is turned into
+        // a pointer when the constant is loaded.
         vm_word_t value;
         bool is_data_offset;
-        bool is_pointer;
 
         inline void set(uint64_t val)
         {
@@ -140,14 +389,19 @@ namespace minivm
 
     struct program_label
     {
-        union
-        {
-            uint64_t offset;
-            const char* name;
-        };
-
+        // Offset of the label's name in the program's static data
+        uint32_t name;
         uint32_t pc;
+
+        // Size of the frame entering the label allocates.  The verifier
+        // raises this for labels inside another label's code, so entering
+        // one directly never gives that code a smaller frame than it was
+        // verified against.
         uint32_t stackalloc;
+
+        // Callee-saved registers (r8-r15) that code reachable from this label
+        // may write.  Only these are preserved when the label is called.
+        uint16_t save_mask;
     };
 
     struct program_label_id_t
@@ -177,22 +431,118 @@ namespace minivm
         vm_word_t registers[16];
         vm_word_t result;
         uint32_t pc;
+
+        // Non-zero if the operands of the last cmp were not equal
         uint32_t cmp;
         uint32_t sp;
     };
 
     typedef void (*extern_program_func_t)(vm_execution_registers* registers);
 
+    // Open addressing hash table from names in a program's static data to
+    // label or extern indices.  Entries store offsets rather than pointers so
+    // the table stays valid when the program is copied, and lookups take a
+    // string_view without allocating.
+    class name_table
+    {
+    public:
+        // Empties the table and sizes it for count names
+        void reset(size_t count);
+        void insert(const char* data, uint32_t name, uint32_t idx);
+        bool find(const char* data, const std::string_view& name,
+                  uint32_t& idx) const;
+
+    private:
+        struct entry
+        {
+            uint32_t hash;
+            uint32_t name;
+            uint32_t idx;
+        };
+
+        static constexpr uint32_t empty = UINT32_MAX;
+
+        std::vector<entry> _entries;
+    };
+
+    // Backing storage for a program loaded from a binary image.  The opcode
+    // and static data sections point directly into the mapped file (or the
+    // memory handed to program::load_binary) rather than being copied.
+    struct program_image
+    {
+        program_image() = default;
+        program_image(const program_image&) = delete;
+        program_image& operator=(const program_image&) = delete;
+        ~program_image();
+
+        const opcode* opcodes = nullptr;
+        size_t opcode_count = 0;
+        const char* data = nullptr;
+        size_t data_size = 0;
+
+        // Set when the image owns a file mapping
+        void* mapping = nullptr;
+        size_t mapping_size = 0;
+
+        // Used instead of a mapping on platforms without mmap
+        std::vector<char> buffer;
+    };
+
+    // Machine code generated for a program by the JIT
+    struct native_code;
+
+    // A program translated to C++ by minivm-aot, see aot.hpp
+    struct aot_module;
+
+    // See profiler.hpp
+    class execution_profile;
+
     class program
     {
         friend class asm_parser;
         friend class execution_context;
+        friend struct native_runtime;
+        friend class aot_runtime;
+        friend class aot_compiler;
+        friend class execution_profile;
+        friend class lane_executor;
 
     public:
         bool load_assembly(const std::string_view& mvmaSrc);
         bool load_assembly_from_file(const std::string_view& filename);
         const char* get_load_error();
 
+        // Binary images (.mvmb) skip the assembler entirely.  Loading one from
+        // a file maps it into memory and uses its opcodes and static data in
+        // place, so many processes can share the same pages.
+        bool save_binary(const std::string_view& filename);
+        bool load_binary_from_file(const std::string_view& filename);
+
+        // data must outlive the program
+        bool load_binary(const void* data, size_t size);
+
+        // Superinstruction fusion runs when loading finishes and is enabled by
+        // default.  Disabling it only affects programs loaded afterwards.
+        void set_superinstructions_enabled(bool enabled);
+        const std::vector<program_fusion>& get_fusions() const;
+
+        // Compiles programs to x86-64 machine code when loading finishes.
+        // Disabled by default, and only affects programs loaded afterwards.
+        // has_native_code() is false on platforms without a JIT.
+        void set_jit_enabled(bool enabled);
+        bool has_native_code() const;
+
+        // mload and mstore are checked against the memory regions registered
+        // with the context running them unless this is disabled, in which
+        // case they access any address they're given.  Enabled by default,
+        // and only affects programs loaded afterwards.
+        void set_memory_checks_enabled(bool enabled);
+
+        // Runs the program through code generated from it by minivm-aot.
+        // Fails if the module was generated from a different program.  The
+        // module is dropped when the program is reloaded.
+        bool set_aot_module(const aot_module& module);
+
     public:
         template <typename T>
         inline bool set_extern_pointer(const std::string_view& name, T* ptr)
@@ -224,76 +574,359 @@ namespace minivm
 
         bool get_extern_ptr(const std::string_view& name, double** value);
 
+    public:
+        // Resolving a name to an id once and using the id afterwards avoids
+        // any hashing or allocation on hot paths.  Ids stay valid until the
+        // program is reloaded.
+        bool get_label_id(const std::string_view& name,
+                          program_label_id_t& id) const;
+        bool get_extern_id(const std::string_view& name,
+                           program_extern_id_t& id) const;
+
+        const char* get_label_name(program_label_id_t id) const;
+        const char* get_extern_name(program_extern_id_t id) const;
+
+        template <typename T>
+        inline void set_extern_pointer(program_extern_id_t id, T* ptr)
+        {
+            set_unsigned_extern(id, reinterpret_cast<size_t>(ptr));
+        }
+
+        void set_extern_function_ptr(program_extern_id_t id,
+                                     extern_program_func_t func);
+
+        void set_unsigned_extern(program_extern_id_t id, uint64_t value);
+        void set_signed_extern(program_extern_id_t id, int64_t value);
+        void set_floating_extern(program_extern_id_t id, double value);
+
+        uint64_t* get_unsigned_extern_ptr(program_extern_id_t id);
+        int64_t* get_signed_extern_ptr(program_extern_id_t id);
+        double* get_floating_extern_ptr(program_extern_id_t id);
+
     private:
-        uint32_t write_static_string(const std::string_view& string);
+        bool load_image(std::shared_ptr<program_image> image,
+                        const char* base, size_t size);
+        const opcode* get_opcodes() const;
+        size_t get_opcode_count() const;
+        const char* get_data() const;
 
     private:
-        program_label_id_t get_label_id(const std::string_view& label);
-        program_label& get_label(const std::string_view& label);
-        program_label& get_label(program_label_id_t);
+        uint32_t write_static_string(const std::string_view& string);
+        bool finalize();
+
+        // Drops everything loaded and derived from it.  Loaders call this
+        // first and again on failure, so a failed load leaves an empty
+        // program rather than a half-replaced one.
+        void clear();
+        bool verify(std::vector<bool>& checkedAccesses);
+        void compute_save_masks();
+        void fuse_superinstructions();
+        void build_name_tables();
+        uint64_t compute_fingerprint() const;
 
     private:
-        program_extern_id_t get_extern_id(const std::string_view& label);
-        program_extern_value& get_extern(const std::string_view& label);
+        program_label& get_label(program_label_id_t);
+        const program_label& get_label(program_label_id_t) const;
         program_extern_value& get_extern(program_extern_id_t);
 
     private:
         std::string load_error;
         std::vector<char> _data;
+        std::shared_ptr<const program_image> _image;
         std::vector<constant_value> constants;
         std::vector<opcode> opcodes;
-        std::unordered_map<std::string, program_label_id_t> label_map;
+        std::vector<decoded_opcode> _code;
+        std::vector<program_fusion> _fusions;
+        bool _fuse = true;
+        bool _checkMemory = true;
+        std::shared_ptr<const native_code> _native;
+        bool _jit = false;
+        const aot_module* _aot = nullptr;
         std::vector<program_label> labels;
-        std::unordered_map<std::string, program_extern_id_t> extern_map;
+        name_table _label_table;
+
+        // Offsets of extern names in static data
+        std::vector<uint32_t> extern_names;
         std::vector<program_extern_value> externs;
+        name_table _extern_table;
     };
 
+    // Fixed-size, page-aligned memory holding a context's stack frames.  It
+    // never moves once allocated, so frames are allocated by bumping an
+    // offset and running code can keep a pointer to it.
+    class vm_stack
+    {
+    public:
+        vm_stack() = default;
+        vm_stack(const vm_stack&) = delete;
+        vm_stack& operator=(const vm_stack&) = delete;
+        ~vm_stack();
+
+        // Replaces the current memory, rounding size up to whole pages.
+        // Guarded stacks are mapped with an inaccessible page after the last
+        // one where the platform supports it.
+        bool allocate(size_t size, bool guarded);
+        void release();
+
+        inline uint8_t* data() const
+        {
+            return _base;
+        }
+
+        inline size_t size() const
+        {
+            return _size;
+        }
+
+    private:
+        uint8_t* _base = nullptr;
+        size_t _size = 0;
+
+        // Bytes mapped including the guard page, or 0 for heap memory
+        size_t _mapped = 0;
+    };
+
+    // Calling convention:
+    //   r0-r7   arguments and results, clobbered by calls
+    //   r8-r15  callee-saved, preserved across calls made by VM code
+    // The values of any callee-saved registers the callee may write are
+    // pushed separately, so a frame only records where to return to.
     struct stack_frame
     {
-        // This is more expensive than it needs to be, but it's a simple way of
-        // doing this.
-        vm_execution_registers state;
+        uint32_t return_pc;
+        uint32_t sp;
         uint32_t label;
+        uint16_t save_mask;
+    };
+
+    // Host memory that checked mload and mstore may access
+    struct memory_region
+    {
+        uint64_t base;
+        uint64_t size;
+        bool writable;
+    };
+
+    // Why a checked mload or mstore was refused
+    enum class memory_fault
+    {
+        none,
+        outside_regions,
+        read_only,
+    };
+
+    enum class extern_storage
+    {
+        // Externs live in the program.  estore and the program's extern
+        // setters see each other's writes, but contexts sharing the program
+        // must not run concurrently.
+        shared,
+
+        // The context copies the program's extern values when it is created
+        // and only ever touches its copy, so the program is never written to
+        // and can be shared by contexts on any number of threads.
+        per_context,
+    };
+
+    enum class execution_mode
+    {
+        interpreter,
+
+        // Runs the program's native code, if it has any.  Anything the JIT
+        // can't handle continues in the interpreter.
+        jit,
     };
 
     class execution_context
     {
+        friend class program;
+        friend struct native_runtime;
+        friend struct native_helpers;
+        friend class aot_runtime;
+        friend class lane_executor;
+
     public:
-        execution_context(program& program);
+        execution_context(program& program,
+                          extern_storage storage = extern_storage::shared);
+
+        // Contexts created from a const program always use per_context
+        // extern storage
+        explicit execution_context(const program& program);
+        ~execution_context();
 
     public:
         const char* get_error();
 
-        // template <typename R, typename... Args>
-        // inline R call(const std::string_view& label, Args&&... args)
-        // {
-        //     std::string copy = std::string(label);
-        //     if (!_program.label_map.count(copy))
-        //     {
-        //         _error = "Unknown label " + copy;
-        //         return R();
-        //     }
-
-        //     call_internal(_program.get_label_id(label));
-        //     // TODO: Finish this
-        // }
-
-        bool run_from(const std::string_view& label);
-        bool resume();
+        // Calls label with args in r0 onwards, runs it to completion and
+        // returns r0 as an R.  Arguments and results take the same types as
+        // bound extern functions.  Nothing is allocated or looked up by name,
+        // so resolve the label once with program::get_label_id.
+        //
+        // On failure (including a yield) it returns R() and get_error() says
+        // why, and the context must be reset before it runs again.  Defined
+        // in vm_binding.hpp.
+        template <typename R, typename... Args>
+        R call(program_label_id_t label, Args... args);
+
+        // Budgets are counted in instructions, but are only charged when a
+        // loop branches backwards or a function is called, so straight-line
+        // code runs unchecked.  When the budget runs out, or interrupt() is
+        // called from another thread, the context stops as though it had
+        // executed a yield.  resume() continues it from that point.
+        static constexpr uint64_t unlimited_budget = UINT64_MAX;
+
+        bool run_from(const std::string_view& label,
+                      uint64_t budget = unlimited_budget);
+        bool run_from(program_label_id_t label,
+                      uint64_t budget = unlimited_budget);
+        bool resume(uint64_t budget = unlimited_budget);
         bool did_yield() const;
 
+        // Abandons whatever the context was running and clears its
+        // registers, error and yield state.  The stack and other buffers are
+        // kept, so a reset context runs again without allocating.
+        void reset();
+
+        // Runs label to completion once per record.  Each record's argCount
+        // words are copied into r0 onwards, and once the label returns the
+        // first resultCount registers are copied to its slot in results.
+        // Registers past argCount aren't cleared between records.  Both
+        // counts must be at most 8.
+        //
+        // Returns the number of records that completed.  If that is less
+        // than count, get_error() says why (a yield counts as a failure) and
+        // the context must be reset before it runs again.
+        size_t run_batch(program_label_id_t label, const vm_word_t* args,
+                         uint32_t argCount, vm_word_t* results,
+                         uint32_t resultCount, size_t count);
+
+        // Safe to call from any thread
+        void interrupt();
+
+        // True if the last run stopped because of the budget or interrupt()
+        // rather than a yield instruction
+        bool was_preempted() const;
+
+        // The stack is allocated the first time the context runs and never
+        // grows, so its size limits how much stack a chain of calls can
+        // allocate.  A call that would overflow it stops the context with an
+        // error.  Frames aren't cleared when they are allocated.
+        //
+        // The size can only be changed while no call is in progress.
+        static constexpr size_t default_stack_size = 64 * 1024;
+        bool set_stack_size(size_t size, bool guarded = false);
+        size_t get_stack_size() const;
+
+        // Arguments are passed to run_from in r0-r7, and results can be read
+        // back from the same registers once it returns.  r8-r15 are left as
+        // the label left them; the host has nothing of its own in them.
+        vm_execution_registers& get_registers();
+
+        // v0-v15.  They start out zeroed and aren't preserved across calls.
+        vm_vector_t* get_vector_registers();
+
+        // Instruction set packed vector instructions run with on this host,
+        // "avx2" or "generic"
+        static const char* get_vector_isa();
+
+        void set_execution_mode(execution_mode mode);
+        execution_mode get_execution_mode() const;
+
+        // Collects an execution_profile while the context runs.  Profiled
+        // runs always use the interpreter.  Returns false if the library was
+        // built without MINIVM_PROFILER.
+        bool set_profiling_enabled(bool enabled);
+
+        // Null until profiling has been enabled.  The profile is kept (and
+        // keeps accumulating) until it is reset.
+        execution_profile* get_profile();
+
+        // Host memory the program's mload and mstore instructions may
+        // access.  An access has to fit inside a single region, and stores
+        // need a writable one.  One that doesn't stops the context with an
+        // error.  Regions can't overlap, and are kept when the context is
+        // reset.
+        bool add_memory_region(const void* base, size_t size, bool writable);
+        bool remove_memory_region(const void* base);
+        void clear_memory_regions();
+
+    public:
+        // Access the externs this context executes with.  For shared storage
+        // these are the program's values.
+        template <typename T>
+        inline void set_extern_pointer(program_extern_id_t id, T* ptr)
+        {
+            set_unsigned_extern(id, reinterpret_cast<size_t>(ptr));
+        }
+
+        void set_extern_function_ptr(program_extern_id_t id,
+                                     extern_program_func_t func);
+
+        void set_unsigned_extern(program_extern_id_t id, uint64_t value);
+        void set_signed_extern(program_extern_id_t id, int64_t value);
+        void set_floating_extern(program_extern_id_t id, double value);
+
+        uint64_t* get_unsigned_extern_ptr(program_extern_id_t id);
+        int64_t* get_signed_extern_ptr(program_extern_id_t id);
+        double* get_floating_extern_ptr(program_extern_id_t id);
+
+    private:
+        static const void* const* get_dispatch_table();
+        static bool execute(execution_context* context,
+                            const void* const** dispatchTable);
+
+    private:
+        program_extern_value* get_extern_storage();
+
     private:
         bool run();
-        void call_internal(program_label_id_t label);
-        void jump(program_label_id_t label);
-        void jump(const program_label& label);
+        void set_budget(uint64_t budget);
+        // Checks label and allocates the stack if it hasn't been yet
+        bool prepare_call(program_label_id_t label);
+
+        // Runs label to completion with the arguments already in registers
+        bool invoke(program_label_id_t label);
+        bool allocate_frame(vm_execution_registers& state,
+                            program_label_id_t labelId,
+                            const program_label& label);
+        bool call_internal(vm_execution_registers& state,
+                           program_label_id_t label);
+        bool tailcall_internal(vm_execution_registers& state,
+                               program_label_id_t label);
+        bool return_internal(vm_execution_registers& state);
+        memory_fault check_memory(uint64_t address, uint64_t width,
+                                  bool write);
 
     private:
         vm_execution_registers _registers;
+        vm_vector_t _vectors[16];
         std::vector<stack_frame> _callStack;
-        std::vector<uint8_t> _stack;
-        program& _program;
+        std::vector<vm_word_t> _savedRegisters;
+        vm_stack _stack;
+
+        // End of the current frame
+        uint32_t _stackTop;
+        size_t _stackSize;
+        bool _stackGuarded;
+        const program& _program;
+
+        std::vector<memory_region> _regions;
+
+        // Copy of the region the last checked access fell in, which native
+        // code tests inline.  Empty when there isn't one.
+        memory_region _lastRegion;
+
+        // Set when externs are shared with the program, otherwise the
+        // context's own copy in _externs is used
+        program* _sharedExterns;
+        std::vector<program_extern_value> _externs;
         std::string _error;
+        std::atomic<bool> _interrupt;
+        int64_t _budget;
         bool _did_yield;
+        bool _preempted;
+        execution_mode _mode;
+        std::unique_ptr<execution_profile> _profile;
+        bool _profiling;
     };
 }  // namespace minivm
\ No newline at end of file
@@ -143,16 +143,83 @@ namespace minivm
         return reg.freg;
     }
 
+    // long, long long, size_t, char and bool are distinct types from the
+    // fixed-width ones register_manip handles, even where they're the same
+    // width, so integers go through the fixed-width type of the same size
+    // and signedness.
+    template <typename T, typename = void>
+    struct register_value_type
+    {
+        using type = T;
+    };
+
+    template <typename T>
+    struct register_value_type<T, std::enable_if_t<std::is_integral_v<T>>>
+    {
+        template <typename S, typename U>
+        using pick = std::conditional_t<std::is_signed_v<T>, S, U>;
+
+        using type = std::conditional_t<
+            sizeof(T) == 1, pick<int8_t, uint8_t>,
+            std::conditional_t<
+                sizeof(T) == 2, pick<int16_t, uint16_t>,
+                std::conditional_t<sizeof(T) == 4, pick<int32_t, uint32_t>,
+                                   pick<int64_t, uint64_t>>>>;
+    };
+
+    template <typename T>
+    using register_value_type_t = typename register_value_type<T>::type;
+
     template <typename T>
     inline T get_register_value(vm_word_t& reg)
     {
         if constexpr (std::is_pointer_v<T>)
         {
-            return register_manip::get_ptr<T>(reg);
+            return register_manip::get_ptr<std::remove_pointer_t<T>>(reg);
         }
         else
         {
-            return register_manip::get<T>(reg);
+            return static_cast<T>(
+                register_manip::get<register_value_type_t<T>>(reg));
+        }
+    }
+
+    template <typename T>
+    inline void set_register_value(vm_word_t& reg, T val)
+    {
+        register_manip::set_register(
+            reg, static_cast<register_value_type_t<T>>(val));
+    }
+
+    template <typename R, typename... Args>
+    inline R execution_context::call(program_label_id_t label, Args... args)
+    {
+        static_assert(sizeof...(Args) <= 8,
+                      "Labels take at most 8 arguments (r0-r7)");
+        static_assert((is_valid_external_value_type_v<Args> && ...),
+                      "Arguments must be pointers or signed/unsigned "
+                      "integer/float types <= 8 bytes.");
+
+        if (!prepare_call(label))
+        {
+            return R();
+        }
+
+        size_t reg = 0;
+        (set_register_value(_registers.registers[reg++], args), ...);
+        (void)reg;
+
+        if (!invoke(label))
+        {
+            return R();
+        }
+
+        if constexpr (!std::is_void_v<R>)
+        {
+            static_assert(is_valid_external_value_type_v<R>,
+                          "Return type must be void, pointer, or "
+                          "signed/unsigned integer/float type <= 8 bytes.");
+            return get_register_value<R>(_registers.registers[0]);
         }
     }
 
@@ -195,8 +262,8 @@ namespace minivm
                 }
                 else
                 {
-                    register_manip::set_register(registers->registers[0],
-                                                 call_with_tuple(ptr, tup));
+                    set_register_value<R>(registers->registers[0],
+                                          call_with_tuple(ptr, tup));
                 }
             }
         };
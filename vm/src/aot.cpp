@@ -0,0 +1,186 @@
+#include <minivm/aot.hpp>
+
+namespace minivm
+{
+    // FNV-1a, 64 bit
+    class fingerprint_hasher
+    {
+    public:
+        void add(const void* data, size_t size)
+        {
+            auto bytes = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < size; ++i)
+            {
+                _hash ^= bytes[i];
+                _hash *= 1099511628211ull;
+            }
+        }
+
+        template <typename T>
+        void add(T value)
+        {
+            add(&value, sizeof(value));
+        }
+
+        uint64_t get() const
+        {
+            return _hash;
+        }
+
+    private:
+        uint64_t _hash = 14695981039346656037ull;
+    };
+
+    uint64_t program::compute_fingerprint() const
+    {
+        fingerprint_hasher hasher;
+
+        // Everything generated code bakes in.  Opcodes are hashed field by
+        // field so struct padding doesn't leak in.
+        const opcode* ops = get_opcodes();
+        size_t opCount = get_opcode_count();
+        hasher.add(uint64_t(opCount));
+        for (size_t i = 0; i < opCount; ++i)
+        {
+            hasher.add(uint8_t(ops[i].instruction));
+            hasher.add(ops[i].warg0);
+            hasher.add(ops[i].arg1);
+        }
+
+        hasher.add(uint64_t(constants.size()));
+        for (auto& cval : constants)
+        {
+            hasher.add(cval.value.ureg);
+            hasher.add(uint8_t(cval.is_data_offset));
+        }
+
+        size_t dataSize = _image ? _image->data_size : _data.size();
+        hasher.add(uint64_t(dataSize));
+        hasher.add(get_data(), dataSize);
+
+        hasher.add(uint64_t(labels.size()));
+        for (auto& label : labels)
+        {
+            hasher.add(label.pc);
+        }
+
+        hasher.add(uint64_t(externs.size()));
+
+        // Whether memory accesses are checked depends on how the program
+        // was loaded
+        for (size_t i = 0; i < opCount; ++i)
+        {
+            if (ops[i].instruction >= instruction::mstore &&
+                ops[i].instruction <= instruction::mloadf32)
+            {
+                hasher.add(uint8_t(_code[i].instruction));
+            }
+        }
+        return hasher.get();
+    }
+
+    bool program::set_aot_module(const aot_module& module)
+    {
+        if (module.abi_version != aot_abi_version)
+        {
+            load_error = "AOT module was generated for a different version of "
+                         "MiniVM";
+            return false;
+        }
+
+        if (module.opcode_count != get_opcode_count() ||
+            module.fingerprint != compute_fingerprint())
+        {
+            load_error = "AOT module was generated from a different program";
+            return false;
+        }
+
+        _aot = &module;
+        return true;
+    }
+
+    bool aot_runtime::call(aot_frame* frame, vm_execution_registers& registers,
+                           uint32_t label)
+    {
+        auto context = frame->context;
+        bool called = context->call_internal(registers, label);
+        frame->stack_top = context->_stackTop;
+        return called;
+    }
+
+    bool aot_runtime::tailcall(aot_frame* frame,
+                               vm_execution_registers& registers,
+                               uint32_t label)
+    {
+        auto context = frame->context;
+        bool called = context->tailcall_internal(registers, label);
+        frame->stack_top = context->_stackTop;
+        return called;
+    }
+
+    bool aot_runtime::ret(aot_frame* frame, vm_execution_registers& registers)
+    {
+        auto context = frame->context;
+        bool hasCaller = context->return_internal(registers);
+        frame->stack_top = context->_stackTop;
+        return hasCaller;
+    }
+
+    void aot_runtime::missing_extern(aot_frame* frame, uint32_t ext)
+    {
+        auto context = frame->context;
+        context->_error = "Failed to call external function ";
+        context->_error += context->_program.get_extern_name(ext);
+        context->_error += " - pointer was null";
+    }
+
+    bool aot_runtime::find_memory(aot_frame* frame, uint64_t address,
+                                  uint32_t width, bool write)
+    {
+        return frame->context->check_memory(address, width, write) ==
+               memory_fault::none;
+    }
+
+    bool aot_runtime::run(execution_context* context, bool& result)
+    {
+        aot_frame frame;
+        frame.context = context;
+        frame.registers = &context->_registers;
+        frame.externs = context->get_extern_storage();
+        frame.stack = context->_stack.data();
+        frame.stack_top = context->_stackTop;
+        frame.data = context->_program.get_data();
+        frame.interrupt = &context->_interrupt;
+        frame.budget = context->_budget;
+        frame.last_region = &context->_lastRegion;
+
+        context->_did_yield = false;
+        context->_preempted = false;
+
+        auto exit = context->_program._aot->entry(&frame);
+        context->_budget = frame.budget;
+
+        switch (exit)
+        {
+            case aot_exit::done:
+                result = true;
+                return true;
+            case aot_exit::yield:
+                context->_did_yield = true;
+                result = true;
+                return true;
+            case aot_exit::preempt:
+                context->_interrupt.store(false, std::memory_order_relaxed);
+                context->_did_yield = true;
+                context->_preempted = true;
+                result = true;
+                return true;
+            case aot_exit::error:
+                result = false;
+                return true;
+            case aot_exit::fallback:
+                break;
+        }
+        return false;
+    }
+}  // namespace minivm
@@ -0,0 +1,655 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <vector>
+
+#include <minivm/aot.hpp>
+
+namespace minivm
+{
+    namespace
+    {
+        // Builds the generated source a line at a time
+        class source_writer
+        {
+        public:
+            template <typename... Args>
+            void line(int indent, const char* format, Args... args)
+            {
+                char buffer[512];
+                snprintf(buffer, sizeof(buffer), format, args...);
+                _source.append(size_t(indent) * 4, ' ');
+                _source += buffer;
+                _source += '\n';
+            }
+
+            void blank()
+            {
+                _source += '\n';
+            }
+
+            std::string& get()
+            {
+                return _source;
+            }
+
+        private:
+            std::string _source;
+        };
+
+        static const char* const word_fields[] = {"ireg", "ureg", "freg"};
+        static const char* const arith_operators[] = {"+", "-", "*", "/"};
+    }  // namespace
+
+    aot_compiler::aot_compiler(const program& program,
+                               const std::string_view& symbol)
+        : _program(program), _symbol(symbol)
+    {
+    }
+
+    void aot_compiler::bind_extern(const std::string_view& name,
+                                   const std::string_view& function)
+    {
+        _bindings.emplace_back(std::string(name), std::string(function));
+    }
+
+    const char* aot_compiler::get_error()
+    {
+        return _error.empty() ? nullptr : _error.c_str();
+    }
+
+    bool aot_compiler::generate(std::string& source)
+    {
+        const opcode* ops = _program.get_opcodes();
+        uint32_t opCount = uint32_t(_program.get_opcode_count());
+        auto& constants = _program.constants;
+        auto& labels = _program.labels;
+
+        std::vector<const char*> bound(_program.externs.size(), nullptr);
+        for (auto& binding : _bindings)
+        {
+            program_extern_id_t id;
+            if (!_program.get_extern_id(binding.first, id))
+            {
+                _error = "Unknown extern " + binding.first;
+                return false;
+            }
+            bound[id.idx] = binding.second.c_str();
+        }
+
+        // pcs execution can enter at (entries) or jump to (targets)
+        std::vector<bool> entries(opCount + 1, false);
+        std::vector<bool> targets(opCount + 1, false);
+        bool hasReturn = false;
+        for (auto& label : labels)
+        {
+            entries[label.pc] = true;
+            targets[label.pc] = true;
+        }
+
+        for (uint32_t pc = 0; pc < opCount; ++pc)
+        {
+            switch (ops[pc].instruction)
+            {
+                case instruction::call:
+                case instruction::yield:
+                    entries[pc + 1] = true;
+                    targets[pc + 1] = true;
+                    break;
+                case instruction::ret:
+                    hasReturn = true;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        source_writer out;
+        out.line(0, "// Generated by minivm-aot.  Do not edit.");
+        out.line(0, "#include <stdio.h>");
+        out.line(0, "#include <minivm/aot.hpp>");
+        out.blank();
+
+        bool declaredBindings = false;
+        for (auto function : bound)
+        {
+            if (function)
+            {
+                out.line(0, "void %s(minivm::vm_execution_registers* registers);",
+                         function);
+                declaredBindings = true;
+            }
+        }
+
+        if (declaredBindings)
+        {
+            out.blank();
+        }
+
+        out.line(0, "namespace");
+        out.line(0, "{");
+        out.line(1, "minivm::aot_exit %s_entry(minivm::aot_frame* frame)",
+                 _symbol.c_str());
+        out.line(1, "{");
+        out.line(2, "using namespace minivm;");
+        out.line(2, "vm_execution_registers regs = *frame->registers;");
+        out.line(2, "vm_word_t* const r = regs.registers;");
+        out.line(2, "program_extern_value* const externs = frame->externs;");
+        out.line(2, "const char* const data = frame->data;");
+        out.line(2, "uint8_t* const stack = frame->stack;");
+        out.line(2, "int64_t budget = frame->budget;");
+        out.line(2, "aot_exit exit = aot_exit::done;");
+        out.line(2, "(void)r;");
+        out.line(2, "(void)externs;");
+        out.line(2, "(void)data;");
+        out.line(2, "(void)stack;");
+        out.blank();
+
+        if (hasReturn)
+        {
+            out.line(1, "dispatch:");
+        }
+        out.line(2, "switch (regs.pc)");
+        out.line(2, "{");
+        for (uint32_t pc = 0; pc <= opCount; ++pc)
+        {
+            if (entries[pc] && pc < opCount)
+            {
+                out.line(3, "case %u: goto pc_%u;", pc, pc);
+            }
+        }
+        out.line(3, "default:");
+        out.line(4, "exit = aot_exit::fallback;");
+        out.line(4, "goto leave;");
+        out.line(2, "}");
+
+        // Emits a jump, charging backwards ones against the budget
+        auto jump = [&](int indent, uint32_t pc, uint32_t target)
+        {
+            if (target <= pc)
+            {
+                out.line(indent, "budget -= %u;", pc - target + 1);
+                out.line(indent,
+                         "if (budget < 0 || "
+                         "frame->interrupt->load(std::memory_order_relaxed))");
+                out.line(indent, "{");
+                out.line(indent + 1, "regs.pc = %u;", target);
+                out.line(indent + 1, "exit = aot_exit::preempt;");
+                out.line(indent + 1, "goto leave;");
+                out.line(indent, "}");
+            }
+            out.line(indent, "goto pc_%u;", target);
+        };
+
+        // Stack accesses the verifier couldn't prove leave through the
+        // interpreter, which reports the error, unless they fit in the frame
+        auto stackCheck = [&](uint32_t pc, uint8_t reg, uint32_t width)
+        {
+            if (_program._code[pc].instruction < instruction::sstore_checked)
+            {
+                return;
+            }
+
+            out.line(2, "if (frame->stack_top - regs.sp < %u ||", width);
+            out.line(2, "    r[%u].ureg > frame->stack_top - regs.sp - %u)",
+                     reg, width);
+            out.line(2, "{");
+            out.line(3, "regs.pc = %u;", pc);
+            out.line(3, "exit = aot_exit::fallback;");
+            out.line(3, "goto leave;");
+            out.line(2, "}");
+        };
+
+        // Memory accesses are checked when the program was loaded with
+        // memory checks enabled
+        auto memoryCheck = [&](uint32_t pc, uint8_t reg, int32_t offset,
+                               uint32_t width, bool write)
+        {
+            if (_program._code[pc].instruction < instruction::mstore_checked)
+            {
+                return;
+            }
+
+            out.line(2,
+                     "if (!aot_runtime::check_memory(frame, r[%u].ureg + "
+                     "uint64_t(INT64_C(%d)), %u, %s))",
+                     reg, offset, width, write ? "true" : "false");
+            out.line(2, "{");
+            out.line(3, "regs.pc = %u;", pc);
+            out.line(3, "exit = aot_exit::fallback;");
+            out.line(3, "goto leave;");
+            out.line(2, "}");
+        };
+
+        static const uint32_t widths[] = {8, 4, 2, 1, 4, 2, 1, 4};
+
+        for (uint32_t pc = 0; pc < opCount; ++pc)
+        {
+            auto& op = ops[pc];
+            auto instr = op.instruction;
+            auto index = static_cast<uint32_t>(instr);
+
+            out.blank();
+            if (targets[pc])
+            {
+                out.line(1, "pc_%u:", pc);
+            }
+            out.line(2, "// %s", get_instruction_name(instr));
+
+            switch (instr)
+            {
+                case instruction::loadc:
+                {
+                    auto& cval = constants[op.arg1];
+                    if (cval.is_data_offset)
+                    {
+                        out.line(2,
+                                 "r[%u].ureg = reinterpret_cast<uint64_t>(data "
+                                 "+ %" PRIu64 ");",
+                                 op.reg0, cval.value.ureg);
+                    }
+                    else
+                    {
+                        out.line(2, "r[%u].ureg = UINT64_C(0x%" PRIx64 ");",
+                                 op.reg0, cval.value.ureg);
+                    }
+                    break;
+                }
+                case instruction::eload:
+                    out.line(2, "r[%u] = externs[%u].value;", op.reg0, op.arg1);
+                    break;
+                case instruction::estore:
+                    out.line(2, "externs[%u].value = r[%u];", op.arg1, op.reg0);
+                    break;
+
+                case instruction::sstore:
+                case instruction::sstoreu32:
+                case instruction::sstoreu16:
+                case instruction::sstoreu8:
+                case instruction::sstorei32:
+                case instruction::sstorei16:
+                case instruction::sstorei8:
+                case instruction::sstoref32:
+                {
+                    static const char* const types[] = {
+                        "uint64_t", "uint32_t", "uint16_t", "uint8_t",
+                        "int32_t",  "int16_t",  "int8_t",   "float"};
+                    static const char* const fields[] = {
+                        "ureg", "ureg", "ureg", "ureg",
+                        "ireg", "ireg", "ireg", "freg"};
+                    auto k = index - uint32_t(instruction::sstore);
+                    stackCheck(pc, op.reg1, widths[k]);
+                    out.line(2,
+                             "*reinterpret_cast<%s*>(&stack[regs.sp + "
+                             "r[%u].ureg]) = %s(r[%u].%s);",
+                             types[k], op.reg1, types[k], op.reg0, fields[k]);
+                    break;
+                }
+
+                case instruction::sload:
+                case instruction::sloadu32:
+                case instruction::sloadu16:
+                case instruction::sloadu8:
+                case instruction::sloadi32:
+                case instruction::sloadi16:
+                case instruction::sloadi8:
+                case instruction::sloadf32:
+                {
+                    static const char* const types[] = {
+                        "uint64_t", "uint32_t", "uint16_t", "uint8_t",
+                        "int32_t",  "int16_t",  "int8_t",   "float"};
+                    static const char* const fields[] = {
+                        "ureg", "ureg", "ureg", "ureg",
+                        "ireg", "ireg", "ireg", "freg"};
+                    auto k = index - uint32_t(instruction::sload);
+                    stackCheck(pc, op.reg1, widths[k]);
+                    out.line(2,
+                             "r[%u].%s = *reinterpret_cast<%s*>(&stack[regs.sp "
+                             "+ r[%u].ureg]);",
+                             op.reg0, fields[k], types[k], op.reg1);
+                    break;
+                }
+
+                case instruction::mstore:
+                case instruction::mstoreu32:
+                case instruction::mstoreu16:
+                case instruction::mstoreu8:
+                case instruction::mstorei32:
+                case instruction::mstorei16:
+                case instruction::mstorei8:
+                case instruction::mstoref32:
+                {
+                    static const char* const types[] = {
+                        "uint64_t", "uint32_t", "uint16_t", "uint8_t",
+                        "int32_t",  "int16_t",  "int8_t",   "float"};
+                    static const char* const fields[] = {
+                        "ureg", "ureg", "ureg", "ureg",
+                        "ireg", "ireg", "ireg", "freg"};
+                    auto k = index - uint32_t(instruction::mstore);
+                    auto offset = int32_t(int16_t(op.arg1));
+                    memoryCheck(pc, op.reg1, offset, widths[k], true);
+                    out.line(2,
+                             "*reinterpret_cast<%s*>(r[%u].ureg + "
+                             "uint64_t(INT64_C(%d))) = %s(r[%u].%s);",
+                             types[k], op.reg1, offset, types[k], op.reg0,
+                             fields[k]);
+                    break;
+                }
+
+                case instruction::mload:
+                case instruction::mloadu32:
+                case instruction::mloadu16:
+                case instruction::mloadu8:
+                case instruction::mloadi32:
+                case instruction::mloadi16:
+                case instruction::mloadi8:
+                case instruction::mloadf32:
+                {
+                    static const char* const types[] = {
+                        "uint64_t", "uint32_t", "uint16_t", "uint8_t",
+                        "int32_t",  "int16_t",  "int8_t",   "float"};
+                    static const char* const fields[] = {
+                        "ureg", "ureg", "ureg", "ureg",
+                        "ireg", "ireg", "ireg", "freg"};
+                    auto k = index - uint32_t(instruction::mload);
+                    auto offset = int32_t(int16_t(op.arg1));
+                    memoryCheck(pc, op.reg1, offset, widths[k], false);
+                    out.line(2,
+                             "r[%u].%s = *reinterpret_cast<%s*>(r[%u].ureg + "
+                             "uint64_t(INT64_C(%d)));",
+                             op.reg0, fields[k], types[k], op.reg1, offset);
+                    break;
+                }
+
+                case instruction::addi:
+                case instruction::addu:
+                case instruction::addf:
+                case instruction::subi:
+                case instruction::subu:
+                case instruction::subf:
+                case instruction::muli:
+                case instruction::mulu:
+                case instruction::mulf:
+                case instruction::divi:
+                case instruction::divu:
+                case instruction::divf:
+                {
+                    auto k = index - uint32_t(instruction::addi);
+                    auto field = word_fields[k % 3];
+                    out.line(2, "r[%u].%s = r[%u].%s %s r[%u].%s;", op.reg0,
+                             field, op.reg1, field, arith_operators[k / 3],
+                             op.reg2, field);
+                    break;
+                }
+
+                case instruction::addi_imm:
+                case instruction::addu_imm:
+                case instruction::subi_imm:
+                case instruction::subu_imm:
+                case instruction::muli_imm:
+                case instruction::mulu_imm:
+                case instruction::divi_imm:
+                case instruction::divu_imm:
+                {
+                    auto k = index - uint32_t(instruction::addi_imm);
+                    if (k % 2 == 0)
+                    {
+                        out.line(2, "r[%u].ireg = r[%u].ireg %s int64_t(%d);",
+                                 op.reg0, op.reg1, arith_operators[k / 2],
+                                 int32_t(int16_t(op.arg1)));
+                    }
+                    else
+                    {
+                        out.line(2, "r[%u].ureg = r[%u].ureg %s uint64_t(%u);",
+                                 op.reg0, op.reg1, arith_operators[k / 2],
+                                 uint32_t(op.arg1));
+                    }
+                    break;
+                }
+
+                case instruction::addi_const:
+                case instruction::addu_const:
+                case instruction::addf_const:
+                case instruction::subi_const:
+                case instruction::subu_const:
+                case instruction::subf_const:
+                case instruction::muli_const:
+                case instruction::mulu_const:
+                case instruction::mulf_const:
+                case instruction::divi_const:
+                case instruction::divu_const:
+                case instruction::divf_const:
+                {
+                    auto k = index - uint32_t(instruction::addi_const);
+                    auto field = word_fields[k % 3];
+                    static const char* const casts[] = {
+                        "int64_t", "uint64_t", "aot_runtime::to_double"};
+                    out.line(2,
+                             "r[%u].%s = r[%u].%s %s %s(UINT64_C(0x%" PRIx64
+                             "));",
+                             op.reg0, field, op.reg1, field,
+                             arith_operators[k / 3], casts[k % 3],
+                             constants[op.arg1].value.ureg);
+                    break;
+                }
+
+                case instruction::mov:
+                case instruction::utoi:
+                case instruction::itou:
+                    out.line(2, "r[%u] = r[%u];", op.reg0, op.reg1);
+                    break;
+                case instruction::utof:
+                    out.line(2, "r[%u].freg = double(r[%u].ureg);", op.reg0,
+                             op.reg1);
+                    break;
+                case instruction::itof:
+                    out.line(2, "r[%u].freg = double(r[%u].ireg);", op.reg0,
+                             op.reg1);
+                    break;
+                case instruction::ftoi:
+                    out.line(2, "r[%u].ireg = int64_t(r[%u].freg);", op.reg0,
+                             op.reg1);
+                    break;
+                case instruction::ftou:
+                    out.line(2, "r[%u].ureg = uint64_t(r[%u].freg);", op.reg0,
+                             op.reg1);
+                    break;
+
+                case instruction::printi:
+                    out.line(2, "printf(\"%%zd\\n\", r[%u].ireg);", op.reg0);
+                    break;
+                case instruction::printu:
+                    out.line(2, "printf(\"%%zu\\n\", r[%u].ureg);", op.reg0);
+                    break;
+                case instruction::printf:
+                    out.line(2, "printf(\"%%f\\n\", r[%u].freg);", op.reg0);
+                    break;
+                case instruction::prints:
+                    out.line(2,
+                             "printf(\"%%s\\n\", reinterpret_cast<const "
+                             "char*>(r[%u].ureg));",
+                             op.reg0);
+                    break;
+
+                case instruction::cmp:
+                    out.line(2, "regs.cmp = r[%u].ureg != r[%u].ureg;", op.reg1,
+                             op.reg0);
+                    break;
+                case instruction::cmp_imm:
+                    out.line(2, "regs.cmp = r[%u].ireg != int64_t(%d);",
+                             op.reg0, int32_t(int16_t(op.arg1)));
+                    break;
+                case instruction::cmp_const:
+                    out.line(2, "regs.cmp = r[%u].ureg != UINT64_C(0x%" PRIx64
+                             ");",
+                             op.reg0, constants[op.arg1].value.ureg);
+                    break;
+
+                case instruction::jump:
+                    jump(2, pc, labels[op.warg0].pc);
+                    break;
+                case instruction::jeq:
+                case instruction::jne:
+                    out.line(2, "if (%sregs.cmp)",
+                             instr == instruction::jeq ? "!" : "");
+                    out.line(2, "{");
+                    jump(3, pc, labels[op.warg0].pc);
+                    out.line(2, "}");
+                    break;
+
+                case instruction::jlti:
+                case instruction::jlei:
+                case instruction::jgti:
+                case instruction::jgei:
+                case instruction::jltu:
+                case instruction::jleu:
+                case instruction::jgtu:
+                case instruction::jgeu:
+                case instruction::jltf:
+                case instruction::jlef:
+                case instruction::jgtf:
+                case instruction::jgef:
+                case instruction::jeqf:
+                case instruction::jnef:
+                {
+                    static const char* const conditions[] = {
+                        "<", "<=", ">", ">=", "<",  "<=", ">",
+                        ">=", "<", "<=", ">", ">=", "==", "!="};
+                    auto k = index - uint32_t(instruction::jlti);
+                    auto field = word_fields[k < 4 ? 0 : k < 8 ? 1 : 2];
+                    out.line(2, "if (r[%u].%s %s r[%u].%s)", op.reg0, field,
+                             conditions[k], op.reg1, field);
+                    out.line(2, "{");
+                    jump(3, pc, labels[get_branch_label(op)].pc);
+                    out.line(2, "}");
+                    break;
+                }
+
+                case instruction::call:
+                case instruction::tailcall:
+                {
+                    bool tail = instr == instruction::tailcall;
+                    if (!tail)
+                    {
+                        out.line(2, "regs.pc = %u;", pc + 1);
+                    }
+                    // The interpreter reports stack overflows
+                    out.line(2, "if (!aot_runtime::%s(frame, regs, %u))",
+                             tail ? "tailcall" : "call", op.warg0);
+                    out.line(2, "{");
+                    out.line(3, "regs.pc = %u;", pc);
+                    out.line(3, "exit = aot_exit::fallback;");
+                    out.line(3, "goto leave;");
+                    out.line(2, "}");
+
+                    // The callee's frame is set up, so a preempted call
+                    // resumes at its first instruction
+                    out.line(2,
+                             "if (--budget < 0 || "
+                             "frame->interrupt->load(std::memory_order_relaxed))");
+                    out.line(2, "{");
+                    out.line(3, "exit = aot_exit::preempt;");
+                    out.line(3, "goto leave;");
+                    out.line(2, "}");
+                    out.line(2, "goto pc_%u;", labels[op.warg0].pc);
+                    break;
+                }
+                case instruction::callext:
+                    out.line(2, "regs.pc = %u;", pc);
+                    if (bound[op.warg0])
+                    {
+                        out.line(2, "%s(&regs);", bound[op.warg0]);
+                        break;
+                    }
+
+                    out.line(2, "{");
+                    out.line(3,
+                             "auto fn = reinterpret_cast<extern_program_func_t>("
+                             "externs[%u].value.ureg);",
+                             op.warg0);
+                    out.line(3, "if (!fn)");
+                    out.line(3, "{");
+                    out.line(4, "aot_runtime::missing_extern(frame, %u);",
+                             op.warg0);
+                    out.line(4, "exit = aot_exit::error;");
+                    out.line(4, "goto leave;");
+                    out.line(3, "}");
+                    out.line(3, "fn(&regs);");
+                    out.line(2, "}");
+                    break;
+                case instruction::yield:
+                    out.line(2, "regs.pc = %u;", pc + 1);
+                    out.line(2, "exit = aot_exit::yield;");
+                    out.line(2, "goto leave;");
+                    break;
+                case instruction::ret:
+                    out.line(2, "if (!aot_runtime::ret(frame, regs))");
+                    out.line(2, "{");
+                    out.line(3, "goto leave;");
+                    out.line(2, "}");
+                    out.line(2, "goto dispatch;");
+                    break;
+                case instruction::halt:
+                    out.line(2, "regs.pc = %u;", pc);
+                    out.line(2, "goto leave;");
+                    break;
+
+                // Vector registers live in the context, which generated code
+                // doesn't see, so these continue in the interpreter
+                case instruction::vaddf32:
+                case instruction::vsubf32:
+                case instruction::vmulf32:
+                case instruction::vdivf32:
+                case instruction::vfmaf32:
+                case instruction::vaddf64:
+                case instruction::vsubf64:
+                case instruction::vmulf64:
+                case instruction::vdivf64:
+                case instruction::vfmaf64:
+                case instruction::vaddi32:
+                case instruction::vsubi32:
+                case instruction::vmuli32:
+                case instruction::vdivi32:
+                case instruction::vfmai32:
+                case instruction::vmov:
+                case instruction::vbroadcastf32:
+                case instruction::vbroadcastf64:
+                case instruction::vbroadcasti32:
+                case instruction::vshuf32:
+                case instruction::vshuf64:
+                case instruction::vsstore:
+                case instruction::vsstore128:
+                case instruction::vsload:
+                case instruction::vsload128:
+                    out.line(2, "regs.pc = %u;", pc);
+                    out.line(2, "exit = aot_exit::fallback;");
+                    out.line(2, "goto leave;");
+                    break;
+
+                default:
+                    _error = "Cannot translate instruction ";
+                    _error += get_instruction_name(instr);
+                    return false;
+            }
+        }
+
+        out.blank();
+        out.line(1, "leave:");
+        out.line(2, "frame->budget = budget;");
+        out.line(2, "*frame->registers = regs;");
+        out.line(2, "return exit;");
+        out.line(1, "}");
+        out.line(0, "}  // namespace");
+        out.blank();
+
+        out.line(0, "extern const minivm::aot_module %s;", _symbol.c_str());
+        out.line(0, "const minivm::aot_module %s = {", _symbol.c_str());
+        out.line(1, "minivm::aot_abi_version,");
+        out.line(1, "%u,", opCount);
+        out.line(1, "UINT64_C(0x%" PRIx64 "),", _program.compute_fingerprint());
+        out.line(1, "&%s_entry,", _symbol.c_str());
+        out.line(0, "};");
+
+        source = std::move(out.get());
+        return true;
+    }
+}  // namespace minivm
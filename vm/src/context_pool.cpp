@@ -0,0 +1,66 @@
+#include <minivm/context_pool.hpp>
+
+namespace minivm
+{
+    context_pool::context_pool(const program& program,
+                               const context_pool_config& config)
+        : _program(program), _config(config)
+    {
+    }
+
+    context_pool::~context_pool() = default;
+
+    std::unique_ptr<execution_context> context_pool::create()
+    {
+        auto context = std::make_unique<execution_context>(_program);
+        context->set_stack_size(_config.stack_size, _config.guarded_stack);
+        context->set_execution_mode(_config.mode);
+        return context;
+    }
+
+    execution_context* context_pool::acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_idle.empty())
+            {
+                auto context = _idle.back();
+                _idle.pop_back();
+                return context;
+            }
+        }
+
+        // Contexts copy the program's externs, so they're created outside
+        // the lock
+        auto context = create();
+        auto result = context.get();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _contexts.push_back(std::move(context));
+        return result;
+    }
+
+    void context_pool::release(execution_context* context)
+    {
+        context->reset();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _idle.push_back(context);
+    }
+
+    void context_pool::reserve(uint32_t count)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        while (_contexts.size() < count)
+        {
+            _contexts.push_back(create());
+            _idle.push_back(_contexts.back().get());
+        }
+    }
+
+    uint32_t context_pool::get_context_count()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return uint32_t(_contexts.size());
+    }
+}  // namespace minivm
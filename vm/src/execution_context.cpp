@@ -1,12 +1,350 @@
+#include <string.h>
+#include <string>
+
+#include <minivm/aot.hpp>
+#include <minivm/profiler.hpp>
 #include <minivm/vm.hpp>
+#include "native.hpp"
+#include "vector_ops.hpp"
+
+// Direct-threaded dispatch relies on the labels-as-values extension, which is
+// only available on GCC-compatible compilers.  Everything else falls back to
+// a portable switch.
+#ifndef MINIVM_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define MINIVM_THREADED_DISPATCH 1
+#else
+#define MINIVM_THREADED_DISPATCH 0
+#endif
+#endif
+
+#ifndef MINIVM_PROFILER
+#define MINIVM_PROFILER 0
+#endif
+
+// Profiling hooks.  These only exist in profiler builds, so the dispatch loop
+// is untouched otherwise.
+#if MINIVM_PROFILER
+#define VM_PROFILE_INSTRUCTION() \
+    if (profile) profile->count(uint32_t(ip - code), ip->instruction)
+#else
+#define VM_PROFILE_INSTRUCTION()
+#endif
+
+#if MINIVM_THREADED_DISPATCH
+#define VM_CASE(name) op_##name
+#if MINIVM_PROFILER
+#define VM_DISPATCH()            \
+    do                           \
+    {                            \
+        VM_PROFILE_INSTRUCTION(); \
+        goto* ip->handler;       \
+    } while (0)
+#else
+#define VM_DISPATCH() goto* ip->handler
+#endif
+#else
+#define VM_CASE(name) case instruction::name
+#define VM_DISPATCH() continue
+#endif
+
+#define VM_NEXT() \
+    ++ip;         \
+    VM_DISPATCH()
+
+// Superinstruction handlers.  Each one performs the work of the instructions
+// it replaced in order, then skips over the slots those instructions occupied.
+#define VM_FUSED_ARITH(first, source, name, field, oper)                   \
+    VM_CASE(first##_##name) :                                              \
+    {                                                                      \
+        auto& op = *ip;                                                    \
+        regs.registers[op.reg0] = source[op.arg].value;                    \
+        regs.registers[op.reg1].field =                                    \
+            regs.registers[op.reg2].field oper regs.registers[op.reg3].field; \
+        ip += 2;                                                           \
+        VM_DISPATCH();                                                     \
+    }
+
+#define VM_FUSED_ARITH_GROUP(first, source)      \
+    VM_FUSED_ARITH(first, source, addi, ireg, +) \
+    VM_FUSED_ARITH(first, source, addu, ureg, +) \
+    VM_FUSED_ARITH(first, source, addf, freg, +) \
+    VM_FUSED_ARITH(first, source, subi, ireg, -) \
+    VM_FUSED_ARITH(first, source, subu, ureg, -) \
+    VM_FUSED_ARITH(first, source, subf, freg, -) \
+    VM_FUSED_ARITH(first, source, muli, ireg, *) \
+    VM_FUSED_ARITH(first, source, mulu, ureg, *) \
+    VM_FUSED_ARITH(first, source, mulf, freg, *)
+
+#define VM_ARITH_IMM(name, field, oper, type)                             \
+    VM_CASE(name##_imm) :                                                 \
+    {                                                                     \
+        auto& op = *ip;                                                   \
+        regs.registers[op.reg0].field =                                   \
+            regs.registers[op.reg1].field oper type(op.arg);              \
+        VM_NEXT();                                                        \
+    }
+
+#define VM_ARITH_CONST(name, field, oper)                                 \
+    VM_CASE(name##_const) :                                               \
+    {                                                                     \
+        auto& op = *ip;                                                   \
+        regs.registers[op.reg0].field =                                   \
+            regs.registers[op.reg1].field oper                            \
+            constants[op.arg].value.field;                        \
+        VM_NEXT();                                                        \
+    }
+
+// Stack accesses come in two forms: the plain one for accesses the verifier
+// proved stay inside the frame, and a checked one for everything else.  The
+// frame runs from sp to the top of the stack.
+#define VM_STACK_ADDRESS(type) \
+    reinterpret_cast<type*>(&stack[regs.sp + regs.registers[ip->reg1].ureg])
+
+#define VM_STACK_CHECK(type)                                             \
+    {                                                                    \
+        uint64_t frameSize = context->_stackTop - regs.sp;               \
+        uint64_t offset = regs.registers[ip->reg1].ureg;                 \
+        if (frameSize < sizeof(type) || offset > frameSize - sizeof(type)) \
+            goto stack_error;                                            \
+    }
+
+#define VM_STACK_STORE(name, type, field)                                \
+    VM_CASE(name) :                                                      \
+    {                                                                    \
+        *VM_STACK_ADDRESS(type) = type(regs.registers[ip->reg0].field);  \
+        VM_NEXT();                                                       \
+    }                                                                    \
+    VM_CASE(name##_checked) :                                            \
+    {                                                                    \
+        VM_STACK_CHECK(type)                                             \
+        *VM_STACK_ADDRESS(type) = type(regs.registers[ip->reg0].field);  \
+        VM_NEXT();                                                       \
+    }
+
+#define VM_STACK_LOAD(name, type, field)                                 \
+    VM_CASE(name) :                                                      \
+    {                                                                    \
+        regs.registers[ip->reg0].field = *VM_STACK_ADDRESS(type);        \
+        VM_NEXT();                                                       \
+    }                                                                    \
+    VM_CASE(name##_checked) :                                            \
+    {                                                                    \
+        VM_STACK_CHECK(type)                                             \
+        regs.registers[ip->reg0].field = *VM_STACK_ADDRESS(type);        \
+        VM_NEXT();                                                       \
+    }
+
+// Host memory accesses work like stack accesses, except the checked form
+// looks for a memory region holding the address instead of using the frame
+#define VM_MEMORY_ADDRESS \
+    (regs.registers[ip->reg1].ureg + uint64_t(int64_t(int32_t(ip->arg))))
+
+#define VM_MEMORY_CHECK(type, write)                                     \
+    memoryFault =                                                        \
+        context->check_memory(VM_MEMORY_ADDRESS, sizeof(type), write);   \
+    if (memoryFault != memory_fault::none) goto memory_error;
+
+#define VM_MEMORY_STORE(name, type, field)                               \
+    VM_CASE(name) :                                                      \
+    {                                                                    \
+        *reinterpret_cast<type*>(VM_MEMORY_ADDRESS) =                    \
+            type(regs.registers[ip->reg0].field);                        \
+        VM_NEXT();                                                       \
+    }                                                                    \
+    VM_CASE(name##_checked) :                                            \
+    {                                                                    \
+        VM_MEMORY_CHECK(type, true)                                      \
+        *reinterpret_cast<type*>(VM_MEMORY_ADDRESS) =                    \
+            type(regs.registers[ip->reg0].field);                        \
+        VM_NEXT();                                                       \
+    }
+
+#define VM_MEMORY_LOAD(name, type, field)                                \
+    VM_CASE(name) :                                                      \
+    {                                                                    \
+        regs.registers[ip->reg0].field =                                 \
+            *reinterpret_cast<const type*>(VM_MEMORY_ADDRESS);           \
+        VM_NEXT();                                                       \
+    }                                                                    \
+    VM_CASE(name##_checked) :                                            \
+    {                                                                    \
+        VM_MEMORY_CHECK(type, false)                                     \
+        regs.registers[ip->reg0].field =                                 \
+            *reinterpret_cast<const type*>(VM_MEMORY_ADDRESS);           \
+        VM_NEXT();                                                       \
+    }
+
+// Vector stack accesses copy the low bytes of the register, and loads clear
+// the rest
+#define VM_VECTOR_STACK_STORE(name, bytes)                                 \
+    VM_CASE(name) :                                                        \
+    {                                                                      \
+        memcpy(VM_STACK_ADDRESS(uint8_t), &vectors[ip->reg0], bytes);      \
+        VM_NEXT();                                                         \
+    }                                                                      \
+    VM_CASE(name##_checked) :                                              \
+    {                                                                      \
+        VM_STACK_CHECK(uint8_t[bytes])                                     \
+        memcpy(VM_STACK_ADDRESS(uint8_t), &vectors[ip->reg0], bytes);      \
+        VM_NEXT();                                                         \
+    }
+
+#define VM_VECTOR_LOAD(bytes)                                              \
+    {                                                                      \
+        auto bytesOut = reinterpret_cast<uint8_t*>(&vectors[ip->reg0]);    \
+        memcpy(bytesOut, VM_STACK_ADDRESS(uint8_t), bytes);                \
+        memset(bytesOut + (bytes), 0, sizeof(vm_vector_t) - (bytes));      \
+    }
+
+#define VM_VECTOR_STACK_LOAD(name, bytes)                                  \
+    VM_CASE(name) :                                                        \
+    {                                                                      \
+        VM_VECTOR_LOAD(bytes)                                              \
+        VM_NEXT();                                                         \
+    }                                                                      \
+    VM_CASE(name##_checked) :                                              \
+    {                                                                      \
+        VM_STACK_CHECK(uint8_t[bytes])                                     \
+        VM_VECTOR_LOAD(bytes)                                              \
+        VM_NEXT();                                                         \
+    }
+
+#define VM_VECTOR_ARITH(name)                                              \
+    VM_CASE(v##name) :                                                     \
+    {                                                                      \
+        auto& op = *ip;                                                    \
+        vectorOps.name(vectors[op.reg0], vectors[op.reg1],                 \
+                       vectors[op.reg2], vectors[op.reg3]);                \
+        VM_NEXT();                                                         \
+    }
+
+// Jumps to pc.  Loops can only run through branches to earlier code, so
+// those are charged against the budget (by the length of the loop body) and
+// poll the interrupt flag.  Forward branches are free.
+#define VM_JUMP(pc)                                                       \
+    {                                                                     \
+        const decoded_opcode* next = code + (pc);                         \
+        if (next <= ip)                                                   \
+        {                                                                 \
+            budget -= (ip - next) + 1;                                    \
+            ip = next;                                                    \
+            if (budget < 0 ||                                             \
+                context->_interrupt.load(std::memory_order_relaxed))      \
+                goto preempt;                                             \
+            VM_DISPATCH();                                                \
+        }                                                                 \
+        ip = next;                                                        \
+        VM_DISPATCH();                                                    \
+    }
+
+// Jumps to the resolved target if cond holds, otherwise skips width slots
+#define VM_BRANCH(cond, width)         \
+    if (cond)                          \
+    {                                  \
+        VM_JUMP(ip->target);           \
+    }                                  \
+    ip += width;                       \
+    VM_DISPATCH()
 
 namespace minivm
 {
-    execution_context::execution_context(program& program)
-        : _program(program), _did_yield(false)
+    execution_context::execution_context(program& program,
+                                         extern_storage storage)
+        : _stackTop(0),
+          _stackSize(default_stack_size),
+          _stackGuarded(false),
+          _program(program),
+          _lastRegion(),
+          _interrupt(false),
+          _budget(INT64_MAX),
+          _did_yield(false),
+          _preempted(false),
+          _mode(execution_mode::interpreter),
+          _profiling(false)
+    {
+        if (storage == extern_storage::shared)
+        {
+            _sharedExterns = &program;
+        }
+        else
+        {
+            _sharedExterns = nullptr;
+            _externs = program.externs;
+        }
+
+        _registers.pc = 0;
+        _registers.sp = 0;
+        memset(_vectors, 0, sizeof(_vectors));
+    }
+
+    execution_context::execution_context(const program& program)
+        : _stackTop(0),
+          _stackSize(default_stack_size),
+          _stackGuarded(false),
+          _program(program),
+          _lastRegion(),
+          _interrupt(false),
+          _budget(INT64_MAX),
+          _did_yield(false),
+          _preempted(false),
+          _mode(execution_mode::interpreter),
+          _profiling(false)
     {
+        _sharedExterns = nullptr;
+        _externs = program.externs;
+
+        _registers.pc = 0;
         _registers.sp = 0;
-        _stack.reserve(4096);
+        memset(_vectors, 0, sizeof(_vectors));
+    }
+
+    execution_context::~execution_context() = default;
+
+    program_extern_value* execution_context::get_extern_storage()
+    {
+        return _sharedExterns ? _sharedExterns->externs.data()
+                              : _externs.data();
+    }
+
+    void execution_context::set_extern_function_ptr(
+        program_extern_id_t id, extern_program_func_t func)
+    {
+        set_extern_pointer(id, func);
+    }
+
+    void execution_context::set_unsigned_extern(program_extern_id_t id,
+                                                uint64_t value)
+    {
+        get_extern_storage()[id.idx].value.ureg = value;
+    }
+
+    void execution_context::set_signed_extern(program_extern_id_t id,
+                                              int64_t value)
+    {
+        get_extern_storage()[id.idx].value.ireg = value;
+    }
+
+    void execution_context::set_floating_extern(program_extern_id_t id,
+                                                double value)
+    {
+        get_extern_storage()[id.idx].value.freg = value;
+    }
+
+    uint64_t* execution_context::get_unsigned_extern_ptr(
+        program_extern_id_t id)
+    {
+        return &get_extern_storage()[id.idx].value.ureg;
+    }
+
+    int64_t* execution_context::get_signed_extern_ptr(program_extern_id_t id)
+    {
+        return &get_extern_storage()[id.idx].value.ireg;
+    }
+
+    double* execution_context::get_floating_extern_ptr(program_extern_id_t id)
+    {
+        return &get_extern_storage()[id.idx].value.freg;
     }
 
     const char* execution_context::get_error()
@@ -15,401 +353,1272 @@ namespace minivm
         return _error.c_str();
     }
 
-    bool execution_context::run_from(const std::string_view& label)
+    bool execution_context::run_from(const std::string_view& label,
+                                     uint64_t budget)
     {
-        std::string copy = std::string(label);
-        if (!_program.label_map.count(copy))
+        program_label_id_t id;
+        if (!_program.get_label_id(label, id))
         {
-            _error = "Unknown label " + copy;
+            _error = "Unknown label " + std::string(label);
             return false;
         }
 
-        call_internal(_program.get_label_id(label));
+        return run_from(id, budget);
+    }
 
-        // Countering the -1 in jump
-        ++_registers.pc;
+    bool execution_context::run_from(program_label_id_t label,
+                                     uint64_t budget)
+    {
+        if (!prepare_call(label) || !call_internal(_registers, label))
+        {
+            return false;
+        }
 
+        set_budget(budget);
         return run();
     }
 
-    void execution_context::call_internal(program_label_id_t labelId)
+    void execution_context::reset()
     {
-        auto& label = _program.get_label(labelId);
+        _callStack.clear();
+        _savedRegisters.clear();
+        _stackTop = 0;
+        memset(&_registers, 0, sizeof(_registers));
+        memset(_vectors, 0, sizeof(_vectors));
 
-        _callStack.push_back({});
-        auto& frame = _callStack.back();
-        frame.state = _registers;
-        frame.label = labelId.idx;
+        _error.clear();
+        _interrupt.store(false, std::memory_order_relaxed);
+        _budget = INT64_MAX;
+        _did_yield = false;
+        _preempted = false;
+
+#if MINIVM_PROFILER
+        // The abandoned frames never return
+        if (_profile) _profile->_frames.clear();
+#endif
+    }
+
+    size_t execution_context::run_batch(program_label_id_t label,
+                                        const vm_word_t* args,
+                                        uint32_t argCount, vm_word_t* results,
+                                        uint32_t resultCount, size_t count)
+    {
+        if (argCount > 8 || resultCount > 8)
+        {
+            _error = "Batches pass at most 8 arguments and results";
+            return 0;
+        }
 
-        jump(label);
+        if (!prepare_call(label))
+        {
+            return 0;
+        }
 
-        if (label.stackalloc > 0)
+        // A record that returns leaves the call stack empty and the stack
+        // top back at 0, so the next one starts from a clean frame
+        for (size_t i = 0; i < count; ++i)
         {
-            auto tgSize = _registers.sp + label.stackalloc;
-            _registers.sp = uint32_t(_stack.size());
-            _stack.resize(tgSize);
+            memcpy(_registers.registers, args + i * argCount,
+                   argCount * sizeof(vm_word_t));
+
+            if (!invoke(label))
+            {
+                return i;
+            }
+
+            memcpy(results + i * resultCount, _registers.registers,
+                   resultCount * sizeof(vm_word_t));
         }
+        return count;
     }
 
-    void execution_context::jump(program_label_id_t labelId)
+    bool execution_context::invoke(program_label_id_t label)
     {
-        auto& label = _program.get_label(labelId);
-        jump(label);
+        if (!call_internal(_registers, label))
+        {
+            return false;
+        }
+
+        _budget = INT64_MAX;
+        if (!run())
+        {
+            return false;
+        }
+
+        if (_did_yield)
+        {
+            _error = "Yielded while being called from the host";
+            return false;
+        }
+        return true;
     }
 
-    void execution_context::jump(const program_label& label)
+    bool execution_context::prepare_call(program_label_id_t label)
     {
-        // Subtracting 1 because we increment pc after
-        _registers.pc = label.pc - 1;
+        if (label.idx >= _program.labels.size())
+        {
+            _error = "Invalid label id";
+            return false;
+        }
+
+        if (!_stack.data() && !_stack.allocate(_stackSize, _stackGuarded))
+        {
+            _error = "Failed to allocate the stack";
+            return false;
+        }
+        return true;
     }
 
-    bool execution_context::resume()
+    bool execution_context::set_stack_size(size_t size, bool guarded)
     {
-        return run();
+        // Frames are addressed with 32 bit offsets
+        if (_callStack.size() > 0 || size == 0 || size > UINT32_MAX)
+        {
+            return false;
+        }
+
+        _stack.release();
+        _stackSize = size;
+        _stackGuarded = guarded;
+        return true;
     }
 
-    bool execution_context::did_yield() const
+    size_t execution_context::get_stack_size() const
     {
-        return _did_yield;
+        return _stackSize;
     }
 
-    bool execution_context::run()
+    bool execution_context::allocate_frame(vm_execution_registers& state,
+                                           program_label_id_t labelId,
+                                           const program_label& label)
     {
-        _did_yield = false;
-        bool shouldRun = true;
-        size_t pSize = _program.opcodes.size();
-        while (shouldRun && _registers.pc < pSize)
+        // sp is the base of the frame, which ends stackalloc bytes later
+        if (label.stackalloc > _stack.size() - state.sp)
+        {
+            _error = "Stack overflow calling ";
+            _error += _program.get_label_name(labelId);
+            return false;
+        }
+
+        _stackTop = state.sp + label.stackalloc;
+        return true;
+    }
+
+    bool execution_context::call_internal(vm_execution_registers& state,
+                                          program_label_id_t labelId)
+    {
+        auto& label = _program.get_label(labelId);
+
+        // The callee's frame starts at the end of the caller's
+        uint32_t callerSp = state.sp;
+        state.sp = _stackTop;
+        if (!allocate_frame(state, labelId, label))
+        {
+            state.sp = callerSp;
+            return false;
+        }
+
+        // The host keeps nothing in r8-r15, so the frame it enters saves
+        // nothing
+        uint16_t saveMask = _callStack.empty() ? 0 : label.save_mask;
+
+        // state.pc already holds the return address.  The frame is filled
+        // in place; a braced temporary gets copied with one wide load right
+        // after the narrow stores that built it.
+        auto& frame = _callStack.emplace_back();
+        frame.return_pc = state.pc;
+        frame.sp = callerSp;
+        frame.label = labelId.idx;
+        frame.save_mask = saveMask;
+
+#if MINIVM_PROFILER
+        if (_profiling) _profile->enter(labelId.idx);
+#endif
+
+        // Leaf labels often save nothing
+        if (saveMask)
         {
-            auto& code = _program.opcodes[_registers.pc];
-            switch (code.instruction)
+            for (uint32_t i = 8; i < 16; ++i)
             {
-                case instruction::loadc:
-                {
-                    _registers.registers[code.reg0] =
-                        _program.constants[code.arg1].value;
-                    break;
-                }
-                case instruction::eload:
-                {
-                    _registers.registers[code.reg0] =
-                        _program.externs[code.arg1].value;
-                    break;
-                }
-                case instruction::estore:
-                {
-                    _program.externs[code.arg1].value =
-                        _registers.registers[code.reg0];
-                    break;
-                }
-                case instruction::sstore:
-                {
-                    *reinterpret_cast<uint64_t*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].ureg;
-                    break;
-                }
-                case instruction::sstoreu32:
-                {
-                    *reinterpret_cast<uint32_t*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].ureg;
-                    break;
-                }
-                case instruction::sstoreu16:
-                {
-                    *reinterpret_cast<uint16_t*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].ureg;
-                    break;
-                }
-                case instruction::sstoreu8:
-                {
-                    *reinterpret_cast<uint8_t*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].ureg;
-                    break;
-                }
-                case instruction::sstorei32:
-                {
-                    *reinterpret_cast<int32_t*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].ireg;
-                    break;
-                }
-                case instruction::sstorei16:
-                {
-                    *reinterpret_cast<int16_t*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].ireg;
-                    break;
-                }
-                case instruction::sstorei8:
+                if (saveMask & (1 << i))
                 {
-                    *reinterpret_cast<int8_t*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].ireg;
-                    break;
-                }
-                case instruction::sstoref32:
-                {
-                    *reinterpret_cast<float*>(
-                        &_stack[_registers.registers[code.reg1].ureg]) =
-                        _registers.registers[code.reg0].freg;
-                    break;
+                    _savedRegisters.push_back(state.registers[i]);
                 }
+            }
+        }
 
-                case instruction::sload:
-                {
-                    _registers.registers[code.reg0].ureg =
-                        *reinterpret_cast<uint64_t*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
-                case instruction::sloadu32:
-                {
-                    _registers.registers[code.reg0].ureg =
-                        *reinterpret_cast<uint32_t*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
-                case instruction::sloadu16:
-                {
-                    _registers.registers[code.reg0].ureg =
-                        *reinterpret_cast<uint16_t*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
-                case instruction::sloadu8:
-                {
-                    _registers.registers[code.reg0].ureg =
-                        *reinterpret_cast<uint8_t*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
-                case instruction::sloadi32:
-                {
-                    _registers.registers[code.reg0].ireg =
-                        *reinterpret_cast<int32_t*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
-                case instruction::sloadi16:
-                {
-                    _registers.registers[code.reg0].ireg =
-                        *reinterpret_cast<int16_t*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
-                case instruction::sloadi8:
-                {
-                    _registers.registers[code.reg0].ireg =
-                        *reinterpret_cast<int8_t*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
-                case instruction::sloadf32:
-                {
-                    _registers.registers[code.reg0].freg =
-                        *reinterpret_cast<float*>(
-                            &_stack[_registers.registers[code.reg1].ureg]);
-                    break;
-                }
+        state.pc = label.pc;
+        return true;
+    }
 
-                case instruction::utoi:
-                {
-                    _registers.registers[code.reg0].ireg =
-                        _registers.registers[code.reg1].ureg;
-                    break;
-                }
-                case instruction::utof:
-                {
-                    _registers.registers[code.reg0].freg =
-                        _registers.registers[code.reg1].ureg;
-                    break;
-                }
-                case instruction::itou:
-                {
-                    _registers.registers[code.reg0].ureg =
-                        _registers.registers[code.reg1].ireg;
-                    break;
-                }
-                case instruction::itof:
-                {
-                    _registers.registers[code.reg0].freg =
-                        _registers.registers[code.reg1].ireg;
-                    break;
-                }
-                case instruction::ftoi:
-                {
-                    _registers.registers[code.reg0].ireg =
-                        _registers.registers[code.reg1].freg;
-                    break;
-                }
-                case instruction::ftou:
-                {
-                    _registers.registers[code.reg0].ureg =
-                        _registers.registers[code.reg1].freg;
-                    break;
-                }
-                case instruction::mov:
-                    _registers.registers[code.reg0].ureg =
-                        _registers.registers[code.reg1].ureg;
-                    break;
-                case instruction::addi:
-                    _registers.registers[code.reg0].ireg =
-                        _registers.registers[code.reg1].ireg +
-                        _registers.registers[code.reg2].ireg;
-                    break;
-                case instruction::addu:
-                    _registers.registers[code.reg0].ureg =
-                        _registers.registers[code.reg1].ureg +
-                        _registers.registers[code.reg2].ureg;
-                    break;
-                case instruction::addf:
-                    _registers.registers[code.reg0].freg =
-                        _registers.registers[code.reg1].freg +
-                        _registers.registers[code.reg2].freg;
-                    break;
-                case instruction::subi:
-                    _registers.registers[code.reg0].ireg =
-                        _registers.registers[code.reg1].ireg -
-                        _registers.registers[code.reg2].ireg;
-                    break;
-                case instruction::subu:
-                    _registers.registers[code.reg0].ureg =
-                        _registers.registers[code.reg1].ureg -
-                        _registers.registers[code.reg2].ureg;
-                    break;
-                case instruction::subf:
-                    _registers.registers[code.reg0].freg =
-                        _registers.registers[code.reg1].freg -
-                        _registers.registers[code.reg2].freg;
-                    break;
-                case instruction::muli:
-                    _registers.registers[code.reg0].ireg =
-                        _registers.registers[code.reg1].ireg *
-                        _registers.registers[code.reg2].ireg;
-                    break;
-                case instruction::mulu:
-                    _registers.registers[code.reg0].ureg =
-                        _registers.registers[code.reg1].ureg *
-                        _registers.registers[code.reg2].ureg;
-                    break;
-                case instruction::mulf:
-                    _registers.registers[code.reg0].freg =
-                        _registers.registers[code.reg1].freg *
-                        _registers.registers[code.reg2].freg;
-                    break;
-                case instruction::divi:
-                    _registers.registers[code.reg0].ireg =
-                        _registers.registers[code.reg1].ireg /
-                        _registers.registers[code.reg2].ireg;
-                    break;
-                case instruction::divu:
-                    _registers.registers[code.reg0].ureg =
-                        _registers.registers[code.reg1].ureg /
-                        _registers.registers[code.reg2].ureg;
-                    break;
-                case instruction::divf:
-                    _registers.registers[code.reg0].freg =
-                        _registers.registers[code.reg1].freg /
-                        _registers.registers[code.reg2].freg;
-                    break;
-                case instruction::printi:
-                    printf("%zd\n", _registers.registers[code.reg0].ireg);
-                    break;
-                case instruction::printu:
-                    printf("%zu\n", _registers.registers[code.reg0].ureg);
-                    break;
-                case instruction::printf:
-                    printf("%f\n", _registers.registers[code.reg0].freg);
-                    break;
-                case instruction::prints:
-                    printf("%s\n", reinterpret_cast<const char*>(
-                                       _registers.registers[code.reg0].ureg));
-                    break;
-                case instruction::cmp:
-                    _registers.cmp = _registers.registers[code.reg1].ireg -
-                                     _registers.registers[code.reg0].ireg;
-                    break;
-                case instruction::jump:
-                    // Subtracting 1 because we increment pc after
-                    jump(code.warg0);
-                    break;
-                case instruction::jeq:
-                    if (!_registers.cmp)
-                    {
-                        // Subtracting 1 because we increment pc after
-                        jump(code.warg0);
-                    }
-                    break;
-                case instruction::jne:
-                    if (_registers.cmp)
-                    {
-                        // Subtracting 1 because we increment pc after
-                        jump(code.warg0);
-                    }
-                    break;
-                case instruction::call:
+    bool execution_context::tailcall_internal(vm_execution_registers& state,
+                                              program_label_id_t labelId)
+    {
+        auto& label = _program.get_label(labelId);
+        auto& frame = _callStack.back();
+
+        // The callee reuses the current frame's base
+        if (!allocate_frame(state, labelId, label))
+        {
+            return false;
+        }
+
+        // Registers outside the frame's mask haven't been touched since the
+        // frame was entered, so they still hold the caller's values and can
+        // be saved now.  The saved block stays in ascending register order.
+        // The frame the host entered has no caller to save for.
+        uint16_t extra = _callStack.size() > 1
+                             ? label.save_mask & ~frame.save_mask
+                             : 0;
+        if (extra)
+        {
+            vm_word_t saved[16];
+            for (uint32_t i = 16; i-- > 8;)
+            {
+                if (frame.save_mask & (1 << i))
                 {
-                    call_internal(code.warg0);
-                    break;
+                    saved[i] = _savedRegisters.back();
+                    _savedRegisters.pop_back();
                 }
-                case instruction::callext:
+            }
+
+            frame.save_mask |= extra;
+            for (uint32_t i = 8; i < 16; ++i)
+            {
+                if (extra & (1 << i))
                 {
-                    auto fn = reinterpret_cast<extern_program_func_t>(
-                        _program.externs[code.warg0].value.ureg);
-                    if (fn)
-                    {
-                        fn(&_registers);
-                    }
-                    else
-                    {
-                        _error = "Failed to call external function ";
-                        bool found = false;
-                        for (auto& it : _program.extern_map)
-                        {
-                            if (it.second.idx == code.warg0)
-                            {
-                                _error += it.first;
-                                found = true;
-                                break;
-                            }
-                        }
-
-                        if (!found)
-                        {
-                            _error += "[unknown]";
-                        }
-                        _error += " - pointer was null";
-                        return false;
-                    }
-                    break;
+                    saved[i] = state.registers[i];
                 }
-                case instruction::yield:
+
+                if (frame.save_mask & (1 << i))
                 {
-                    _did_yield = true;
-                    shouldRun = false;
-                    break;
+                    _savedRegisters.push_back(saved[i]);
                 }
-                case instruction::ret:
+            }
+        }
+
+        frame.label = labelId.idx;
+
+#if MINIVM_PROFILER
+        if (_profiling) _profile->replace(labelId.idx);
+#endif
+
+        state.pc = label.pc;
+        return true;
+    }
+
+    bool execution_context::return_internal(vm_execution_registers& state)
+    {
+        auto& frame = _callStack.back();
+
+        if (frame.save_mask)
+        {
+            for (uint32_t i = 16; i-- > 8;)
+            {
+                if (frame.save_mask & (1 << i))
                 {
-                    auto frame = _callStack.back();
-                    _callStack.pop_back();
-                    _registers = frame.state;
-
-                    if (_callStack.size() == 0)
-                    {
-                        shouldRun = false;
-                    }
-                    break;
+                    state.registers[i] = _savedRegisters.back();
+                    _savedRegisters.pop_back();
                 }
-                case instruction::Count:
-                    break;
             }
-            ++_registers.pc;
         }
+
+        _stackTop = state.sp;
+        state.sp = frame.sp;
+        state.pc = frame.return_pc;
+
+        _callStack.pop_back();
+
+#if MINIVM_PROFILER
+        if (_profiling) _profile->leave();
+#endif
+        return _callStack.size() != 0;
+    }
+
+    bool execution_context::add_memory_region(const void* base, size_t size,
+                                              bool writable)
+    {
+        uint64_t start = reinterpret_cast<uint64_t>(base);
+        if (size == 0 || start + size < start)
+        {
+            return false;
+        }
+
+        for (auto& region : _regions)
+        {
+            if (start < region.base + region.size &&
+                region.base < start + size)
+            {
+                return false;
+            }
+        }
+
+        _regions.push_back({start, size, writable});
+        return true;
+    }
+
+    bool execution_context::remove_memory_region(const void* base)
+    {
+        uint64_t start = reinterpret_cast<uint64_t>(base);
+        for (size_t i = 0; i < _regions.size(); ++i)
+        {
+            if (_regions[i].base == start)
+            {
+                _regions.erase(_regions.begin() + i);
+                _lastRegion = memory_region();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execution_context::clear_memory_regions()
+    {
+        _regions.clear();
+        _lastRegion = memory_region();
+    }
+
+    memory_fault execution_context::check_memory(uint64_t address,
+                                                 uint64_t width, bool write)
+    {
+        // Loops usually walk through one buffer, so the region the last
+        // access fell in is tried first
+        uint64_t offset = address - _lastRegion.base;
+        if (offset < _lastRegion.size && width <= _lastRegion.size - offset)
+        {
+            return write && !_lastRegion.writable ? memory_fault::read_only
+                                                  : memory_fault::none;
+        }
+
+        for (auto& region : _regions)
+        {
+            offset = address - region.base;
+            if (offset < region.size && width <= region.size - offset)
+            {
+                _lastRegion = region;
+                return write && !region.writable ? memory_fault::read_only
+                                                 : memory_fault::none;
+            }
+        }
+        return memory_fault::outside_regions;
+    }
+
+    bool execution_context::resume(uint64_t budget)
+    {
+        set_budget(budget);
+        return run();
+    }
+
+    void execution_context::interrupt()
+    {
+        _interrupt.store(true, std::memory_order_relaxed);
+    }
+
+    bool execution_context::was_preempted() const
+    {
+        return _preempted;
+    }
+
+    void execution_context::set_budget(uint64_t budget)
+    {
+        _budget = budget > uint64_t(INT64_MAX) ? INT64_MAX : int64_t(budget);
+    }
+
+    bool execution_context::did_yield() const
+    {
+        return _did_yield;
+    }
+
+    vm_execution_registers& execution_context::get_registers()
+    {
+        return _registers;
+    }
+
+    vm_vector_t* execution_context::get_vector_registers()
+    {
+        return _vectors;
+    }
+
+    const char* execution_context::get_vector_isa()
+    {
+        return vector_kernels::get().isa;
+    }
+
+    void execution_context::set_execution_mode(execution_mode mode)
+    {
+        _mode = mode;
+    }
+
+    execution_mode execution_context::get_execution_mode() const
+    {
+        return _mode;
+    }
+
+    bool execution_context::set_profiling_enabled(bool enabled)
+    {
+#if MINIVM_PROFILER
+        if (enabled && !_profile)
+        {
+            _profile = std::make_unique<execution_profile>(_program);
+        }
+        _profiling = enabled;
+        return true;
+#else
+        (void)enabled;
+        return false;
+#endif
+    }
+
+    execution_profile* execution_context::get_profile()
+    {
+        return _profile.get();
+    }
+
+    bool execution_context::run()
+    {
+        // Only the interpreter reports to the profiler
+        bool native = !_profiling;
+        if (native && _program._aot)
+        {
+            bool result;
+            if (aot_runtime::run(this, result))
+            {
+                return result;
+            }
+        }
+        else if (native && _mode == execution_mode::jit && _program._native)
+        {
+            bool result;
+            if (native_runtime::run(this, result))
+            {
+                return result;
+            }
+
+            // The interpreter picks up from wherever native code stopped,
+            // with whatever budget is left
+        }
+        return execute(this, nullptr);
+    }
+
+    const void* const* execution_context::get_dispatch_table()
+    {
+        const void* const* table = nullptr;
+        execute(nullptr, &table);
+        return table;
+    }
+
+    bool execution_context::execute(execution_context* context,
+                                    const void* const** dispatchTable)
+    {
+#if MINIVM_THREADED_DISPATCH
+        // Must match the order of minivm::instruction exactly
+        static const void* const dispatch_table[] = {
+            &&op_loadc,             &&op_eload,
+            &&op_estore,            &&op_sstore,
+            &&op_sstoreu32,         &&op_sstoreu16,
+            &&op_sstoreu8,          &&op_sstorei32,
+            &&op_sstorei16,         &&op_sstorei8,
+            &&op_sstoref32,         &&op_sload,
+            &&op_sloadu32,          &&op_sloadu16,
+            &&op_sloadu8,           &&op_sloadi32,
+            &&op_sloadi16,          &&op_sloadi8,
+            &&op_sloadf32,          &&op_mstore,
+            &&op_mstoreu32,         &&op_mstoreu16,
+            &&op_mstoreu8,          &&op_mstorei32,
+            &&op_mstorei16,         &&op_mstorei8,
+            &&op_mstoref32,         &&op_mload,
+            &&op_mloadu32,          &&op_mloadu16,
+            &&op_mloadu8,           &&op_mloadi32,
+            &&op_mloadi16,          &&op_mloadi8,
+            &&op_mloadf32,          &&op_addi,
+            &&op_addu,              &&op_addf,
+            &&op_subi,              &&op_subu,
+            &&op_subf,              &&op_muli,
+            &&op_mulu,              &&op_mulf,
+            &&op_divi,              &&op_divu,
+            &&op_divf,              &&op_addi_imm,
+            &&op_addu_imm,          &&op_subi_imm,
+            &&op_subu_imm,          &&op_muli_imm,
+            &&op_mulu_imm,          &&op_divi_imm,
+            &&op_divu_imm,          &&op_addi_const,
+            &&op_addu_const,        &&op_addf_const,
+            &&op_subi_const,        &&op_subu_const,
+            &&op_subf_const,        &&op_muli_const,
+            &&op_mulu_const,        &&op_mulf_const,
+            &&op_divi_const,        &&op_divu_const,
+            &&op_divf_const,        &&op_mov,
+            &&op_utoi,              &&op_utof,
+            &&op_itou,              &&op_itof,
+            &&op_ftoi,              &&op_ftou,
+            &&op_printi,            &&op_printu,
+            &&op_printf,            &&op_prints,
+            &&op_cmp,               &&op_cmp_imm,
+            &&op_cmp_const,         &&op_jump,
+            &&op_jeq,               &&op_jne,
+            &&op_jlti,              &&op_jlei,
+            &&op_jgti,              &&op_jgei,
+            &&op_jltu,              &&op_jleu,
+            &&op_jgtu,              &&op_jgeu,
+            &&op_jltf,              &&op_jlef,
+            &&op_jgtf,              &&op_jgef,
+            &&op_jeqf,              &&op_jnef,
+            &&op_call,              &&op_tailcall,
+            &&op_callext,           &&op_yield,
+            &&op_ret,               &&op_vaddf32,
+            &&op_vsubf32,           &&op_vmulf32,
+            &&op_vdivf32,           &&op_vfmaf32,
+            &&op_vaddf64,           &&op_vsubf64,
+            &&op_vmulf64,           &&op_vdivf64,
+            &&op_vfmaf64,           &&op_vaddi32,
+            &&op_vsubi32,           &&op_vmuli32,
+            &&op_vdivi32,           &&op_vfmai32,
+            &&op_vmov,              &&op_vbroadcastf32,
+            &&op_vbroadcastf64,     &&op_vbroadcasti32,
+            &&op_vshuf32,           &&op_vshuf64,
+            &&op_vsstore,           &&op_vsstore128,
+            &&op_vsload,            &&op_vsload128,
+            &&op_halt,              &&op_loadc_data,
+            &&op_sstore_checked,
+            &&op_sstoreu32_checked, &&op_sstoreu16_checked,
+            &&op_sstoreu8_checked,  &&op_sstorei32_checked,
+            &&op_sstorei16_checked, &&op_sstorei8_checked,
+            &&op_sstoref32_checked, &&op_sload_checked,
+            &&op_sloadu32_checked,  &&op_sloadu16_checked,
+            &&op_sloadu8_checked,   &&op_sloadi32_checked,
+            &&op_sloadi16_checked,  &&op_sloadi8_checked,
+            &&op_sloadf32_checked,  &&op_vsstore_checked,
+            &&op_vsstore128_checked, &&op_vsload_checked,
+            &&op_vsload128_checked, &&op_mstore_checked,
+            &&op_mstoreu32_checked, &&op_mstoreu16_checked,
+            &&op_mstoreu8_checked,  &&op_mstorei32_checked,
+            &&op_mstorei16_checked, &&op_mstorei8_checked,
+            &&op_mstoref32_checked, &&op_mload_checked,
+            &&op_mloadu32_checked,  &&op_mloadu16_checked,
+            &&op_mloadu8_checked,   &&op_mloadi32_checked,
+            &&op_mloadi16_checked,  &&op_mloadi8_checked,
+            &&op_mloadf32_checked,  &&op_loadc_addi,
+            &&op_loadc_addu,        &&op_loadc_addf,
+            &&op_loadc_subi,        &&op_loadc_subu,
+            &&op_loadc_subf,        &&op_loadc_muli,
+            &&op_loadc_mulu,        &&op_loadc_mulf,
+            &&op_eload_addi,        &&op_eload_addu,
+            &&op_eload_addf,        &&op_eload_subi,
+            &&op_eload_subu,        &&op_eload_subf,
+            &&op_eload_muli,        &&op_eload_mulu,
+            &&op_eload_mulf,        &&op_cmp_jeq,
+            &&op_cmp_jne,           &&op_loadc_cmp_jeq,
+            &&op_loadc_cmp_jne,     &&op_addi_cmp_jeq,
+            &&op_addi_cmp_jne,      &&op_addu_cmp_jeq,
+            &&op_addu_cmp_jne,      &&op_addi_imm_cmp_jeq,
+            &&op_addi_imm_cmp_jne,  &&op_cmp_imm_jeq,
+            &&op_cmp_imm_jne,
+        };
+        static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+                          static_cast<size_t>(instruction::Count),
+                      "Dispatch table is out of sync with minivm::instruction");
+
+        if (dispatchTable)
+        {
+            *dispatchTable = dispatch_table;
+            return true;
+        }
+#else
+        if (dispatchTable)
+        {
+            *dispatchTable = nullptr;
+            return true;
+        }
+#endif
+
+        auto& program = context->_program;
+        uint8_t* const stack = context->_stack.data();
+        context->_did_yield = false;
+        context->_preempted = false;
+        int64_t budget = context->_budget;
+
+        // pc and the register file are kept in locals for the duration of
+        // the loop so the compiler is free to keep them out of memory.  They
+        // are written back to _registers whenever we leave execute().
+        const decoded_opcode* const code = program._code.data();
+
+        // Static data is addressed relative to this base, so the program
+        // itself never holds pointers into its own storage
+        const char* const data = program.get_data();
+        const constant_value* const constants = program.constants.data();
+        program_extern_value* const externs = context->get_extern_storage();
+        vm_execution_registers regs = context->_registers;
+        const decoded_opcode* ip = code + regs.pc;
+        vm_vector_t* const vectors = context->_vectors;
+        const vector_kernels& vectorOps = vector_kernels::get();
+        memory_fault memoryFault = memory_fault::none;
+
+#if MINIVM_PROFILER
+        execution_profile* const profile =
+            context->_profiling ? context->_profile.get() : nullptr;
+        if (profile) profile->resume();
+#endif
+
+#if MINIVM_THREADED_DISPATCH
+        VM_DISPATCH();
+#else
+        for (;;)
+        {
+            VM_PROFILE_INSTRUCTION();
+            switch (ip->instruction)
+            {
+#endif
+        VM_CASE(loadc) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0] = constants[op.arg].value;
+            VM_NEXT();
+        }
+        VM_CASE(eload) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0] = externs[op.arg].value;
+            VM_NEXT();
+        }
+        VM_CASE(estore) :
+        {
+            auto& op = *ip;
+            externs[op.arg].value = regs.registers[op.reg0];
+            VM_NEXT();
+        }
+        VM_STACK_STORE(sstore, uint64_t, ureg)
+        VM_STACK_STORE(sstoreu32, uint32_t, ureg)
+        VM_STACK_STORE(sstoreu16, uint16_t, ureg)
+        VM_STACK_STORE(sstoreu8, uint8_t, ureg)
+        VM_STACK_STORE(sstorei32, int32_t, ireg)
+        VM_STACK_STORE(sstorei16, int16_t, ireg)
+        VM_STACK_STORE(sstorei8, int8_t, ireg)
+        VM_STACK_STORE(sstoref32, float, freg)
+
+        VM_STACK_LOAD(sload, uint64_t, ureg)
+        VM_STACK_LOAD(sloadu32, uint32_t, ureg)
+        VM_STACK_LOAD(sloadu16, uint16_t, ureg)
+        VM_STACK_LOAD(sloadu8, uint8_t, ureg)
+        VM_STACK_LOAD(sloadi32, int32_t, ireg)
+        VM_STACK_LOAD(sloadi16, int16_t, ireg)
+        VM_STACK_LOAD(sloadi8, int8_t, ireg)
+        VM_STACK_LOAD(sloadf32, float, freg)
+
+        VM_MEMORY_STORE(mstore, uint64_t, ureg)
+        VM_MEMORY_STORE(mstoreu32, uint32_t, ureg)
+        VM_MEMORY_STORE(mstoreu16, uint16_t, ureg)
+        VM_MEMORY_STORE(mstoreu8, uint8_t, ureg)
+        VM_MEMORY_STORE(mstorei32, int32_t, ireg)
+        VM_MEMORY_STORE(mstorei16, int16_t, ireg)
+        VM_MEMORY_STORE(mstorei8, int8_t, ireg)
+        VM_MEMORY_STORE(mstoref32, float, freg)
+
+        VM_MEMORY_LOAD(mload, uint64_t, ureg)
+        VM_MEMORY_LOAD(mloadu32, uint32_t, ureg)
+        VM_MEMORY_LOAD(mloadu16, uint16_t, ureg)
+        VM_MEMORY_LOAD(mloadu8, uint8_t, ureg)
+        VM_MEMORY_LOAD(mloadi32, int32_t, ireg)
+        VM_MEMORY_LOAD(mloadi16, int16_t, ireg)
+        VM_MEMORY_LOAD(mloadi8, int8_t, ireg)
+        VM_MEMORY_LOAD(mloadf32, float, freg)
+
+        VM_CASE(utoi) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg = regs.registers[op.reg1].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(utof) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].freg = regs.registers[op.reg1].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(itou) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg = regs.registers[op.reg1].ireg;
+            VM_NEXT();
+        }
+        VM_CASE(itof) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].freg = regs.registers[op.reg1].ireg;
+            VM_NEXT();
+        }
+        VM_CASE(ftoi) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg = regs.registers[op.reg1].freg;
+            VM_NEXT();
+        }
+        VM_CASE(ftou) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg = regs.registers[op.reg1].freg;
+            VM_NEXT();
+        }
+        VM_CASE(mov) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg = regs.registers[op.reg1].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(addi) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg + regs.registers[op.reg2].ireg;
+            VM_NEXT();
+        }
+        VM_CASE(addu) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg =
+                regs.registers[op.reg1].ureg + regs.registers[op.reg2].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(addf) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].freg =
+                regs.registers[op.reg1].freg + regs.registers[op.reg2].freg;
+            VM_NEXT();
+        }
+        VM_CASE(subi) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg - regs.registers[op.reg2].ireg;
+            VM_NEXT();
+        }
+        VM_CASE(subu) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg =
+                regs.registers[op.reg1].ureg - regs.registers[op.reg2].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(subf) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].freg =
+                regs.registers[op.reg1].freg - regs.registers[op.reg2].freg;
+            VM_NEXT();
+        }
+        VM_CASE(muli) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg * regs.registers[op.reg2].ireg;
+            VM_NEXT();
+        }
+        VM_CASE(mulu) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg =
+                regs.registers[op.reg1].ureg * regs.registers[op.reg2].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(mulf) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].freg =
+                regs.registers[op.reg1].freg * regs.registers[op.reg2].freg;
+            VM_NEXT();
+        }
+        VM_CASE(divi) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg / regs.registers[op.reg2].ireg;
+            VM_NEXT();
+        }
+        VM_CASE(divu) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg =
+                regs.registers[op.reg1].ureg / regs.registers[op.reg2].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(divf) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].freg =
+                regs.registers[op.reg1].freg / regs.registers[op.reg2].freg;
+            VM_NEXT();
+        }
+
+        VM_ARITH_IMM(addi, ireg, +, int32_t)
+        VM_ARITH_IMM(addu, ureg, +, uint32_t)
+        VM_ARITH_IMM(subi, ireg, -, int32_t)
+        VM_ARITH_IMM(subu, ureg, -, uint32_t)
+        VM_ARITH_IMM(muli, ireg, *, int32_t)
+        VM_ARITH_IMM(mulu, ureg, *, uint32_t)
+        VM_ARITH_IMM(divi, ireg, /, int32_t)
+        VM_ARITH_IMM(divu, ureg, /, uint32_t)
+
+        VM_ARITH_CONST(addi, ireg, +)
+        VM_ARITH_CONST(addu, ureg, +)
+        VM_ARITH_CONST(addf, freg, +)
+        VM_ARITH_CONST(subi, ireg, -)
+        VM_ARITH_CONST(subu, ureg, -)
+        VM_ARITH_CONST(subf, freg, -)
+        VM_ARITH_CONST(muli, ireg, *)
+        VM_ARITH_CONST(mulu, ureg, *)
+        VM_ARITH_CONST(mulf, freg, *)
+        VM_ARITH_CONST(divi, ireg, /)
+        VM_ARITH_CONST(divu, ureg, /)
+        VM_ARITH_CONST(divf, freg, /)
+
+        VM_CASE(printi) :
+        {
+            printf("%zd\n", regs.registers[ip->reg0].ireg);
+            VM_NEXT();
+        }
+        VM_CASE(printu) :
+        {
+            printf("%zu\n", regs.registers[ip->reg0].ureg);
+            VM_NEXT();
+        }
+        VM_CASE(printf) :
+        {
+            printf("%f\n", regs.registers[ip->reg0].freg);
+            VM_NEXT();
+        }
+        VM_CASE(prints) :
+        {
+            printf("%s\n", reinterpret_cast<const char*>(
+                               regs.registers[ip->reg0].ureg));
+            VM_NEXT();
+        }
+        VM_CASE(cmp) :
+        {
+            auto& op = *ip;
+            regs.cmp = regs.registers[op.reg1].ureg !=
+                       regs.registers[op.reg0].ureg;
+            VM_NEXT();
+        }
+        VM_CASE(cmp_imm) :
+        {
+            auto& op = *ip;
+            regs.cmp = regs.registers[op.reg0].ireg != int32_t(op.arg);
+            VM_NEXT();
+        }
+        VM_CASE(cmp_const) :
+        {
+            auto& op = *ip;
+            regs.cmp = regs.registers[op.reg0].ureg !=
+                       constants[op.arg].value.ureg;
+            VM_NEXT();
+        }
+        VM_CASE(jump) :
+        {
+            VM_JUMP(ip->target);
+        }
+        VM_CASE(jeq) :
+        {
+            if (!regs.cmp)
+            {
+                VM_JUMP(ip->target);
+            }
+            VM_NEXT();
+        }
+        VM_CASE(jne) :
+        {
+            if (regs.cmp)
+            {
+                VM_JUMP(ip->target);
+            }
+            VM_NEXT();
+        }
+        VM_CASE(jlti) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ireg <
+                          regs.registers[ip->reg1].ireg,
+                      1);
+        }
+        VM_CASE(jlei) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ireg <=
+                          regs.registers[ip->reg1].ireg,
+                      1);
+        }
+        VM_CASE(jgti) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ireg >
+                          regs.registers[ip->reg1].ireg,
+                      1);
+        }
+        VM_CASE(jgei) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ireg >=
+                          regs.registers[ip->reg1].ireg,
+                      1);
+        }
+        VM_CASE(jltu) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ureg <
+                          regs.registers[ip->reg1].ureg,
+                      1);
+        }
+        VM_CASE(jleu) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ureg <=
+                          regs.registers[ip->reg1].ureg,
+                      1);
+        }
+        VM_CASE(jgtu) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ureg >
+                          regs.registers[ip->reg1].ureg,
+                      1);
+        }
+        VM_CASE(jgeu) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].ureg >=
+                          regs.registers[ip->reg1].ureg,
+                      1);
+        }
+        VM_CASE(jltf) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].freg <
+                          regs.registers[ip->reg1].freg,
+                      1);
+        }
+        VM_CASE(jlef) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].freg <=
+                          regs.registers[ip->reg1].freg,
+                      1);
+        }
+        VM_CASE(jgtf) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].freg >
+                          regs.registers[ip->reg1].freg,
+                      1);
+        }
+        VM_CASE(jgef) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].freg >=
+                          regs.registers[ip->reg1].freg,
+                      1);
+        }
+        VM_CASE(jeqf) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].freg ==
+                          regs.registers[ip->reg1].freg,
+                      1);
+        }
+        VM_CASE(jnef) :
+        {
+            VM_BRANCH(regs.registers[ip->reg0].freg !=
+                          regs.registers[ip->reg1].freg,
+                      1);
+        }
+        VM_CASE(call) :
+        {
+            // The frame stores the return address
+            regs.pc = uint32_t(ip - code) + 1;
+            if (!context->call_internal(regs, ip->arg))
+            {
+                goto fail;
+            }
+            ip = code + regs.pc;
+
+            // Recursion can loop without a backwards branch, so calls are
+            // charged too.  The callee's frame is already set up, so
+            // resuming continues at its first instruction.
+            if (--budget < 0 ||
+                context->_interrupt.load(std::memory_order_relaxed))
+                goto preempt;
+            VM_DISPATCH();
+        }
+        VM_CASE(tailcall) :
+        {
+            if (!context->tailcall_internal(regs, ip->arg))
+            {
+                goto fail;
+            }
+            ip = code + regs.pc;
+
+            if (--budget < 0 ||
+                context->_interrupt.load(std::memory_order_relaxed))
+                goto preempt;
+            VM_DISPATCH();
+        }
+        VM_CASE(callext) :
+        {
+            auto& op = *ip;
+            auto fn = reinterpret_cast<extern_program_func_t>(
+                externs[op.arg].value.ureg);
+            if (fn)
+            {
+                regs.pc = uint32_t(ip - code);
+#if MINIVM_PROFILER
+                if (profile)
+                {
+                    uint64_t start = profile->now();
+                    fn(&regs);
+                    profile->record_extern(op.arg, start);
+                    VM_NEXT();
+                }
+#endif
+                fn(&regs);
+                VM_NEXT();
+            }
+
+            context->_error = "Failed to call external function ";
+            context->_error += program.get_extern_name(op.arg);
+            context->_error += " - pointer was null";
+
+            regs.pc = uint32_t(ip - code);
+            context->_registers = regs;
+#if MINIVM_PROFILER
+            if (profile) profile->pause();
+#endif
+            return false;
+        }
+        VM_CASE(yield) :
+        {
+            context->_did_yield = true;
+            ++ip;
+            goto exit;
+        }
+        VM_CASE(ret) :
+        {
+            bool hasCaller = context->return_internal(regs);
+            ip = code + regs.pc;
+
+            if (!hasCaller)
+            {
+                goto exit;
+            }
+            VM_DISPATCH();
+        }
+
+        VM_VECTOR_ARITH(addf32)
+        VM_VECTOR_ARITH(subf32)
+        VM_VECTOR_ARITH(mulf32)
+        VM_VECTOR_ARITH(divf32)
+        VM_VECTOR_ARITH(fmaf32)
+        VM_VECTOR_ARITH(addf64)
+        VM_VECTOR_ARITH(subf64)
+        VM_VECTOR_ARITH(mulf64)
+        VM_VECTOR_ARITH(divf64)
+        VM_VECTOR_ARITH(fmaf64)
+        VM_VECTOR_ARITH(addi32)
+        VM_VECTOR_ARITH(subi32)
+        VM_VECTOR_ARITH(muli32)
+        VM_VECTOR_ARITH(divi32)
+        VM_VECTOR_ARITH(fmai32)
+
+        VM_CASE(vmov) :
+        {
+            auto& op = *ip;
+            vectors[op.reg0] = vectors[op.reg1];
+            VM_NEXT();
+        }
+        VM_CASE(vbroadcastf32) :
+        {
+            auto& op = *ip;
+            float value = float(regs.registers[op.reg1].freg);
+            for (auto& lane : vectors[op.reg0].f32) lane = value;
+            VM_NEXT();
+        }
+        VM_CASE(vbroadcastf64) :
+        {
+            auto& op = *ip;
+            double value = regs.registers[op.reg1].freg;
+            for (auto& lane : vectors[op.reg0].f64) lane = value;
+            VM_NEXT();
+        }
+        VM_CASE(vbroadcasti32) :
+        {
+            auto& op = *ip;
+            int32_t value = int32_t(regs.registers[op.reg1].ireg);
+            for (auto& lane : vectors[op.reg0].i32) lane = value;
+            VM_NEXT();
+        }
+        VM_CASE(vshuf32) :
+        {
+            auto& op = *ip;
+            uint64_t control = regs.registers[op.reg2].ureg;
+            vm_vector_t source = vectors[op.reg1];
+            for (uint32_t l = 0; l < 8; ++l)
+            {
+                vectors[op.reg0].i32[l] = source.i32[(control >> (4 * l)) & 7];
+            }
+            VM_NEXT();
+        }
+        VM_CASE(vshuf64) :
+        {
+            auto& op = *ip;
+            uint64_t control = regs.registers[op.reg2].ureg;
+            vm_vector_t source = vectors[op.reg1];
+            for (uint32_t l = 0; l < 4; ++l)
+            {
+                vectors[op.reg0].u64[l] = source.u64[(control >> (4 * l)) & 3];
+            }
+            VM_NEXT();
+        }
+
+        VM_VECTOR_STACK_STORE(vsstore, 32)
+        VM_VECTOR_STACK_STORE(vsstore128, 16)
+        VM_VECTOR_STACK_LOAD(vsload, 32)
+        VM_VECTOR_STACK_LOAD(vsload128, 16)
+
+        VM_CASE(halt) :
+        {
+            goto exit;
+        }
+
+        VM_CASE(loadc_data) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg =
+                reinterpret_cast<uint64_t>(data + op.arg);
+            VM_NEXT();
+        }
+
+        VM_FUSED_ARITH_GROUP(loadc, constants)
+        VM_FUSED_ARITH_GROUP(eload, externs)
+
+        VM_CASE(cmp_jeq) :
+        {
+            auto& op = *ip;
+            regs.cmp = regs.registers[op.reg1].ureg !=
+                       regs.registers[op.reg0].ureg;
+            VM_BRANCH(!regs.cmp, 2);
+        }
+        VM_CASE(cmp_jne) :
+        {
+            auto& op = *ip;
+            regs.cmp = regs.registers[op.reg1].ureg !=
+                       regs.registers[op.reg0].ureg;
+            VM_BRANCH(regs.cmp, 2);
+        }
+        VM_CASE(loadc_cmp_jeq) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0] = constants[op.arg].value;
+            regs.cmp = regs.registers[op.reg2].ureg !=
+                       regs.registers[op.reg1].ureg;
+            VM_BRANCH(!regs.cmp, 3);
+        }
+        VM_CASE(loadc_cmp_jne) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0] = constants[op.arg].value;
+            regs.cmp = regs.registers[op.reg2].ureg !=
+                       regs.registers[op.reg1].ureg;
+            VM_BRANCH(regs.cmp, 3);
+        }
+        VM_CASE(addi_cmp_jeq) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg + regs.registers[op.reg2].ireg;
+            regs.cmp = regs.registers[op.reg4].ureg !=
+                       regs.registers[op.reg3].ureg;
+            VM_BRANCH(!regs.cmp, 3);
+        }
+        VM_CASE(addi_cmp_jne) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg + regs.registers[op.reg2].ireg;
+            regs.cmp = regs.registers[op.reg4].ureg !=
+                       regs.registers[op.reg3].ureg;
+            VM_BRANCH(regs.cmp, 3);
+        }
+        VM_CASE(addu_cmp_jeq) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg =
+                regs.registers[op.reg1].ureg + regs.registers[op.reg2].ureg;
+            regs.cmp = regs.registers[op.reg4].ureg !=
+                       regs.registers[op.reg3].ureg;
+            VM_BRANCH(!regs.cmp, 3);
+        }
+        VM_CASE(addu_cmp_jne) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ureg =
+                regs.registers[op.reg1].ureg + regs.registers[op.reg2].ureg;
+            regs.cmp = regs.registers[op.reg4].ureg !=
+                       regs.registers[op.reg3].ureg;
+            VM_BRANCH(regs.cmp, 3);
+        }
+        VM_CASE(addi_imm_cmp_jeq) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg + int32_t(op.arg);
+            regs.cmp = regs.registers[op.reg4].ureg !=
+                       regs.registers[op.reg3].ureg;
+            VM_BRANCH(!regs.cmp, 3);
+        }
+        VM_CASE(addi_imm_cmp_jne) :
+        {
+            auto& op = *ip;
+            regs.registers[op.reg0].ireg =
+                regs.registers[op.reg1].ireg + int32_t(op.arg);
+            regs.cmp = regs.registers[op.reg4].ureg !=
+                       regs.registers[op.reg3].ureg;
+            VM_BRANCH(regs.cmp, 3);
+        }
+        VM_CASE(cmp_imm_jeq) :
+        {
+            auto& op = *ip;
+            regs.cmp = regs.registers[op.reg0].ireg != int32_t(op.arg);
+            VM_BRANCH(!regs.cmp, 2);
+        }
+        VM_CASE(cmp_imm_jne) :
+        {
+            auto& op = *ip;
+            regs.cmp = regs.registers[op.reg0].ireg != int32_t(op.arg);
+            VM_BRANCH(regs.cmp, 2);
+        }
+#if !MINIVM_THREADED_DISPATCH
+                case instruction::Count:
+                    goto exit;
+            }
+        }
+#endif
+
+    stack_error:
+        context->_error =
+            "Stack access out of bounds at pc " + std::to_string(ip - code);
+        goto fail;
+
+    memory_error:
+        context->_error = memoryFault == memory_fault::read_only
+                              ? "Memory write to a read-only region at pc "
+                              : "Memory access outside the context's memory "
+                                "regions at pc ";
+        context->_error += std::to_string(ip - code);
+
+    fail:
+        regs.pc = uint32_t(ip - code);
+        context->_registers = regs;
+#if MINIVM_PROFILER
+        if (profile) profile->pause();
+#endif
+        return false;
+
+    preempt:
+        // Behaves exactly like a yield at ip
+        context->_interrupt.store(false, std::memory_order_relaxed);
+        context->_did_yield = true;
+        context->_preempted = true;
+
+    exit:
+        regs.pc = uint32_t(ip - code);
+        context->_registers = regs;
+#if MINIVM_PROFILER
+        if (profile) profile->pause();
+#endif
         return true;
     }
 
-}  // namespace minivm
\ No newline at end of file
+}  // namespace minivm
@@ -0,0 +1,1326 @@
+#include "native.hpp"
+
+#if MINIVM_HAS_JIT
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <initializer_list>
+#include <vector>
+#endif
+
+namespace minivm
+{
+#if !MINIVM_HAS_JIT
+    std::shared_ptr<const native_code> native_runtime::compile(const program&)
+    {
+        return nullptr;
+    }
+
+    bool native_runtime::run(execution_context*, bool&)
+    {
+        return false;
+    }
+#else
+    // Everything compiled code needs that doesn't live in the register file.
+    // r12 holds a pointer to it for the duration of a run.
+    struct native_frame
+    {
+        execution_context* context;
+        program_extern_value* externs;
+        uint8_t* stack;
+
+        // End of the current frame
+        uint64_t stack_top;
+        const char* data;
+        const std::atomic<bool>* interrupt;
+        int64_t budget;
+
+        // The context's copy of the region the last checked memory access
+        // fell in
+        const memory_region* last_region;
+    };
+
+    enum class native_exit : uint32_t
+    {
+        done,
+        yield,
+        preempt,
+
+        // Hit something the compiler doesn't handle.  regs.pc points at it.
+        fallback,
+    };
+
+    typedef native_exit (*native_entry_t)(native_frame* frame,
+                                          vm_execution_registers* regs,
+                                          const void* target);
+
+    struct native_code
+    {
+        native_code() = default;
+        native_code(const native_code&) = delete;
+        native_code& operator=(const native_code&) = delete;
+
+        ~native_code()
+        {
+            if (memory) munmap(memory, size);
+        }
+
+        void* memory = nullptr;
+        size_t size = 0;
+        native_entry_t entry = nullptr;
+
+        // Address of the code for every pc.  Compiled code indexes this
+        // directly to return to a caller.
+        std::vector<const void*> pcs;
+    };
+
+    // Called from compiled code
+    struct native_helpers
+    {
+        // Both return 0 if the callee's frame doesn't fit on the stack
+        static uint32_t call(native_frame* frame, uint32_t label)
+        {
+            auto context = frame->context;
+            bool called = context->call_internal(context->_registers, label);
+            frame->stack_top = context->_stackTop;
+            return called;
+        }
+
+        static uint32_t tailcall(native_frame* frame, uint32_t label)
+        {
+            auto context = frame->context;
+            bool called =
+                context->tailcall_internal(context->_registers, label);
+            frame->stack_top = context->_stackTop;
+            return called;
+        }
+
+        static uint32_t ret(native_frame* frame)
+        {
+            auto context = frame->context;
+            bool hasCaller = context->return_internal(context->_registers);
+            frame->stack_top = context->_stackTop;
+            return hasCaller;
+        }
+
+        // Returns 0 if the access doesn't fit in one of the context's
+        // memory regions or writes to a read-only one.  The interpreter
+        // re-runs the access and reports which.
+        static uint32_t check_memory(native_frame* frame, uint64_t address,
+                                     uint32_t width, uint32_t write)
+        {
+            return frame->context->check_memory(address, width, write != 0) ==
+                   memory_fault::none;
+        }
+
+        static void printi(int64_t value)
+        {
+            ::printf("%zd\n", value);
+        }
+
+        static void printu(uint64_t value)
+        {
+            ::printf("%zu\n", value);
+        }
+
+        static void printf(double value)
+        {
+            ::printf("%f\n", value);
+        }
+
+        static void prints(const char* value)
+        {
+            ::printf("%s\n", value);
+        }
+
+        static double utof(uint64_t value)
+        {
+            return double(value);
+        }
+
+        static uint64_t ftou(double value)
+        {
+            return uint64_t(value);
+        }
+    };
+
+    namespace
+    {
+        enum gpr : uint8_t
+        {
+            rax = 0,
+            rcx = 1,
+            rdx = 2,
+            rbx = 3,
+            rsp = 4,
+            rbp = 5,
+            rsi = 6,
+            rdi = 7,
+            r12 = 12,
+            r13 = 13,
+            r14 = 14,
+            r15 = 15,
+        };
+
+        // Condition codes, as used by jcc and setcc
+        enum cond : uint8_t
+        {
+            cc_b = 0x2,
+            cc_ae = 0x3,
+            cc_e = 0x4,
+            cc_ne = 0x5,
+            cc_be = 0x6,
+            cc_a = 0x7,
+            cc_s = 0x8,
+            cc_p = 0xA,
+            cc_l = 0xC,
+            cc_ge = 0xD,
+            cc_le = 0xE,
+            cc_g = 0xF,
+        };
+
+        static cond invert(cond cc)
+        {
+            return cond(cc ^ 1);
+        }
+
+        // Just enough of an x86-64 encoder for the templates below.  Memory
+        // operands are always [base + disp32].
+        class x64_emitter
+        {
+        public:
+            size_t size() const
+            {
+                return _code.size();
+            }
+
+            const std::vector<uint8_t>& code() const
+            {
+                return _code;
+            }
+
+            void byte(uint8_t value)
+            {
+                _code.push_back(value);
+            }
+
+            void u32(uint32_t value)
+            {
+                for (int i = 0; i < 4; ++i) byte(uint8_t(value >> (i * 8)));
+            }
+
+            void u64(uint64_t value)
+            {
+                for (int i = 0; i < 8; ++i) byte(uint8_t(value >> (i * 8)));
+            }
+
+            // Generic [prefix] [rex] opcode modrm forms
+            void mem_op(uint8_t prefix, bool wide,
+                        std::initializer_list<uint8_t> opcode, uint8_t reg,
+                        uint8_t base, int32_t disp)
+            {
+                if (prefix) byte(prefix);
+                rex(wide, reg, base);
+                for (auto b : opcode) byte(b);
+                byte(0x80 | ((reg & 7) << 3) | (base & 7));
+                if ((base & 7) == rsp) byte(0x24);
+                u32(uint32_t(disp));
+            }
+
+            void reg_op(uint8_t prefix, bool wide,
+                        std::initializer_list<uint8_t> opcode, uint8_t reg,
+                        uint8_t rm)
+            {
+                if (prefix) byte(prefix);
+                rex(wide, reg, rm);
+                for (auto b : opcode) byte(b);
+                byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+            }
+
+            void load(uint8_t reg, uint8_t base, int32_t disp)
+            {
+                mem_op(0, true, {0x8B}, reg, base, disp);
+            }
+
+            void store(uint8_t base, int32_t disp, uint8_t reg)
+            {
+                mem_op(0, true, {0x89}, reg, base, disp);
+            }
+
+            void mov(uint8_t dst, uint8_t src)
+            {
+                reg_op(0, true, {0x89}, src, dst);
+            }
+
+            void mov_imm64(uint8_t reg, uint64_t value)
+            {
+                rex(true, 0, reg);
+                byte(0xB8 + (reg & 7));
+                u64(value);
+            }
+
+            void mov_imm32(uint8_t reg, uint32_t value)
+            {
+                rex(false, 0, reg);
+                byte(0xB8 + (reg & 7));
+                u32(value);
+            }
+
+            void store_imm32(uint8_t base, int32_t disp, uint32_t value)
+            {
+                mem_op(0, false, {0xC7}, 0, base, disp);
+                u32(value);
+            }
+
+            // reg op= [base + disp], for add (03), sub (2B) and cmp (3B)
+            void alu_mem(uint8_t opcode, uint8_t reg, uint8_t base,
+                         int32_t disp)
+            {
+                mem_op(0, true, {opcode}, reg, base, disp);
+            }
+
+            void imul_mem(uint8_t reg, uint8_t base, int32_t disp)
+            {
+                mem_op(0, true, {0x0F, 0xAF}, reg, base, disp);
+            }
+
+            // reg op= imm32, ext selects add (0), sub (5) or cmp (7)
+            void alu_imm(uint8_t ext, uint8_t reg, int32_t value)
+            {
+                reg_op(0, true, {0x81}, ext, reg);
+                u32(uint32_t(value));
+            }
+
+            void imul_imm(uint8_t reg, int32_t value)
+            {
+                reg_op(0, true, {0x69}, reg, reg);
+                u32(uint32_t(value));
+            }
+
+            void cqo()
+            {
+                byte(0x48);
+                byte(0x99);
+            }
+
+            void zero_rdx()
+            {
+                reg_op(0, false, {0x31}, rdx, rdx);
+            }
+
+            void idiv(uint8_t reg)
+            {
+                reg_op(0, true, {0xF7}, 7, reg);
+            }
+
+            void div(uint8_t reg)
+            {
+                reg_op(0, true, {0xF7}, 6, reg);
+            }
+
+            void setcc_movzx_eax(cond cc)
+            {
+                byte(0x0F);
+                byte(0x90 + cc);
+                byte(0xC0);
+                reg_op(0, false, {0x0F, 0xB6}, rax, rax);
+            }
+
+            void test32(uint8_t reg)
+            {
+                reg_op(0, false, {0x85}, reg, reg);
+            }
+
+            void test64(uint8_t reg)
+            {
+                reg_op(0, true, {0x85}, reg, reg);
+            }
+
+            void cmp_byte_zero(uint8_t base, int32_t disp)
+            {
+                mem_op(0, false, {0x80}, 7, base, disp);
+                byte(0);
+            }
+
+            // SSE2 scalar double ops on xmm registers 0-7
+            void sse_mem(uint8_t prefix, uint8_t opcode, uint8_t xmm,
+                         uint8_t base, int32_t disp, bool wide = false)
+            {
+                mem_op(prefix, wide, {0x0F, opcode}, xmm, base, disp);
+            }
+
+            void movq_xmm_gpr(uint8_t xmm, uint8_t reg)
+            {
+                reg_op(0x66, true, {0x0F, 0x6E}, xmm, reg);
+            }
+
+            void cvtsd2ss(uint8_t xmm)
+            {
+                reg_op(0xF2, false, {0x0F, 0x5A}, xmm, xmm);
+            }
+
+            void call(uint8_t reg)
+            {
+                reg_op(0, false, {0xFF}, 2, reg);
+            }
+
+            void call_abs(const void* fn)
+            {
+                mov_imm64(rax, uint64_t(fn));
+                call(rax);
+            }
+
+            void jmp(uint8_t reg)
+            {
+                reg_op(0, false, {0xFF}, 4, reg);
+            }
+
+            // jmp [table + index * 8]
+            void jmp_table(uint8_t table, uint8_t index)
+            {
+                byte(0xFF);
+                byte(0x24);
+                byte(uint8_t((3 << 6) | ((index & 7) << 3) | (table & 7)));
+            }
+
+            void push(uint8_t reg)
+            {
+                rex(false, 0, reg);
+                byte(0x50 + (reg & 7));
+            }
+
+            void pop(uint8_t reg)
+            {
+                rex(false, 0, reg);
+                byte(0x58 + (reg & 7));
+            }
+
+            void ret()
+            {
+                byte(0xC3);
+            }
+
+            // Branches return the offset of their rel32 for patch()
+            size_t jcc(cond cc)
+            {
+                byte(0x0F);
+                byte(0x80 + cc);
+                u32(0);
+                return size() - 4;
+            }
+
+            size_t jmp()
+            {
+                byte(0xE9);
+                u32(0);
+                return size() - 4;
+            }
+
+            void patch(size_t at, size_t target)
+            {
+                uint32_t rel = uint32_t(int32_t(target - (at + 4)));
+                memcpy(&_code[at], &rel, 4);
+            }
+
+        private:
+            void rex(bool wide, uint8_t reg, uint8_t rm)
+            {
+                uint8_t value = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) |
+                                (rm >> 3);
+                if (value != 0x40) byte(value);
+            }
+
+            std::vector<uint8_t> _code;
+        };
+
+        constexpr int32_t reg_disp(uint32_t reg)
+        {
+            return int32_t(offsetof(vm_execution_registers, registers) +
+                           reg * sizeof(vm_word_t));
+        }
+
+        constexpr int32_t pc_disp = offsetof(vm_execution_registers, pc);
+        constexpr int32_t cmp_disp = offsetof(vm_execution_registers, cmp);
+        constexpr int32_t sp_disp = offsetof(vm_execution_registers, sp);
+
+        // Register assignments for compiled code:
+        //   rbx  vm_execution_registers*
+        //   r12  native_frame*
+        //   r13  remaining budget
+        // rax, rcx, rdx and xmm0-1 are scratch.
+        class native_compiler
+        {
+        public:
+            native_compiler(const std::vector<decoded_opcode>& code,
+                            const std::vector<constant_value>& constants)
+                : _code(code), _constants(constants)
+            {
+            }
+
+            std::shared_ptr<native_code> compile()
+            {
+                emit_prologue();
+
+                _pcOffsets.resize(_code.size());
+                for (uint32_t pc = 0; pc < _code.size(); ++pc)
+                {
+                    _pcOffsets[pc] = _asm.size();
+                    emit_instruction(pc, _code[pc]);
+                }
+
+                for (auto& stub : _stubs)
+                {
+                    _asm.patch(stub.at, _asm.size());
+                    if (stub.pc != no_pc)
+                    {
+                        _asm.store_imm32(rbx, pc_disp, stub.pc);
+                    }
+                    _asm.mov_imm32(rax, uint32_t(stub.reason));
+                    _asm.patch(_asm.jmp(), _exitOffset);
+                }
+
+                for (auto& fixup : _fixups)
+                {
+                    _asm.patch(fixup.at, _pcOffsets[fixup.pc]);
+                }
+
+                return finish();
+            }
+
+        private:
+            static constexpr uint32_t no_pc = UINT32_MAX;
+
+            struct fixup
+            {
+                size_t at;
+                uint32_t pc;
+            };
+
+            struct stub
+            {
+                size_t at;
+                native_exit reason;
+                uint32_t pc;
+            };
+
+            void emit_prologue()
+            {
+                // native_entry_t(frame, regs, target)
+                _asm.push(rbx);
+                _asm.push(rbp);
+                _asm.push(r12);
+                _asm.push(r13);
+                _asm.push(r14);
+                _asm.push(r15);
+
+                // Six pushes leave the stack 8 bytes off 16 byte alignment
+                _asm.alu_imm(5, rsp, 8);
+                _asm.mov(r12, rdi);
+                _asm.mov(rbx, rsi);
+                _asm.load(r13, r12, offsetof(native_frame, budget));
+                _asm.jmp(rdx);
+
+                // Every exit lands here with the reason in eax
+                _exitOffset = _asm.size();
+                _asm.store(r12, offsetof(native_frame, budget), r13);
+                _asm.alu_imm(0, rsp, 8);
+                _asm.pop(r15);
+                _asm.pop(r14);
+                _asm.pop(r13);
+                _asm.pop(r12);
+                _asm.pop(rbp);
+                _asm.pop(rbx);
+                _asm.ret();
+            }
+
+            void exit_at(native_exit reason, uint32_t pc)
+            {
+                _asm.store_imm32(rbx, pc_disp, pc);
+                _asm.mov_imm32(rax, uint32_t(reason));
+                _asm.patch(_asm.jmp(), _exitOffset);
+            }
+
+            void jump_to(uint32_t pc)
+            {
+                _fixups.push_back({_asm.jmp(), pc});
+            }
+
+            void stub_on(cond cc, native_exit reason, uint32_t pc)
+            {
+                _stubs.push_back({_asm.jcc(cc), reason, pc});
+            }
+
+            // Charges the budget and polls the interrupt flag, leaving
+            // through a stub that resumes at pc
+            void emit_budget_check(int64_t cost, uint32_t pc)
+            {
+                _asm.alu_imm(5, r13, int32_t(cost));
+                stub_on(cc_s, native_exit::preempt, pc);
+                _asm.load(rax, r12, offsetof(native_frame, interrupt));
+                _asm.cmp_byte_zero(rax, 0);
+                stub_on(cc_ne, native_exit::preempt, pc);
+            }
+
+            // Branches to target if cc holds.  Backwards branches are charged
+            // the same way the interpreter charges them.
+            void emit_branch(cond cc, uint32_t pc, uint32_t target)
+            {
+                if (target > pc)
+                {
+                    _fixups.push_back({_asm.jcc(cc), target});
+                    return;
+                }
+
+                size_t skip = _asm.jcc(invert(cc));
+                emit_budget_check(int64_t(pc - target) + 1, target);
+                jump_to(target);
+                _asm.patch(skip, _asm.size());
+            }
+
+            void emit_jump(uint32_t pc, uint32_t target)
+            {
+                if (target <= pc)
+                {
+                    emit_budget_check(int64_t(pc - target) + 1, target);
+                }
+                jump_to(target);
+            }
+
+            // rax = frame->stack + sp + registers[reg]
+            void emit_stack_address(uint8_t reg)
+            {
+                _asm.load(rax, r12, offsetof(native_frame, stack));
+                _asm.mem_op(0, false, {0x8B}, rcx, rbx, sp_disp);
+                _asm.reg_op(0, true, {0x01}, rcx, rax);
+                _asm.alu_mem(0x03, rax, rbx, reg_disp(reg));
+            }
+
+            // Stores or loads reg at rax + disp.  instr is one of sstore
+            // through sloadf32, which gives the type.
+            void emit_access(instruction instr, uint8_t reg, int32_t disp)
+            {
+                switch (instr)
+                {
+                    case instruction::sstore:
+                        _asm.load(rcx, rbx, reg_disp(reg));
+                        _asm.store(rax, disp, rcx);
+                        break;
+                    case instruction::sstoreu32:
+                    case instruction::sstorei32:
+                        _asm.load(rcx, rbx, reg_disp(reg));
+                        _asm.mem_op(0, false, {0x89}, rcx, rax, disp);
+                        break;
+                    case instruction::sstoreu16:
+                    case instruction::sstorei16:
+                        _asm.load(rcx, rbx, reg_disp(reg));
+                        _asm.mem_op(0x66, false, {0x89}, rcx, rax, disp);
+                        break;
+                    case instruction::sstoreu8:
+                    case instruction::sstorei8:
+                        _asm.load(rcx, rbx, reg_disp(reg));
+                        _asm.mem_op(0, false, {0x88}, rcx, rax, disp);
+                        break;
+                    case instruction::sstoref32:
+                        _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(reg));
+                        _asm.cvtsd2ss(0);
+                        _asm.sse_mem(0xF3, 0x11, 0, rax, disp);
+                        break;
+
+                    case instruction::sload:
+                        _asm.load(rcx, rax, disp);
+                        _asm.store(rbx, reg_disp(reg), rcx);
+                        break;
+                    case instruction::sloadu32:
+                        _asm.mem_op(0, false, {0x8B}, rcx, rax, disp);
+                        _asm.store(rbx, reg_disp(reg), rcx);
+                        break;
+                    case instruction::sloadu16:
+                        _asm.mem_op(0, false, {0x0F, 0xB7}, rcx, rax, disp);
+                        _asm.store(rbx, reg_disp(reg), rcx);
+                        break;
+                    case instruction::sloadu8:
+                        _asm.mem_op(0, false, {0x0F, 0xB6}, rcx, rax, disp);
+                        _asm.store(rbx, reg_disp(reg), rcx);
+                        break;
+                    case instruction::sloadi32:
+                        _asm.mem_op(0, true, {0x63}, rcx, rax, disp);
+                        _asm.store(rbx, reg_disp(reg), rcx);
+                        break;
+                    case instruction::sloadi16:
+                        _asm.mem_op(0, true, {0x0F, 0xBF}, rcx, rax, disp);
+                        _asm.store(rbx, reg_disp(reg), rcx);
+                        break;
+                    case instruction::sloadi8:
+                        _asm.mem_op(0, true, {0x0F, 0xBE}, rcx, rax, disp);
+                        _asm.store(rbx, reg_disp(reg), rcx);
+                        break;
+                    case instruction::sloadf32:
+                        _asm.sse_mem(0xF3, 0x5A, 0, rax, disp);
+                        _asm.sse_mem(0xF2, 0x11, 0, rbx, reg_disp(reg));
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+
+            // Leaves through the interpreter, which reports the error, unless
+            // the access at pc fits in the frame
+            void emit_stack_check(uint32_t pc, uint8_t reg, int32_t width)
+            {
+                _asm.load(rcx, r12, offsetof(native_frame, stack_top));
+                _asm.mem_op(0, false, {0x8B}, rdx, rbx, sp_disp);
+                _asm.reg_op(0, true, {0x29}, rdx, rcx);
+                _asm.alu_imm(5, rcx, width);
+                stub_on(cc_b, native_exit::fallback, pc);
+                _asm.load(rax, rbx, reg_disp(reg));
+                _asm.reg_op(0, true, {0x39}, rcx, rax);
+                stub_on(cc_a, native_exit::fallback, pc);
+            }
+
+            void emit_int_arith(instruction instr, const decoded_opcode& op)
+            {
+                _asm.load(rax, rbx, reg_disp(op.reg1));
+                switch (instr)
+                {
+                    case instruction::addi:
+                    case instruction::addu:
+                        _asm.alu_mem(0x03, rax, rbx, reg_disp(op.reg2));
+                        break;
+                    case instruction::subi:
+                    case instruction::subu:
+                        _asm.alu_mem(0x2B, rax, rbx, reg_disp(op.reg2));
+                        break;
+                    case instruction::muli:
+                    case instruction::mulu:
+                        _asm.imul_mem(rax, rbx, reg_disp(op.reg2));
+                        break;
+                    case instruction::divi:
+                        _asm.load(rcx, rbx, reg_disp(op.reg2));
+                        _asm.cqo();
+                        _asm.idiv(rcx);
+                        break;
+                    case instruction::divu:
+                        _asm.load(rcx, rbx, reg_disp(op.reg2));
+                        _asm.zero_rdx();
+                        _asm.div(rcx);
+                        break;
+                    default:
+                        break;
+                }
+                _asm.store(rbx, reg_disp(op.reg0), rax);
+            }
+
+            // Same as emit_int_arith with the right hand side in rcx
+            void emit_int_arith_rcx(instruction instr,
+                                    const decoded_opcode& op)
+            {
+                _asm.load(rax, rbx, reg_disp(op.reg1));
+                switch (instr)
+                {
+                    case instruction::addi:
+                    case instruction::addu:
+                        _asm.reg_op(0, true, {0x01}, rcx, rax);
+                        break;
+                    case instruction::subi:
+                    case instruction::subu:
+                        _asm.reg_op(0, true, {0x29}, rcx, rax);
+                        break;
+                    case instruction::muli:
+                    case instruction::mulu:
+                        _asm.reg_op(0, true, {0x0F, 0xAF}, rax, rcx);
+                        break;
+                    case instruction::divi:
+                        _asm.cqo();
+                        _asm.idiv(rcx);
+                        break;
+                    case instruction::divu:
+                        _asm.zero_rdx();
+                        _asm.div(rcx);
+                        break;
+                    default:
+                        break;
+                }
+                _asm.store(rbx, reg_disp(op.reg0), rax);
+            }
+
+            static uint8_t sse_arith_opcode(instruction instr)
+            {
+                switch (instr)
+                {
+                    case instruction::addf:
+                        return 0x58;
+                    case instruction::subf:
+                        return 0x5C;
+                    case instruction::mulf:
+                        return 0x59;
+                    default:
+                        return 0x5E;
+                }
+            }
+
+            void emit_float_arith(instruction instr, const decoded_opcode& op)
+            {
+                _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(op.reg1));
+                _asm.sse_mem(0xF2, sse_arith_opcode(instr), 0, rbx,
+                             reg_disp(op.reg2));
+                _asm.sse_mem(0xF2, 0x11, 0, rbx, reg_disp(op.reg0));
+            }
+
+            // reg0 = reg1 op constant, for the _const forms
+            void emit_const_arith(instruction base, const decoded_opcode& op)
+            {
+                auto value = _constants[op.arg].value.ureg;
+                if (base == instruction::addf || base == instruction::subf ||
+                    base == instruction::mulf || base == instruction::divf)
+                {
+                    _asm.mov_imm64(rax, value);
+                    _asm.movq_xmm_gpr(1, rax);
+                    _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(op.reg1));
+                    _asm.reg_op(0xF2, false, {0x0F, sse_arith_opcode(base)},
+                                0, 1);
+                    _asm.sse_mem(0xF2, 0x11, 0, rbx, reg_disp(op.reg0));
+                    return;
+                }
+
+                _asm.mov_imm64(rcx, value);
+                emit_int_arith_rcx(base, op);
+            }
+
+            void emit_call_helper_value(const void* fn, uint32_t reg,
+                                        bool floating)
+            {
+                if (floating)
+                {
+                    _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(reg));
+                }
+                else
+                {
+                    _asm.load(rdi, rbx, reg_disp(reg));
+                }
+                _asm.call_abs(fn);
+            }
+
+            // Accesses that fit in the region the last one fell in go
+            // straight through.  Anything else asks the context, and leaves
+            // through the interpreter, which reports the error, if the
+            // access doesn't fit in any region.
+            void emit_memory_check(uint32_t pc, const decoded_opcode& op,
+                                   uint32_t width, bool write)
+            {
+                _asm.load(rsi, rbx, reg_disp(op.reg1));
+                _asm.alu_imm(0, rsi, int32_t(op.arg));
+                _asm.load(rcx, r12, offsetof(native_frame, last_region));
+                _asm.mov(rax, rsi);
+                _asm.alu_mem(0x2B, rax, rcx, offsetof(memory_region, base));
+                auto below = _asm.jcc(cc_b);
+                _asm.alu_imm(0, rax, int32_t(width));
+                auto wraps = _asm.jcc(cc_b);
+                _asm.alu_mem(0x3B, rax, rcx, offsetof(memory_region, size));
+                auto past = _asm.jcc(cc_a);
+                size_t readOnly = 0;
+                if (write)
+                {
+                    _asm.cmp_byte_zero(rcx, offsetof(memory_region, writable));
+                    readOnly = _asm.jcc(cc_e);
+                }
+                auto done = _asm.jmp();
+
+                _asm.patch(below, _asm.size());
+                _asm.patch(wraps, _asm.size());
+                _asm.patch(past, _asm.size());
+                if (write)
+                {
+                    _asm.patch(readOnly, _asm.size());
+                }
+                _asm.mov(rdi, r12);
+                _asm.mov_imm32(rdx, width);
+                _asm.mov_imm32(rcx, write ? 1 : 0);
+                _asm.call_abs(reinterpret_cast<const void*>(
+                    &native_helpers::check_memory));
+                _asm.test32(rax);
+                stub_on(cc_e, native_exit::fallback, pc);
+                _asm.patch(done, _asm.size());
+            }
+
+            void emit_instruction(uint32_t pc, const decoded_opcode& op)
+            {
+                if (op.instruction >= instruction::sstore_checked &&
+                    op.instruction <= instruction::sloadf32_checked)
+                {
+                    static const int32_t widths[] = {8, 4, 2, 1, 4, 2, 1, 4};
+                    auto k = uint32_t(op.instruction) -
+                             uint32_t(instruction::sstore_checked);
+                    emit_stack_check(pc, op.reg1, widths[k % 8]);
+
+                    decoded_opcode unchecked = op;
+                    unchecked.instruction = static_cast<instruction>(
+                        uint32_t(instruction::sstore) + k);
+                    emit_instruction(pc, unchecked);
+                    return;
+                }
+
+                if (op.instruction >= instruction::mstore_checked &&
+                    op.instruction <= instruction::mloadf32_checked)
+                {
+                    static const uint32_t widths[] = {8, 4, 2, 1, 4, 2, 1, 4};
+                    auto k = uint32_t(op.instruction) -
+                             uint32_t(instruction::mstore_checked);
+                    emit_memory_check(pc, op, widths[k % 8], k < 8);
+
+                    decoded_opcode unchecked = op;
+                    unchecked.instruction = static_cast<instruction>(
+                        uint32_t(instruction::mstore) + k);
+                    emit_instruction(pc, unchecked);
+                    return;
+                }
+
+                switch (op.instruction)
+                {
+                    case instruction::loadc:
+                        _asm.mov_imm64(
+                            rax, _constants[op.arg].value.ureg);
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::loadc_data:
+                        _asm.load(rax, r12, offsetof(native_frame, data));
+                        _asm.alu_imm(0, rax, int32_t(op.arg));
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::eload:
+                        _asm.load(rcx, r12, offsetof(native_frame, externs));
+                        _asm.load(rax, rcx,
+                                  int32_t(op.arg * sizeof(program_extern_value)));
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::estore:
+                        _asm.load(rcx, r12, offsetof(native_frame, externs));
+                        _asm.load(rax, rbx, reg_disp(op.reg0));
+                        _asm.store(rcx,
+                                   int32_t(op.arg * sizeof(program_extern_value)),
+                                   rax);
+                        break;
+
+                    case instruction::sstore:
+                    case instruction::sstoreu32:
+                    case instruction::sstoreu16:
+                    case instruction::sstoreu8:
+                    case instruction::sstorei32:
+                    case instruction::sstorei16:
+                    case instruction::sstorei8:
+                    case instruction::sstoref32:
+                    case instruction::sload:
+                    case instruction::sloadu32:
+                    case instruction::sloadu16:
+                    case instruction::sloadu8:
+                    case instruction::sloadi32:
+                    case instruction::sloadi16:
+                    case instruction::sloadi8:
+                    case instruction::sloadf32:
+                        emit_stack_address(op.reg1);
+                        emit_access(op.instruction, op.reg0, 0);
+                        break;
+
+                    case instruction::mstore:
+                    case instruction::mstoreu32:
+                    case instruction::mstoreu16:
+                    case instruction::mstoreu8:
+                    case instruction::mstorei32:
+                    case instruction::mstorei16:
+                    case instruction::mstorei8:
+                    case instruction::mstoref32:
+                    case instruction::mload:
+                    case instruction::mloadu32:
+                    case instruction::mloadu16:
+                    case instruction::mloadu8:
+                    case instruction::mloadi32:
+                    case instruction::mloadi16:
+                    case instruction::mloadi8:
+                    case instruction::mloadf32:
+                        _asm.load(rax, rbx, reg_disp(op.reg1));
+                        emit_access(
+                            static_cast<instruction>(
+                                uint32_t(instruction::sstore) +
+                                uint32_t(op.instruction) -
+                                uint32_t(instruction::mstore)),
+                            op.reg0, int32_t(op.arg));
+                        break;
+
+                    case instruction::mov:
+                    case instruction::utoi:
+                    case instruction::itou:
+                        _asm.load(rax, rbx, reg_disp(op.reg1));
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::itof:
+                        _asm.sse_mem(0xF2, 0x2A, 0, rbx, reg_disp(op.reg1),
+                                     true);
+                        _asm.sse_mem(0xF2, 0x11, 0, rbx, reg_disp(op.reg0));
+                        break;
+                    case instruction::ftoi:
+                        _asm.sse_mem(0xF2, 0x2C, rax, rbx, reg_disp(op.reg1),
+                                     true);
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::utof:
+                        emit_call_helper_value(
+                            reinterpret_cast<const void*>(
+                                &native_helpers::utof),
+                            op.reg1, false);
+                        _asm.sse_mem(0xF2, 0x11, 0, rbx, reg_disp(op.reg0));
+                        break;
+                    case instruction::ftou:
+                        emit_call_helper_value(
+                            reinterpret_cast<const void*>(
+                                &native_helpers::ftou),
+                            op.reg1, true);
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+
+                    case instruction::addi:
+                    case instruction::addu:
+                    case instruction::subi:
+                    case instruction::subu:
+                    case instruction::muli:
+                    case instruction::mulu:
+                    case instruction::divi:
+                    case instruction::divu:
+                        emit_int_arith(op.instruction, op);
+                        break;
+                    case instruction::addf:
+                    case instruction::subf:
+                    case instruction::mulf:
+                    case instruction::divf:
+                        emit_float_arith(op.instruction, op);
+                        break;
+
+                    case instruction::addi_imm:
+                    case instruction::addu_imm:
+                        _asm.load(rax, rbx, reg_disp(op.reg1));
+                        _asm.alu_imm(0, rax, int32_t(op.arg));
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::subi_imm:
+                    case instruction::subu_imm:
+                        _asm.load(rax, rbx, reg_disp(op.reg1));
+                        _asm.alu_imm(5, rax, int32_t(op.arg));
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::muli_imm:
+                    case instruction::mulu_imm:
+                        _asm.load(rax, rbx, reg_disp(op.reg1));
+                        _asm.imul_imm(rax, int32_t(op.arg));
+                        _asm.store(rbx, reg_disp(op.reg0), rax);
+                        break;
+                    case instruction::divi_imm:
+                        _asm.mov_imm64(rcx, uint64_t(int64_t(int32_t(op.arg))));
+                        emit_int_arith_rcx(instruction::divi, op);
+                        break;
+                    case instruction::divu_imm:
+                        _asm.mov_imm64(rcx, op.arg);
+                        emit_int_arith_rcx(instruction::divu, op);
+                        break;
+
+                    case instruction::addi_const:
+                    case instruction::addu_const:
+                    case instruction::addf_const:
+                    case instruction::subi_const:
+                    case instruction::subu_const:
+                    case instruction::subf_const:
+                    case instruction::muli_const:
+                    case instruction::mulu_const:
+                    case instruction::mulf_const:
+                    case instruction::divi_const:
+                    case instruction::divu_const:
+                    case instruction::divf_const:
+                    {
+                        // The _const forms are declared in the same order as
+                        // addi..divf
+                        auto base = static_cast<instruction>(
+                            static_cast<uint32_t>(instruction::addi) +
+                            static_cast<uint32_t>(op.instruction) -
+                            static_cast<uint32_t>(instruction::addi_const));
+                        emit_const_arith(base, op);
+                        break;
+                    }
+
+                    case instruction::printi:
+                        emit_call_helper_value(
+                            reinterpret_cast<const void*>(
+                                &native_helpers::printi),
+                            op.reg0, false);
+                        break;
+                    case instruction::printu:
+                        emit_call_helper_value(
+                            reinterpret_cast<const void*>(
+                                &native_helpers::printu),
+                            op.reg0, false);
+                        break;
+                    case instruction::printf:
+                        emit_call_helper_value(
+                            reinterpret_cast<const void*>(
+                                &native_helpers::printf),
+                            op.reg0, true);
+                        break;
+                    case instruction::prints:
+                        emit_call_helper_value(
+                            reinterpret_cast<const void*>(
+                                &native_helpers::prints),
+                            op.reg0, false);
+                        break;
+
+                    case instruction::cmp:
+                        _asm.load(rcx, rbx, reg_disp(op.reg1));
+                        _asm.alu_mem(0x3B, rcx, rbx, reg_disp(op.reg0));
+                        _asm.setcc_movzx_eax(cc_ne);
+                        _asm.mem_op(0, false, {0x89}, rax, rbx, cmp_disp);
+                        break;
+                    case instruction::cmp_imm:
+                        _asm.load(rcx, rbx, reg_disp(op.reg0));
+                        _asm.alu_imm(7, rcx, int32_t(op.arg));
+                        _asm.setcc_movzx_eax(cc_ne);
+                        _asm.mem_op(0, false, {0x89}, rax, rbx, cmp_disp);
+                        break;
+                    case instruction::cmp_const:
+                        _asm.mov_imm64(rcx,
+                                       _constants[op.arg].value.ureg);
+                        _asm.alu_mem(0x3B, rcx, rbx, reg_disp(op.reg0));
+                        _asm.setcc_movzx_eax(cc_ne);
+                        _asm.mem_op(0, false, {0x89}, rax, rbx, cmp_disp);
+                        break;
+
+                    case instruction::jump:
+                        emit_jump(pc, op.target);
+                        break;
+                    case instruction::jeq:
+                    case instruction::jne:
+                        _asm.mem_op(0, false, {0x8B}, rax, rbx, cmp_disp);
+                        _asm.test32(rax);
+                        emit_branch(op.instruction == instruction::jeq ? cc_e
+                                                                       : cc_ne,
+                                    pc, op.target);
+                        break;
+
+                    case instruction::jlti:
+                    case instruction::jlei:
+                    case instruction::jgti:
+                    case instruction::jgei:
+                    case instruction::jltu:
+                    case instruction::jleu:
+                    case instruction::jgtu:
+                    case instruction::jgeu:
+                    {
+                        static const cond conds[] = {cc_l, cc_le, cc_g,
+                                                     cc_ge, cc_b, cc_be,
+                                                     cc_a, cc_ae};
+                        auto index = static_cast<uint32_t>(op.instruction) -
+                                     static_cast<uint32_t>(instruction::jlti);
+                        _asm.load(rax, rbx, reg_disp(op.reg0));
+                        _asm.alu_mem(0x3B, rax, rbx, reg_disp(op.reg1));
+                        emit_branch(conds[index], pc, op.target);
+                        break;
+                    }
+
+                    // ucomisd only has unsigned-style flags, and unordered
+                    // compares set CF, so a < b is tested as b > a to make
+                    // NaNs fall through like they do in C++
+                    case instruction::jltf:
+                    case instruction::jlef:
+                        _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(op.reg1));
+                        _asm.sse_mem(0x66, 0x2E, 0, rbx, reg_disp(op.reg0));
+                        emit_branch(op.instruction == instruction::jltf ? cc_a
+                                                                        : cc_ae,
+                                    pc, op.target);
+                        break;
+                    case instruction::jgtf:
+                    case instruction::jgef:
+                        _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(op.reg0));
+                        _asm.sse_mem(0x66, 0x2E, 0, rbx, reg_disp(op.reg1));
+                        emit_branch(op.instruction == instruction::jgtf ? cc_a
+                                                                        : cc_ae,
+                                    pc, op.target);
+                        break;
+                    case instruction::jeqf:
+                    {
+                        _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(op.reg0));
+                        _asm.sse_mem(0x66, 0x2E, 0, rbx, reg_disp(op.reg1));
+                        size_t unordered = _asm.jcc(cc_p);
+                        emit_branch(cc_e, pc, op.target);
+                        _asm.patch(unordered, _asm.size());
+                        break;
+                    }
+                    case instruction::jnef:
+                        _asm.sse_mem(0xF2, 0x10, 0, rbx, reg_disp(op.reg0));
+                        _asm.sse_mem(0x66, 0x2E, 0, rbx, reg_disp(op.reg1));
+                        emit_branch(cc_p, pc, op.target);
+                        emit_branch(cc_ne, pc, op.target);
+                        break;
+
+                    case instruction::call:
+                    case instruction::tailcall:
+                    {
+                        bool tail = op.instruction == instruction::tailcall;
+                        if (!tail)
+                        {
+                            _asm.store_imm32(rbx, pc_disp, pc + 1);
+                        }
+                        _asm.mov(rdi, r12);
+                        _asm.mov_imm32(rsi, op.arg);
+                        _asm.call_abs(
+                            tail ? reinterpret_cast<const void*>(
+                                       &native_helpers::tailcall)
+                                 : reinterpret_cast<const void*>(
+                                       &native_helpers::call));
+
+                        // The interpreter reports stack overflows
+                        _asm.test32(rax);
+                        stub_on(cc_e, native_exit::fallback, pc);
+                        emit_budget_check(1, op.target);
+                        jump_to(op.target);
+                        break;
+                    }
+                    case instruction::ret:
+                    {
+                        _asm.mov(rdi, r12);
+                        _asm.call_abs(
+                            reinterpret_cast<const void*>(&native_helpers::ret));
+                        _asm.test32(rax);
+                        stub_on(cc_e, native_exit::done, no_pc);
+
+                        // Continue wherever the caller left off
+                        _asm.mem_op(0, false, {0x8B}, rax, rbx, pc_disp);
+                        _asm.mov_imm64(rcx, 0);
+                        _tableLoads.push_back(_asm.size() - 8);
+                        _asm.jmp_table(rcx, rax);
+                        break;
+                    }
+                    case instruction::callext:
+                    {
+                        _asm.load(rcx, r12, offsetof(native_frame, externs));
+                        _asm.load(rax, rcx,
+                                  int32_t(op.arg * sizeof(program_extern_value)));
+                        _asm.test64(rax);
+
+                        // The interpreter reports unbound externs
+                        stub_on(cc_e, native_exit::fallback, pc);
+                        _asm.store_imm32(rbx, pc_disp, pc);
+                        _asm.mov(rdi, rbx);
+                        _asm.call(rax);
+                        break;
+                    }
+                    case instruction::yield:
+                        exit_at(native_exit::yield, pc + 1);
+                        break;
+                    case instruction::halt:
+                        exit_at(native_exit::done, pc);
+                        break;
+
+                    default:
+                        exit_at(native_exit::fallback, pc);
+                        break;
+                }
+            }
+
+            std::shared_ptr<native_code> finish()
+            {
+                auto result = std::make_shared<native_code>();
+
+                size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+                size_t size = (_asm.size() + pageSize - 1) & ~(pageSize - 1);
+                void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED) return nullptr;
+
+                result->memory = memory;
+                result->size = size;
+
+                auto base = static_cast<uint8_t*>(memory);
+                result->pcs.resize(_pcOffsets.size());
+                for (size_t i = 0; i < _pcOffsets.size(); ++i)
+                {
+                    result->pcs[i] = base + _pcOffsets[i];
+                }
+
+                // ret jumps through the pc table, which only has an address
+                // once the table exists
+                std::vector<uint8_t> code = _asm.code();
+                uint64_t table = uint64_t(result->pcs.data());
+                for (auto at : _tableLoads)
+                {
+                    memcpy(&code[at], &table, sizeof(table));
+                }
+
+                memcpy(memory, code.data(), code.size());
+                if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+                {
+                    return nullptr;
+                }
+
+                result->entry = reinterpret_cast<native_entry_t>(memory);
+                return result;
+            }
+
+        private:
+            const std::vector<decoded_opcode>& _code;
+            const std::vector<constant_value>& _constants;
+            x64_emitter _asm;
+            size_t _exitOffset = 0;
+            std::vector<size_t> _pcOffsets;
+            std::vector<fixup> _fixups;
+            std::vector<stub> _stubs;
+            std::vector<size_t> _tableLoads;
+        };
+    }  // namespace
+
+    std::shared_ptr<const native_code> native_runtime::compile(
+        const program& program)
+    {
+        native_compiler compiler(program._code, program.constants);
+        return compiler.compile();
+    }
+
+    bool native_runtime::run(execution_context* context, bool& result)
+    {
+        auto native = context->_program._native.get();
+        auto& regs = context->_registers;
+
+        native_frame frame;
+        frame.context = context;
+        frame.externs = context->get_extern_storage();
+        frame.stack = context->_stack.data();
+        frame.stack_top = context->_stackTop;
+        frame.data = context->_program.get_data();
+        frame.interrupt = &context->_interrupt;
+        frame.budget = context->_budget;
+        frame.last_region = &context->_lastRegion;
+
+        context->_did_yield = false;
+        context->_preempted = false;
+
+        auto exit = native->entry(&frame, &regs, native->pcs[regs.pc]);
+        context->_budget = frame.budget;
+
+        switch (exit)
+        {
+            case native_exit::done:
+                result = true;
+                return true;
+            case native_exit::yield:
+                context->_did_yield = true;
+                result = true;
+                return true;
+            case native_exit::preempt:
+                context->_interrupt.store(false, std::memory_order_relaxed);
+                context->_did_yield = true;
+                context->_preempted = true;
+                result = true;
+                return true;
+            case native_exit::fallback:
+                break;
+        }
+        return false;
+    }
+#endif
+}  // namespace minivm
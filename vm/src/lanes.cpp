@@ -0,0 +1,496 @@
+#include <string.h>
+#include <algorithm>
+
+#include <minivm/lanes.hpp>
+
+// The lockstep loop is compiled twice on x86-64: once for the baseline ISA
+// and once for AVX2, picked at runtime.  Both are the same inlined body, the
+// AVX2 copy just lets the compiler use wider vectors for the lane loops.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define MINIVM_LANES_AVX2 1
+#define MINIVM_LANES_INLINE inline __attribute__((always_inline))
+#else
+#define MINIVM_LANES_AVX2 0
+#define MINIVM_LANES_INLINE inline
+#endif
+
+// Applies expr to every lane.  The loops have a constant trip count and no
+// dependencies between lanes, so they vectorize.
+#define LANES(expr)                                  \
+    for (uint32_t l = 0; l < lane_count; ++l)        \
+    {                                                \
+        expr;                                        \
+    }
+
+// Jumps to target.  Backwards jumps poll the interrupt flag, and leave
+// lockstep at the branch (the last of width slots) so that the scalar
+// interpreter sees the interrupt and preempts.
+#define LANE_JUMP(target, width)                                         \
+    {                                                                    \
+        const decoded_opcode* next = code + (target);                    \
+        if (next <= ip &&                                                \
+            in.interrupt->load(std::memory_order_relaxed))               \
+        {                                                                \
+            pc = uint32_t(ip - code) + (width) - 1;                        \
+            return false;                                                \
+        }                                                                \
+        ip = next;                                                       \
+    }
+
+// Branches if cond holds in every lane and skips width slots if it holds in
+// none.  Otherwise the lanes diverge and leave lockstep at the branch, which
+// is always the last of the width slots.
+#define LANE_BRANCH(width)                              \
+    {                                                   \
+        uint32_t taken = 0;                             \
+        LANES(taken += cond[l]);                        \
+        if (taken == lane_count)                        \
+        {                                               \
+            LANE_JUMP(op.target, width);                \
+        }                                               \
+        else if (taken == 0)                            \
+        {                                               \
+            ip += width;                                \
+        }                                               \
+        else                                            \
+        {                                               \
+            pc = uint32_t(ip - code) + (width) - 1;       \
+            return false;                               \
+        }                                               \
+        break;                                          \
+    }
+
+#define LANE_ARITH(name, field, oper)                                   \
+    case instruction::name:                                             \
+        LANES(r[op.reg0][l].field =                                     \
+                  r[op.reg1][l].field oper r[op.reg2][l].field);        \
+        ++ip;                                                           \
+        break;
+
+#define LANE_ARITH_IMM(name, field, oper, type)                         \
+    case instruction::name##_imm:                                       \
+    {                                                                   \
+        auto imm = type(op.arg);                                        \
+        LANES(r[op.reg0][l].field = r[op.reg1][l].field oper imm);      \
+        ++ip;                                                           \
+        break;                                                          \
+    }
+
+#define LANE_ARITH_CONST(name, field, oper)                             \
+    case instruction::name##_const:                                     \
+    {                                                                   \
+        auto value = constants[op.arg].value.field;                     \
+        LANES(r[op.reg0][l].field = r[op.reg1][l].field oper value);    \
+        ++ip;                                                           \
+        break;                                                          \
+    }
+
+#define LANE_FUSED_ARITH(first, source, name, field, oper)              \
+    case instruction::first##_##name:                                   \
+    {                                                                   \
+        auto value = source[op.arg].value;                              \
+        LANES(r[op.reg0][l] = value);                                   \
+        LANES(r[op.reg1][l].field =                                     \
+                  r[op.reg2][l].field oper r[op.reg3][l].field);        \
+        ip += 2;                                                        \
+        break;                                                          \
+    }
+
+#define LANE_FUSED_ARITH_GROUP(first, source)      \
+    LANE_FUSED_ARITH(first, source, addi, ireg, +) \
+    LANE_FUSED_ARITH(first, source, addu, ureg, +) \
+    LANE_FUSED_ARITH(first, source, addf, freg, +) \
+    LANE_FUSED_ARITH(first, source, subi, ireg, -) \
+    LANE_FUSED_ARITH(first, source, subu, ureg, -) \
+    LANE_FUSED_ARITH(first, source, subf, freg, -) \
+    LANE_FUSED_ARITH(first, source, muli, ireg, *) \
+    LANE_FUSED_ARITH(first, source, mulu, ureg, *) \
+    LANE_FUSED_ARITH(first, source, mulf, freg, *)
+
+#define LANE_CONVERT(name, to, from)                     \
+    case instruction::name:                              \
+        LANES(r[op.reg0][l].to = r[op.reg1][l].from);    \
+        ++ip;                                            \
+        break;
+
+#define LANE_COMPARE_BRANCH(name, field, oper)                           \
+    case instruction::name:                                              \
+        LANES(cond[l] = r[op.reg0][l].field oper r[op.reg1][l].field);   \
+        LANE_BRANCH(1)
+
+namespace minivm
+{
+    static constexpr uint32_t lane_count = lane_executor::lane_count;
+
+    struct lane_executor::lane_code
+    {
+        const decoded_opcode* code;
+        const constant_value* constants;
+        const program_extern_value* externs;
+        const char* data;
+        const std::atomic<bool>* interrupt;
+    };
+
+    struct lane_kernels
+    {
+        // Mirrors the interpreter's handlers for everything that can run in
+        // lockstep
+        static MINIVM_LANES_INLINE bool lockstep(
+            lane_executor& executor, const lane_executor::lane_code& in,
+            uint32_t& pc)
+        {
+            const decoded_opcode* const code = in.code;
+            const constant_value* const constants = in.constants;
+            const program_extern_value* const externs = in.externs;
+            const char* const data = in.data;
+
+            auto& r = executor._registers;
+            auto& cmp = executor._cmp;
+            uint8_t cond[lane_count];
+
+            const decoded_opcode* ip = code + pc;
+            for (;;)
+            {
+                auto& op = *ip;
+                switch (op.instruction)
+                {
+                    case instruction::loadc:
+                    {
+                        auto value = constants[op.arg].value;
+                        LANES(r[op.reg0][l] = value);
+                        ++ip;
+                        break;
+                    }
+                    case instruction::loadc_data:
+                    {
+                        auto value = reinterpret_cast<uint64_t>(data + op.arg);
+                        LANES(r[op.reg0][l].ureg = value);
+                        ++ip;
+                        break;
+                    }
+                    case instruction::eload:
+                    {
+                        auto value = externs[op.arg].value;
+                        LANES(r[op.reg0][l] = value);
+                        ++ip;
+                        break;
+                    }
+
+                    LANE_CONVERT(mov, ureg, ureg)
+                    LANE_CONVERT(utoi, ireg, ureg)
+                    LANE_CONVERT(utof, freg, ureg)
+                    LANE_CONVERT(itou, ureg, ireg)
+                    LANE_CONVERT(itof, freg, ireg)
+                    LANE_CONVERT(ftoi, ireg, freg)
+                    LANE_CONVERT(ftou, ureg, freg)
+
+                    LANE_ARITH(addi, ireg, +)
+                    LANE_ARITH(addu, ureg, +)
+                    LANE_ARITH(addf, freg, +)
+                    LANE_ARITH(subi, ireg, -)
+                    LANE_ARITH(subu, ureg, -)
+                    LANE_ARITH(subf, freg, -)
+                    LANE_ARITH(muli, ireg, *)
+                    LANE_ARITH(mulu, ureg, *)
+                    LANE_ARITH(mulf, freg, *)
+                    LANE_ARITH(divi, ireg, /)
+                    LANE_ARITH(divu, ureg, /)
+                    LANE_ARITH(divf, freg, /)
+
+                    LANE_ARITH_IMM(addi, ireg, +, int32_t)
+                    LANE_ARITH_IMM(addu, ureg, +, uint32_t)
+                    LANE_ARITH_IMM(subi, ireg, -, int32_t)
+                    LANE_ARITH_IMM(subu, ureg, -, uint32_t)
+                    LANE_ARITH_IMM(muli, ireg, *, int32_t)
+                    LANE_ARITH_IMM(mulu, ureg, *, uint32_t)
+                    LANE_ARITH_IMM(divi, ireg, /, int32_t)
+                    LANE_ARITH_IMM(divu, ureg, /, uint32_t)
+
+                    LANE_ARITH_CONST(addi, ireg, +)
+                    LANE_ARITH_CONST(addu, ureg, +)
+                    LANE_ARITH_CONST(addf, freg, +)
+                    LANE_ARITH_CONST(subi, ireg, -)
+                    LANE_ARITH_CONST(subu, ureg, -)
+                    LANE_ARITH_CONST(subf, freg, -)
+                    LANE_ARITH_CONST(muli, ireg, *)
+                    LANE_ARITH_CONST(mulu, ureg, *)
+                    LANE_ARITH_CONST(mulf, freg, *)
+                    LANE_ARITH_CONST(divi, ireg, /)
+                    LANE_ARITH_CONST(divu, ureg, /)
+                    LANE_ARITH_CONST(divf, freg, /)
+
+                    LANE_FUSED_ARITH_GROUP(loadc, constants)
+                    LANE_FUSED_ARITH_GROUP(eload, externs)
+
+                    case instruction::cmp:
+                        LANES(cmp[l] = r[op.reg1][l].ureg != r[op.reg0][l].ureg);
+                        ++ip;
+                        break;
+                    case instruction::cmp_imm:
+                    {
+                        auto imm = int32_t(op.arg);
+                        LANES(cmp[l] = r[op.reg0][l].ireg != imm);
+                        ++ip;
+                        break;
+                    }
+                    case instruction::cmp_const:
+                    {
+                        auto value = constants[op.arg].value.ureg;
+                        LANES(cmp[l] = r[op.reg0][l].ureg != value);
+                        ++ip;
+                        break;
+                    }
+
+                    case instruction::jump:
+                        LANE_JUMP(op.target, 1);
+                        break;
+                    case instruction::jeq:
+                        LANES(cond[l] = !cmp[l]);
+                        LANE_BRANCH(1)
+                    case instruction::jne:
+                        LANES(cond[l] = cmp[l] != 0);
+                        LANE_BRANCH(1)
+
+                    LANE_COMPARE_BRANCH(jlti, ireg, <)
+                    LANE_COMPARE_BRANCH(jlei, ireg, <=)
+                    LANE_COMPARE_BRANCH(jgti, ireg, >)
+                    LANE_COMPARE_BRANCH(jgei, ireg, >=)
+                    LANE_COMPARE_BRANCH(jltu, ureg, <)
+                    LANE_COMPARE_BRANCH(jleu, ureg, <=)
+                    LANE_COMPARE_BRANCH(jgtu, ureg, >)
+                    LANE_COMPARE_BRANCH(jgeu, ureg, >=)
+                    LANE_COMPARE_BRANCH(jltf, freg, <)
+                    LANE_COMPARE_BRANCH(jlef, freg, <=)
+                    LANE_COMPARE_BRANCH(jgtf, freg, >)
+                    LANE_COMPARE_BRANCH(jgef, freg, >=)
+                    LANE_COMPARE_BRANCH(jeqf, freg, ==)
+                    LANE_COMPARE_BRANCH(jnef, freg, !=)
+
+                    case instruction::cmp_jeq:
+                    case instruction::cmp_jne:
+                    {
+                        bool eq = op.instruction == instruction::cmp_jeq;
+                        LANES(cmp[l] = r[op.reg1][l].ureg != r[op.reg0][l].ureg);
+                        LANES(cond[l] = (cmp[l] != 0) != eq);
+                        LANE_BRANCH(2)
+                    }
+                    case instruction::cmp_imm_jeq:
+                    case instruction::cmp_imm_jne:
+                    {
+                        bool eq = op.instruction == instruction::cmp_imm_jeq;
+                        auto imm = int32_t(op.arg);
+                        LANES(cmp[l] = r[op.reg0][l].ireg != imm);
+                        LANES(cond[l] = (cmp[l] != 0) != eq);
+                        LANE_BRANCH(2)
+                    }
+                    case instruction::loadc_cmp_jeq:
+                    case instruction::loadc_cmp_jne:
+                    {
+                        bool eq = op.instruction == instruction::loadc_cmp_jeq;
+                        auto value = constants[op.arg].value;
+                        LANES(r[op.reg0][l] = value);
+                        LANES(cmp[l] = r[op.reg2][l].ureg != r[op.reg1][l].ureg);
+                        LANES(cond[l] = (cmp[l] != 0) != eq);
+                        LANE_BRANCH(3)
+                    }
+                    case instruction::addi_cmp_jeq:
+                    case instruction::addi_cmp_jne:
+                    {
+                        bool eq = op.instruction == instruction::addi_cmp_jeq;
+                        LANES(r[op.reg0][l].ireg =
+                                  r[op.reg1][l].ireg + r[op.reg2][l].ireg);
+                        LANES(cmp[l] = r[op.reg4][l].ureg != r[op.reg3][l].ureg);
+                        LANES(cond[l] = (cmp[l] != 0) != eq);
+                        LANE_BRANCH(3)
+                    }
+                    case instruction::addu_cmp_jeq:
+                    case instruction::addu_cmp_jne:
+                    {
+                        bool eq = op.instruction == instruction::addu_cmp_jeq;
+                        LANES(r[op.reg0][l].ureg =
+                                  r[op.reg1][l].ureg + r[op.reg2][l].ureg);
+                        LANES(cmp[l] = r[op.reg4][l].ureg != r[op.reg3][l].ureg);
+                        LANES(cond[l] = (cmp[l] != 0) != eq);
+                        LANE_BRANCH(3)
+                    }
+                    case instruction::addi_imm_cmp_jeq:
+                    case instruction::addi_imm_cmp_jne:
+                    {
+                        bool eq =
+                            op.instruction == instruction::addi_imm_cmp_jeq;
+                        auto imm = int32_t(op.arg);
+                        LANES(r[op.reg0][l].ireg = r[op.reg1][l].ireg + imm);
+                        LANES(cmp[l] = r[op.reg4][l].ureg != r[op.reg3][l].ureg);
+                        LANES(cond[l] = (cmp[l] != 0) != eq);
+                        LANE_BRANCH(3)
+                    }
+
+                    // Nothing has been called in lockstep, so this returns
+                    // from the entry label
+                    case instruction::ret:
+                        return true;
+
+                    default:
+                        pc = uint32_t(ip - code);
+                        return false;
+                }
+            }
+        }
+
+        static bool lockstep_generic(lane_executor& executor,
+                                     const lane_executor::lane_code& code,
+                                     uint32_t& pc)
+        {
+            return lockstep(executor, code, pc);
+        }
+
+#if MINIVM_LANES_AVX2
+        __attribute__((target("avx2"))) static bool lockstep_avx2(
+            lane_executor& executor, const lane_executor::lane_code& code,
+            uint32_t& pc)
+        {
+            return lockstep(executor, code, pc);
+        }
+#endif
+    };
+
+    lane_executor::lane_executor(execution_context& context)
+        : _context(context),
+          _lockstep(&lane_kernels::lockstep_generic),
+          _isa("generic"),
+          _lockstepCount(0),
+          _scalarCount(0)
+    {
+#if MINIVM_LANES_AVX2
+        if (__builtin_cpu_supports("avx2"))
+        {
+            _lockstep = &lane_kernels::lockstep_avx2;
+            _isa = "avx2";
+        }
+#endif
+    }
+
+    size_t lane_executor::run(program_label_id_t label, const vm_word_t* args,
+                              uint32_t argCount, vm_word_t* results,
+                              uint32_t resultCount, size_t count)
+    {
+        if (argCount > 8 || resultCount > 8)
+        {
+            _context._error = "Batches pass at most 8 arguments and results";
+            return 0;
+        }
+
+        if (!_context.prepare_call(label))
+        {
+            return 0;
+        }
+
+        // Scalar runs change the context's registers, so every block starts
+        // from a copy
+        vm_execution_registers base = _context._registers;
+        auto& program = _context._program;
+        uint32_t entry = program.get_label(label).pc;
+
+        lane_code code;
+        code.code = program._code.data();
+        code.constants = program.constants.data();
+        code.externs = _context.get_extern_storage();
+        code.data = program.get_data();
+        code.interrupt = &_context._interrupt;
+
+        for (size_t first = 0; first < count; first += lane_count)
+        {
+            // Spare lanes in the last block repeat its first record, so they
+            // never diverge from it or fault where it wouldn't
+            auto active = uint32_t(std::min<size_t>(lane_count, count - first));
+            for (uint32_t l = 0; l < lane_count; ++l)
+            {
+                const vm_word_t* record =
+                    args + (first + (l < active ? l : 0)) * argCount;
+                for (uint32_t reg = 0; reg < 16; ++reg)
+                {
+                    _registers[reg][l] =
+                        reg < argCount ? record[reg] : base.registers[reg];
+                }
+                _cmp[l] = base.cmp;
+            }
+
+            uint32_t pc = entry;
+            if (_lockstep(*this, code, pc))
+            {
+                for (uint32_t l = 0; l < active; ++l)
+                {
+                    for (uint32_t reg = 0; reg < resultCount; ++reg)
+                    {
+                        results[(first + l) * resultCount + reg] =
+                            _registers[reg][l];
+                    }
+                }
+                _lockstepCount += active;
+                continue;
+            }
+
+            for (uint32_t l = 0; l < active; ++l)
+            {
+                if (!finish_scalar(label, l, pc))
+                {
+                    return first + l;
+                }
+
+                memcpy(results + (first + l) * resultCount,
+                       _context._registers.registers,
+                       resultCount * sizeof(vm_word_t));
+                ++_scalarCount;
+            }
+        }
+        return count;
+    }
+
+    bool lane_executor::finish_scalar(program_label_id_t label, uint32_t lane,
+                                      uint32_t pc)
+    {
+        // Enter the label as run_batch would, then pick up where the lanes
+        // stopped.  Nothing the lanes ran touched the stack, so the fresh
+        // frame is all the state they had.
+        auto& regs = _context._registers;
+        if (!_context.call_internal(regs, label))
+        {
+            return false;
+        }
+
+        for (uint32_t reg = 0; reg < 16; ++reg)
+        {
+            regs.registers[reg] = _registers[reg][lane];
+        }
+        regs.cmp = _cmp[lane];
+        regs.pc = pc;
+
+        _context._budget = INT64_MAX;
+        if (!_context.run())
+        {
+            return false;
+        }
+
+        if (_context._did_yield)
+        {
+            _context._error = "Yielded while being called from the host";
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t lane_executor::get_lockstep_count() const
+    {
+        return _lockstepCount;
+    }
+
+    uint64_t lane_executor::get_scalar_count() const
+    {
+        return _scalarCount;
+    }
+
+    const char* lane_executor::get_isa() const
+    {
+        return _isa;
+    }
+}  // namespace minivm
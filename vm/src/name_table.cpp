@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include <minivm/vm.hpp>
+
+namespace minivm
+{
+    // FNV-1a
+    static uint32_t hash_name(const std::string_view& name)
+    {
+        uint32_t hash = 2166136261u;
+        for (char c : name)
+        {
+            hash ^= uint8_t(c);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    static bool name_equals(const char* data, uint32_t name,
+                            const std::string_view& str)
+    {
+        // Names in static data are null terminated, so strncmp stops at the
+        // end of a shorter name rather than reading past it
+        const char* stored = data + name;
+        return strncmp(stored, str.data(), str.size()) == 0 &&
+               stored[str.size()] == 0;
+    }
+
+    void name_table::reset(size_t count)
+    {
+        // Keep the load factor at or below one half
+        size_t capacity = 8;
+        while (capacity < count * 2)
+        {
+            capacity *= 2;
+        }
+
+        _entries.assign(capacity, {0, 0, empty});
+    }
+
+    void name_table::insert(const char* data, uint32_t name, uint32_t idx)
+    {
+        std::string_view str(data + name);
+        uint32_t hash = hash_name(str);
+        size_t mask = _entries.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask)
+        {
+            auto& entry = _entries[slot];
+            if (entry.idx == empty)
+            {
+                entry = {hash, name, idx};
+                return;
+            }
+
+            // First definition wins, matching what the assembler accepts
+            if (entry.hash == hash && name_equals(data, entry.name, str))
+                return;
+        }
+    }
+
+    bool name_table::find(const char* data, const std::string_view& name,
+                          uint32_t& idx) const
+    {
+        if (_entries.empty()) return false;
+
+        uint32_t hash = hash_name(name);
+        size_t mask = _entries.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask)
+        {
+            auto& entry = _entries[slot];
+            if (entry.idx == empty) return false;
+
+            if (entry.hash == hash && name_equals(data, entry.name, name))
+            {
+                idx = entry.idx;
+                return true;
+            }
+        }
+    }
+}  // namespace minivm
@@ -0,0 +1,30 @@
+#pragma once
+#include <memory>
+#include <minivm/vm.hpp>
+
+#ifndef MINIVM_JIT
+#define MINIVM_JIT 1
+#endif
+
+#if MINIVM_JIT && defined(__x86_64__) && defined(__linux__)
+#define MINIVM_HAS_JIT 1
+#else
+#define MINIVM_HAS_JIT 0
+#endif
+
+namespace minivm
+{
+    // Glue between the interpreter and natively compiled code
+    struct native_runtime
+    {
+        // Translates a program's decoded stream into machine code.  Returns
+        // null if there is no JIT for this platform.
+        static std::shared_ptr<const native_code> compile(
+            const program& program);
+
+        // Runs the context's native code from its current pc.  Returns false
+        // if execution has to continue in the interpreter, otherwise result
+        // holds the value run() should return.
+        static bool run(execution_context* context, bool& result);
+    };
+}  // namespace minivm
@@ -0,0 +1,313 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include <minivm/profiler.hpp>
+
+namespace minivm
+{
+    execution_profile::execution_profile(const program& program)
+        : _program(program), _elapsed(0), _running(false)
+    {
+        reset();
+    }
+
+    void execution_profile::reset()
+    {
+        _opcodeCounts.assign(_program._code.size(), 0);
+        _instructionCounts.assign(size_t(instruction::Count), 0);
+        _labels.assign(_program.labels.size(), label_profile());
+        _externs.assign(_program.externs.size(), extern_profile());
+
+        // Frames that are still open keep being timed from here on
+        uint64_t start = now();
+        for (auto& frame : _frames)
+        {
+            frame.start = start;
+            frame.children = 0;
+        }
+    }
+
+    const std::vector<uint64_t>& execution_profile::get_opcode_counts() const
+    {
+        return _opcodeCounts;
+    }
+
+    uint64_t execution_profile::get_instruction_count(instruction instr) const
+    {
+        return _instructionCounts[static_cast<size_t>(instr)];
+    }
+
+    const std::vector<label_profile>& execution_profile::get_labels() const
+    {
+        update_label_instructions();
+        return _labels;
+    }
+
+    const std::vector<extern_profile>& execution_profile::get_externs() const
+    {
+        return _externs;
+    }
+
+    uint64_t execution_profile::now() const
+    {
+        if (!_running)
+        {
+            return _elapsed;
+        }
+
+        auto running = clock::now() - _resumed;
+        return _elapsed + uint64_t(std::chrono::duration_cast<
+                                       std::chrono::nanoseconds>(running)
+                                       .count());
+    }
+
+    void execution_profile::resume()
+    {
+        _resumed = clock::now();
+        _running = true;
+    }
+
+    void execution_profile::pause()
+    {
+        _elapsed = now();
+        _running = false;
+    }
+
+    void execution_profile::enter(uint32_t label)
+    {
+        ++_labels[label].calls;
+        _frames.push_back({label, now(), 0});
+    }
+
+    void execution_profile::leave()
+    {
+        if (_frames.empty())
+        {
+            return;
+        }
+
+        auto frame = _frames.back();
+        _frames.pop_back();
+
+        uint64_t inclusive = now() - frame.start;
+        auto& label = _labels[frame.label];
+        label.inclusive_ns += inclusive;
+        label.exclusive_ns += inclusive - frame.children;
+
+        if (!_frames.empty())
+        {
+            _frames.back().children += inclusive;
+        }
+    }
+
+    void execution_profile::replace(uint32_t label)
+    {
+        // A tailcall ends the current label's frame without returning to its
+        // caller, so the callee's time belongs to the caller too
+        uint64_t start = now();
+        if (!_frames.empty())
+        {
+            auto frame = _frames.back();
+            _frames.pop_back();
+
+            uint64_t inclusive = start - frame.start;
+            auto& current = _labels[frame.label];
+            current.inclusive_ns += inclusive;
+            current.exclusive_ns += inclusive - frame.children;
+        }
+
+        enter(label);
+        _frames.back().start = start;
+    }
+
+    void execution_profile::record_extern(uint32_t ext, uint64_t start)
+    {
+        uint64_t elapsed = now() - start;
+        auto& profile = _externs[ext];
+        ++profile.calls;
+        profile.ns += elapsed;
+
+        // Extern time is reported separately rather than charged to the
+        // label that made the call
+        if (!_frames.empty())
+        {
+            _frames.back().children += elapsed;
+        }
+    }
+
+    void execution_profile::update_label_instructions() const
+    {
+        // Each pc belongs to the closest label at or before it.  Labels
+        // sharing a pc count toward the first one declared.
+        auto& programLabels = _program.labels;
+        std::vector<uint32_t> order(programLabels.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(),
+                         [&](uint32_t a, uint32_t b)
+                         { return programLabels[a].pc < programLabels[b].pc; });
+
+        for (auto& label : _labels)
+        {
+            label.instructions = 0;
+        }
+
+        size_t next = 0;
+        label_profile* owner = nullptr;
+        for (uint32_t pc = 0; pc < _opcodeCounts.size(); ++pc)
+        {
+            if (next < order.size() && programLabels[order[next]].pc == pc)
+            {
+                owner = &_labels[order[next]];
+                while (next < order.size() &&
+                       programLabels[order[next]].pc == pc)
+                {
+                    ++next;
+                }
+            }
+
+            if (owner)
+            {
+                owner->instructions += _opcodeCounts[pc];
+            }
+        }
+    }
+
+    namespace
+    {
+        template <typename... Args>
+        void append(std::string& out, const char* format, Args... args)
+        {
+            char buffer[512];
+            snprintf(buffer, sizeof(buffer), format, args...);
+            out += buffer;
+        }
+
+        // Names come from assembly source, so only quotes and backslashes
+        // need escaping
+        std::string json_string(const char* str)
+        {
+            std::string out = "\"";
+            for (; *str; ++str)
+            {
+                if (*str == '"' || *str == '\\')
+                {
+                    out += '\\';
+                }
+                out += *str;
+            }
+            out += '"';
+            return out;
+        }
+    }  // namespace
+
+    std::string execution_profile::to_text() const
+    {
+        auto& labels = get_labels();
+        std::string out;
+
+        std::vector<uint32_t> order(labels.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(),
+                  [&](uint32_t a, uint32_t b)
+                  { return labels[a].exclusive_ns > labels[b].exclusive_ns; });
+
+        append(out, "%-24s %12s %14s %14s %14s\n", "label", "calls",
+               "instructions", "inclusive ms", "exclusive ms");
+        for (auto i : order)
+        {
+            auto& label = labels[i];
+            if (label.calls == 0 && label.instructions == 0) continue;
+            append(out, "%-24s %12" PRIu64 " %14" PRIu64 " %14.3f %14.3f\n",
+                   _program.get_label_name(i), label.calls, label.instructions,
+                   label.inclusive_ns / 1e6, label.exclusive_ns / 1e6);
+        }
+
+        out += "\n";
+        append(out, "%-24s %12s %14s\n", "extern", "calls", "ms");
+        for (uint32_t i = 0; i < _externs.size(); ++i)
+        {
+            auto& ext = _externs[i];
+            if (ext.calls == 0) continue;
+            append(out, "%-24s %12" PRIu64 " %14.3f\n",
+                   _program.get_extern_name(i), ext.calls, ext.ns / 1e6);
+        }
+
+        out += "\n";
+        append(out, "%-24s %12s\n", "instruction", "count");
+        for (size_t i = 0; i < _instructionCounts.size(); ++i)
+        {
+            if (_instructionCounts[i] == 0) continue;
+            append(out, "%-24s %12" PRIu64 "\n",
+                   get_instruction_name(static_cast<instruction>(i)),
+                   _instructionCounts[i]);
+        }
+
+        out += "\n";
+        append(out, "%-8s %-24s %12s\n", "pc", "opcode", "count");
+        for (uint32_t pc = 0; pc < _opcodeCounts.size(); ++pc)
+        {
+            if (_opcodeCounts[pc] == 0) continue;
+            append(out, "%-8u %-24s %12" PRIu64 "\n", pc,
+                   get_instruction_name(_program._code[pc].instruction),
+                   _opcodeCounts[pc]);
+        }
+        return out;
+    }
+
+    std::string execution_profile::to_json() const
+    {
+        auto& labels = get_labels();
+        std::string out = "{\n  \"labels\": [";
+        for (uint32_t i = 0; i < labels.size(); ++i)
+        {
+            auto& label = labels[i];
+            append(out,
+                   "%s\n    {\"name\": %s, \"calls\": %" PRIu64
+                   ", \"instructions\": %" PRIu64 ", \"inclusive_ns\": %" PRIu64
+                   ", \"exclusive_ns\": %" PRIu64 "}",
+                   i ? "," : "",
+                   json_string(_program.get_label_name(i)).c_str(),
+                   label.calls, label.instructions, label.inclusive_ns,
+                   label.exclusive_ns);
+        }
+
+        out += "\n  ],\n  \"externs\": [";
+        for (uint32_t i = 0; i < _externs.size(); ++i)
+        {
+            append(out,
+                   "%s\n    {\"name\": %s, \"calls\": %" PRIu64
+                   ", \"ns\": %" PRIu64 "}",
+                   i ? "," : "",
+                   json_string(_program.get_extern_name(i)).c_str(),
+                   _externs[i].calls, _externs[i].ns);
+        }
+
+        out += "\n  ],\n  \"instructions\": {";
+        bool first = true;
+        for (size_t i = 0; i < _instructionCounts.size(); ++i)
+        {
+            if (_instructionCounts[i] == 0) continue;
+            append(out, "%s\n    \"%s\": %" PRIu64, first ? "" : ",",
+                   get_instruction_name(static_cast<instruction>(i)),
+                   _instructionCounts[i]);
+            first = false;
+        }
+
+        out += "\n  },\n  \"opcodes\": [";
+        first = true;
+        for (uint32_t pc = 0; pc < _opcodeCounts.size(); ++pc)
+        {
+            if (_opcodeCounts[pc] == 0) continue;
+            append(out,
+                   "%s\n    {\"pc\": %u, \"instruction\": \"%s\", \"count\": "
+                   "%" PRIu64 "}",
+                   first ? "" : ",", pc,
+                   get_instruction_name(_program._code[pc].instruction),
+                   _opcodeCounts[pc]);
+            first = false;
+        }
+        out += "\n  ]\n}\n";
+        return out;
+    }
+}  // namespace minivm
@@ -0,0 +1,390 @@
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MINIVM_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define MINIVM_HAS_MMAP 0
+#endif
+
+#include <minivm/vm.hpp>
+
+namespace minivm
+{
+    // On-disk layout of a .mvmb file.  Every section starts on an 8 byte
+    // boundary so the opcode section can be used straight out of the
+    // mapping.  Values are stored in host byte order.
+    static constexpr uint32_t binary_magic = 0x424D564D;  // "MVMB"
+    static constexpr uint32_t binary_version = 2;
+
+    struct binary_header
+    {
+        uint32_t magic;
+        uint32_t version;
+
+        // Guards against loading images built with a different instruction
+        // set or opcode layout
+        uint32_t instruction_count;
+        uint32_t opcode_size;
+
+        uint32_t opcode_count;
+        uint32_t opcode_offset;
+        uint32_t constant_count;
+        uint32_t constant_offset;
+        uint32_t data_size;
+        uint32_t data_offset;
+        uint32_t label_count;
+        uint32_t label_offset;
+        uint32_t extern_count;
+        uint32_t extern_offset;
+    };
+
+    struct binary_constant
+    {
+        uint64_t value;
+        uint32_t is_data_offset;
+        uint32_t reserved;
+    };
+
+    struct binary_label
+    {
+        // Offset of the label's name in the data section
+        uint32_t name;
+        uint32_t pc;
+        uint32_t stackalloc;
+        uint16_t save_mask;
+        uint16_t reserved;
+    };
+
+    struct binary_extern
+    {
+        // Offset of the extern's name in the data section
+        uint32_t name;
+        uint32_t reserved;
+    };
+
+    program_image::~program_image()
+    {
+#if MINIVM_HAS_MMAP
+        if (mapping)
+        {
+            munmap(mapping, mapping_size);
+        }
+#endif
+    }
+
+    static uint32_t align_section(size_t offset)
+    {
+        return uint32_t((offset + 7) & ~size_t(7));
+    }
+
+    bool program::save_binary(const std::string_view& filename)
+    {
+        const char* data = get_data();
+        size_t dataSize = _image ? _image->data_size : _data.size();
+
+        std::vector<binary_extern> binExterns(externs.size());
+        for (size_t i = 0; i < externs.size(); ++i)
+        {
+            binExterns[i].name = extern_names[i];
+            binExterns[i].reserved = 0;
+        }
+
+        std::vector<binary_constant> binConstants(constants.size());
+        for (size_t i = 0; i < constants.size(); ++i)
+        {
+            auto& cval = constants[i];
+            auto& bin = binConstants[i];
+            bin.value = cval.value.ureg;
+            bin.is_data_offset = cval.is_data_offset ? 1 : 0;
+            bin.reserved = 0;
+        }
+
+        std::vector<binary_label> binLabels(labels.size());
+        for (size_t i = 0; i < labels.size(); ++i)
+        {
+            auto& label = labels[i];
+            auto& bin = binLabels[i];
+            bin.name = label.name;
+            bin.pc = label.pc;
+            bin.stackalloc = label.stackalloc;
+            bin.save_mask = label.save_mask;
+            bin.reserved = 0;
+        }
+
+        binary_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = binary_magic;
+        header.version = binary_version;
+        header.instruction_count = uint32_t(instruction::Count);
+        header.opcode_size = sizeof(opcode);
+
+        size_t offset = align_section(sizeof(header));
+        header.opcode_count = uint32_t(get_opcode_count());
+        header.opcode_offset = uint32_t(offset);
+        offset = align_section(offset + get_opcode_count() * sizeof(opcode));
+
+        header.constant_count = uint32_t(binConstants.size());
+        header.constant_offset = uint32_t(offset);
+        offset = align_section(offset +
+                               binConstants.size() * sizeof(binary_constant));
+
+        header.data_size = uint32_t(dataSize);
+        header.data_offset = uint32_t(offset);
+        offset = align_section(offset + dataSize);
+
+        header.label_count = uint32_t(binLabels.size());
+        header.label_offset = uint32_t(offset);
+        offset =
+            align_section(offset + binLabels.size() * sizeof(binary_label));
+
+        header.extern_count = uint32_t(binExterns.size());
+        header.extern_offset = uint32_t(offset);
+        offset += binExterns.size() * sizeof(binary_extern);
+
+        std::vector<char> buffer(offset, 0);
+        auto write = [&](uint32_t at, const void* src, size_t size)
+        {
+            if (size > 0) memcpy(buffer.data() + at, src, size);
+        };
+
+        write(0, &header, sizeof(header));
+        write(header.opcode_offset, get_opcodes(),
+              get_opcode_count() * sizeof(opcode));
+        write(header.constant_offset, binConstants.data(),
+              binConstants.size() * sizeof(binary_constant));
+        write(header.data_offset, data, dataSize);
+        write(header.label_offset, binLabels.data(),
+              binLabels.size() * sizeof(binary_label));
+        write(header.extern_offset, binExterns.data(),
+              binExterns.size() * sizeof(binary_extern));
+
+        std::ofstream stream(std::string(filename), std::ios_base::binary);
+        if (!stream.good())
+        {
+            load_error = "Failed to open file " + std::string(filename);
+            return false;
+        }
+
+        stream.write(buffer.data(), buffer.size());
+        if (!stream.good())
+        {
+            load_error = "Failed to write file " + std::string(filename);
+            return false;
+        }
+        return true;
+    }
+
+    bool program::load_binary_from_file(const std::string_view& filename)
+    {
+        auto image = std::make_shared<program_image>();
+        std::string path(filename);
+
+#if MINIVM_HAS_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            load_error = "Failed to open file " + path;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            load_error = "Failed to read file " + path;
+            return false;
+        }
+
+        void* mapping =
+            mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+        {
+            load_error = "Failed to map file " + path;
+            return false;
+        }
+
+        image->mapping = mapping;
+        image->mapping_size = size_t(st.st_size);
+        const void* contents = mapping;
+        size_t size = image->mapping_size;
+#else
+        std::ifstream stream(path, std::ios_base::binary);
+        if (!stream.good())
+        {
+            load_error = "Failed to open file " + path;
+            return false;
+        }
+
+        stream.seekg(0, std::ios::end);
+        size_t size = stream.tellg();
+        stream.seekg(0);
+
+        image->buffer.resize(size);
+        stream.read(image->buffer.data(), size);
+        const void* contents = image->buffer.data();
+#endif
+
+        if (!load_image(std::move(image), static_cast<const char*>(contents),
+                        size))
+        {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool program::load_binary(const void* data, size_t size)
+    {
+        // The caller owns the memory, so the image has nothing to release
+        if (!load_image(std::make_shared<program_image>(),
+                        static_cast<const char*>(data), size))
+        {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    static bool section_in_bounds(uint32_t offset, size_t count,
+                                  size_t elementSize, size_t size)
+    {
+        return offset <= size && count <= (size - offset) / elementSize;
+    }
+
+    bool program::load_image(std::shared_ptr<program_image> image,
+                             const char* base, size_t size)
+    {
+        if (size < sizeof(binary_header))
+        {
+            load_error = "Binary image is truncated";
+            return false;
+        }
+
+        binary_header header;
+        memcpy(&header, base, sizeof(header));
+        if (header.magic != binary_magic)
+        {
+            load_error = "Not a MiniVM binary image";
+            return false;
+        }
+
+        if (header.version != binary_version ||
+            header.instruction_count != uint32_t(instruction::Count) ||
+            header.opcode_size != sizeof(opcode))
+        {
+            load_error =
+                "Binary image was built for a different version of MiniVM";
+            return false;
+        }
+
+        if (header.opcode_offset % alignof(opcode) != 0 ||
+            header.opcode_count == 0 ||
+            !section_in_bounds(header.opcode_offset, header.opcode_count,
+                               sizeof(opcode), size) ||
+            !section_in_bounds(header.constant_offset, header.constant_count,
+                               sizeof(binary_constant), size) ||
+            !section_in_bounds(header.data_offset, header.data_size, 1,
+                               size) ||
+            !section_in_bounds(header.label_offset, header.label_count,
+                               sizeof(binary_label), size) ||
+            !section_in_bounds(header.extern_offset, header.extern_count,
+                               sizeof(binary_extern), size))
+        {
+            load_error = "Binary image is truncated or corrupt";
+            return false;
+        }
+
+        image->opcodes =
+            reinterpret_cast<const opcode*>(base + header.opcode_offset);
+        image->opcode_count = header.opcode_count;
+        image->data = base + header.data_offset;
+        image->data_size = header.data_size;
+
+        if (image->opcodes[image->opcode_count - 1].instruction !=
+            instruction::halt)
+        {
+            load_error = "Binary image is missing its terminator";
+            return false;
+        }
+
+        // Every string in static data is null terminated, so this is enough
+        // to keep name lookups inside the section
+        if (image->data_size > 0 && image->data[image->data_size - 1] != 0)
+        {
+            load_error = "Binary image static data is not terminated";
+            return false;
+        }
+
+        // Everything below is small and mutable (or needs hashing), so it is
+        // copied out of the image.  Opcodes and static data stay in place.
+        clear();
+        _image = image;
+
+        constants.resize(header.constant_count);
+        for (uint32_t i = 0; i < header.constant_count; ++i)
+        {
+            binary_constant bin;
+            memcpy(&bin, base + header.constant_offset + i * sizeof(bin),
+                   sizeof(bin));
+
+            auto& cval = constants[i];
+            cval.value.ureg = bin.value;
+            cval.is_data_offset = bin.is_data_offset != 0;
+            if (cval.is_data_offset && bin.value >= header.data_size)
+            {
+                load_error = "Constant points outside of static data";
+                return false;
+            }
+        }
+
+        labels.resize(header.label_count);
+        for (uint32_t i = 0; i < header.label_count; ++i)
+        {
+            binary_label bin;
+            memcpy(&bin, base + header.label_offset + i * sizeof(bin),
+                   sizeof(bin));
+
+            if (bin.name >= header.data_size ||
+                bin.pc >= header.opcode_count)
+            {
+                load_error = "Label is out of range";
+                return false;
+            }
+
+            auto& label = labels[i];
+            label.name = bin.name;
+            label.pc = bin.pc;
+            label.stackalloc = bin.stackalloc;
+            label.save_mask = bin.save_mask;
+        }
+
+        externs.resize(header.extern_count, {0});
+        extern_names.resize(header.extern_count);
+        for (uint32_t i = 0; i < header.extern_count; ++i)
+        {
+            binary_extern bin;
+            memcpy(&bin, base + header.extern_offset + i * sizeof(bin),
+                   sizeof(bin));
+
+            if (bin.name >= header.data_size)
+            {
+                load_error = "Extern name is out of range";
+                return false;
+            }
+            extern_names[i] = bin.name;
+        }
+
+        return finalize();
+    }
+}  // namespace minivm
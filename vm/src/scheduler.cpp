@@ -0,0 +1,201 @@
+#include <minivm/scheduler.hpp>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace minivm
+{
+    scheduler::scheduler(const scheduler_config& config)
+        : _queued(0),
+          _stopping(false),
+          _pending(0),
+          _nextQueue(0),
+          _timeSlice(config.time_slice)
+    {
+        uint32_t threadCount = config.thread_count;
+        if (threadCount == 0)
+        {
+            threadCount = std::thread::hardware_concurrency();
+            if (threadCount == 0) threadCount = 1;
+        }
+
+        for (uint32_t i = 0; i < threadCount; ++i)
+        {
+            _queues.push_back(std::make_unique<worker_queue>());
+        }
+
+        uint32_t coreCount = std::thread::hardware_concurrency();
+        for (uint32_t i = 0; i < threadCount; ++i)
+        {
+            _threads.emplace_back(&scheduler::worker_main, this, i);
+
+#if defined(__linux__)
+            if (config.pin_threads && coreCount > 0)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(i % coreCount, &cpus);
+                pthread_setaffinity_np(_threads.back().native_handle(),
+                                       sizeof(cpus), &cpus);
+            }
+#else
+            (void)coreCount;
+#endif
+        }
+    }
+
+    scheduler::~scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            _stopping = true;
+        }
+        _wake.notify_all();
+
+        for (auto& thread : _threads)
+        {
+            thread.join();
+        }
+    }
+
+    void scheduler::submit(execution_context* context,
+                           program_label_id_t entry)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_finishedMutex);
+            ++_pending;
+        }
+
+        // Spread submissions from outside the pool across all workers
+        uint32_t index = _nextQueue.fetch_add(1, std::memory_order_relaxed) %
+                         uint32_t(_queues.size());
+        push(index, {context, entry, false});
+    }
+
+    void scheduler::collect(std::vector<execution_context*>& finished)
+    {
+        std::lock_guard<std::mutex> lock(_finishedMutex);
+        finished.insert(finished.end(), _finished.begin(), _finished.end());
+        _finished.clear();
+    }
+
+    void scheduler::wait_idle()
+    {
+        std::unique_lock<std::mutex> lock(_finishedMutex);
+        _idle.wait(lock, [this] { return _pending == 0; });
+    }
+
+    uint32_t scheduler::get_thread_count() const
+    {
+        return uint32_t(_threads.size());
+    }
+
+    void scheduler::push(uint32_t index, const task& work)
+    {
+        {
+            auto& queue = *_queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(work);
+        }
+
+        // Taking the wake mutex orders the increment with a worker that is
+        // about to check _queued and go to sleep
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            _queued.fetch_add(1, std::memory_order_relaxed);
+        }
+        _wake.notify_one();
+    }
+
+    bool scheduler::pop_local(uint32_t index, task& out)
+    {
+        auto& queue = *_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+
+        out = queue.tasks.front();
+        queue.tasks.pop_front();
+        _queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool scheduler::steal(uint32_t index, task& out)
+    {
+        uint32_t count = uint32_t(_queues.size());
+        for (uint32_t i = 1; i < count; ++i)
+        {
+            auto& victim = *_queues[(index + i) % count];
+            std::unique_lock<std::mutex> victimLock(victim.mutex,
+                                                    std::try_to_lock);
+            if (!victimLock.owns_lock() || victim.tasks.empty()) continue;
+
+            // Take one task to run now and move up to half of the rest over,
+            // so a busy worker isn't robbed one task at a time
+            out = victim.tasks.back();
+            victim.tasks.pop_back();
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+
+            size_t moveCount = victim.tasks.size() / 2;
+            if (moveCount == 0) return true;
+
+            auto first = victim.tasks.end() - moveCount;
+            std::vector<task> stolen(first, victim.tasks.end());
+            victim.tasks.erase(first, victim.tasks.end());
+
+            // Only ever hold one queue lock at a time
+            victimLock.unlock();
+
+            auto& own = *_queues[index];
+            std::lock_guard<std::mutex> ownLock(own.mutex);
+            own.tasks.insert(own.tasks.end(), stolen.begin(), stolen.end());
+            return true;
+        }
+        return false;
+    }
+
+    void scheduler::finish(execution_context* context)
+    {
+        std::lock_guard<std::mutex> lock(_finishedMutex);
+        _finished.push_back(context);
+        if (--_pending == 0)
+        {
+            _idle.notify_all();
+        }
+    }
+
+    void scheduler::worker_main(uint32_t index)
+    {
+        for (;;)
+        {
+            task work;
+            if (!pop_local(index, work) && !steal(index, work))
+            {
+                std::unique_lock<std::mutex> lock(_wakeMutex);
+                _wake.wait(lock, [this] {
+                    return _stopping ||
+                           _queued.load(std::memory_order_relaxed) > 0;
+                });
+
+                if (_stopping) return;
+                continue;
+            }
+
+            auto context = work.context;
+            bool success = work.started
+                               ? context->resume(_timeSlice)
+                               : context->run_from(work.entry, _timeSlice);
+
+            if (success && context->did_yield())
+            {
+                work.started = true;
+                push(index, work);
+            }
+            else
+            {
+                finish(context);
+            }
+        }
+    }
+}  // namespace minivm
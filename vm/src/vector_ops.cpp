@@ -0,0 +1,117 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "vector_ops.hpp"
+
+// Same approach as the lanes: every op is written once as an inlined lane
+// loop and wrapped in a function per ISA, so the AVX2 copy can use 256 bit
+// registers and fused multiply-adds.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define MINIVM_VECTOR_AVX2 1
+#define MINIVM_VECTOR_INLINE inline __attribute__((always_inline))
+#else
+#define MINIVM_VECTOR_AVX2 0
+#define MINIVM_VECTOR_INLINE inline
+#endif
+
+// name, lane field, lane count, and the result of one lane computed from its
+// a, b and c
+#define VECTOR_OPS(X)                                                       \
+    X(addf32, f32, 8, a + b)                                                \
+    X(subf32, f32, 8, a - b)                                                \
+    X(mulf32, f32, 8, a * b)                                                \
+    X(divf32, f32, 8, a / b)                                                \
+    X(fmaf32, f32, 8, fmaf(a, b, c))                                        \
+    X(addf64, f64, 4, a + b)                                                \
+    X(subf64, f64, 4, a - b)                                                \
+    X(mulf64, f64, 4, a * b)                                                \
+    X(divf64, f64, 4, a / b)                                                \
+    X(fmaf64, f64, 4, fma(a, b, c))                                         \
+    X(addi32, i32, 8, int32_t(uint32_t(a) + uint32_t(b)))                   \
+    X(subi32, i32, 8, int32_t(uint32_t(a) - uint32_t(b)))                   \
+    X(muli32, i32, 8, int32_t(uint32_t(a) * uint32_t(b)))                   \
+    X(divi32, i32, 8, divi32(a, b))                                         \
+    X(fmai32, i32, 8, int32_t(uint32_t(a) * uint32_t(b) + uint32_t(c)))
+
+// The result is built in a local, so the loop vectorizes even though dst may
+// alias an operand
+#define VECTOR_BODY(name, field, count, expr)                               \
+    static MINIVM_VECTOR_INLINE void name##_body(                           \
+        vm_vector_t& dst, const vm_vector_t& va, const vm_vector_t& vb,     \
+        const vm_vector_t& vc)                                              \
+    {                                                                       \
+        vm_vector_t result;                                                 \
+        for (uint32_t l = 0; l < count; ++l)                                \
+        {                                                                   \
+            auto a = va.field[l];                                           \
+            auto b = vb.field[l];                                           \
+            auto c = vc.field[l];                                           \
+            (void)c;                                                        \
+            result.field[l] = expr;                                         \
+        }                                                                   \
+        dst = result;                                                       \
+    }
+
+#define VECTOR_WRAPPER(name, field, count, expr, isa, attributes)          \
+    attributes static void name##_##isa(                                   \
+        vm_vector_t& dst, const vm_vector_t& a, const vm_vector_t& b,      \
+        const vm_vector_t& c)                                              \
+    {                                                                      \
+        name##_body(dst, a, b, c);                                         \
+    }
+
+#define VECTOR_GENERIC(name, field, count, expr) \
+    VECTOR_WRAPPER(name, field, count, expr, generic, )
+#define VECTOR_AVX2(name, field, count, expr) \
+    VECTOR_WRAPPER(name, field, count, expr, avx2, \
+                   __attribute__((target("avx2,fma"))))
+
+#define VECTOR_ENTRY_GENERIC(name, field, count, expr) &name##_generic,
+#define VECTOR_ENTRY_AVX2(name, field, count, expr) &name##_avx2,
+
+namespace minivm
+{
+    namespace
+    {
+        // Matches the other integer lanes by wrapping INT32_MIN / -1, and
+        // gives 0 rather than trapping on division by zero
+        MINIVM_VECTOR_INLINE int32_t divi32(int32_t a, int32_t b)
+        {
+            if (b == 0) return 0;
+            if (b == -1) return int32_t(0u - uint32_t(a));
+            return a / b;
+        }
+
+        VECTOR_OPS(VECTOR_BODY)
+        VECTOR_OPS(VECTOR_GENERIC)
+#if MINIVM_VECTOR_AVX2
+        VECTOR_OPS(VECTOR_AVX2)
+#endif
+
+        const vector_kernels generic_kernels = {
+            VECTOR_OPS(VECTOR_ENTRY_GENERIC) "generic"};
+
+#if MINIVM_VECTOR_AVX2
+        const vector_kernels avx2_kernels = {
+            VECTOR_OPS(VECTOR_ENTRY_AVX2) "avx2"};
+#endif
+
+        const vector_kernels& select_kernels()
+        {
+#if MINIVM_VECTOR_AVX2
+            if (__builtin_cpu_supports("avx2") &&
+                __builtin_cpu_supports("fma"))
+            {
+                return avx2_kernels;
+            }
+#endif
+            return generic_kernels;
+        }
+    }  // namespace
+
+    const vector_kernels& vector_kernels::get()
+    {
+        static const vector_kernels& kernels = select_kernels();
+        return kernels;
+    }
+}  // namespace minivm
@@ -0,0 +1,35 @@
+#pragma once
+#include <minivm/vm.hpp>
+
+namespace minivm
+{
+    // Binary ops ignore c.  The destination may be any of the operands.
+    typedef void (*vector_op_fn)(vm_vector_t& dst, const vm_vector_t& a,
+                                 const vm_vector_t& b, const vm_vector_t& c);
+
+    // Packed arithmetic used by the interpreter.  It is compiled once for
+    // the baseline ISA and, on x86-64, once more for AVX2 and FMA, and the
+    // widest one the host supports is picked the first time it's needed.
+    // Every set gives bit-identical results.
+    struct vector_kernels
+    {
+        vector_op_fn addf32;
+        vector_op_fn subf32;
+        vector_op_fn mulf32;
+        vector_op_fn divf32;
+        vector_op_fn fmaf32;
+        vector_op_fn addf64;
+        vector_op_fn subf64;
+        vector_op_fn mulf64;
+        vector_op_fn divf64;
+        vector_op_fn fmaf64;
+        vector_op_fn addi32;
+        vector_op_fn subi32;
+        vector_op_fn muli32;
+        vector_op_fn divi32;
+        vector_op_fn fmai32;
+        const char* isa;
+
+        static const vector_kernels& get();
+    };
+}  // namespace minivm
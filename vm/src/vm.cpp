@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <algorithm>
 #include <charconv>
 #include <fstream>
 #include <string>
@@ -7,11 +8,65 @@
 #include <variant>
 
 #include <minivm/vm.hpp>
+#include "native.hpp"
 
 namespace minivm
 {
+    static const char* const instruction_names[] = {
+        "loadc", "eload", "estore", "sstore", "sstoreu32", "sstoreu16",
+        "sstoreu8", "sstorei32", "sstorei16", "sstorei8", "sstoref32", "sload",
+        "sloadu32", "sloadu16", "sloadu8", "sloadi32", "sloadi16", "sloadi8",
+        "sloadf32", "mstore", "mstoreu32", "mstoreu16", "mstoreu8",
+        "mstorei32", "mstorei16", "mstorei8", "mstoref32", "mload", "mloadu32",
+        "mloadu16", "mloadu8", "mloadi32", "mloadi16", "mloadi8", "mloadf32",
+        "addi", "addu", "addf", "subi", "subu", "subf", "muli",
+        "mulu", "mulf", "divi", "divu", "divf", "addi_imm", "addu_imm",
+        "subi_imm", "subu_imm", "muli_imm", "mulu_imm", "divi_imm", "divu_imm",
+        "addi_const", "addu_const", "addf_const", "subi_const", "subu_const",
+        "subf_const", "muli_const", "mulu_const", "mulf_const", "divi_const",
+        "divu_const", "divf_const", "mov", "utoi", "utof", "itou", "itof",
+        "ftoi", "ftou", "printi", "printu", "printf", "prints", "cmp",
+        "cmp_imm", "cmp_const", "jump", "jeq", "jne", "jlti", "jlei", "jgti",
+        "jgei", "jltu", "jleu", "jgtu", "jgeu", "jltf", "jlef", "jgtf", "jgef",
+        "jeqf", "jnef", "call", "tailcall", "callext", "yield", "ret",
+        "vaddf32", "vsubf32", "vmulf32", "vdivf32", "vfmaf32", "vaddf64",
+        "vsubf64", "vmulf64", "vdivf64", "vfmaf64", "vaddi32", "vsubi32",
+        "vmuli32", "vdivi32", "vfmai32", "vmov", "vbroadcastf32",
+        "vbroadcastf64", "vbroadcasti32", "vshuf32", "vshuf64", "vsstore",
+        "vsstore128", "vsload", "vsload128", "halt", "loadc_data",
+        "sstore_checked", "sstoreu32_checked",
+        "sstoreu16_checked", "sstoreu8_checked", "sstorei32_checked",
+        "sstorei16_checked", "sstorei8_checked", "sstoref32_checked",
+        "sload_checked", "sloadu32_checked", "sloadu16_checked",
+        "sloadu8_checked", "sloadi32_checked", "sloadi16_checked",
+        "sloadi8_checked", "sloadf32_checked", "vsstore_checked",
+        "vsstore128_checked", "vsload_checked", "vsload128_checked",
+        "mstore_checked", "mstoreu32_checked", "mstoreu16_checked",
+        "mstoreu8_checked", "mstorei32_checked", "mstorei16_checked",
+        "mstorei8_checked", "mstoref32_checked", "mload_checked",
+        "mloadu32_checked", "mloadu16_checked", "mloadu8_checked",
+        "mloadi32_checked", "mloadi16_checked", "mloadi8_checked",
+        "mloadf32_checked",
+        "loadc_addi", "loadc_addu",
+        "loadc_addf", "loadc_subi", "loadc_subu", "loadc_subf", "loadc_muli",
+        "loadc_mulu", "loadc_mulf", "eload_addi", "eload_addu", "eload_addf",
+        "eload_subi", "eload_subu", "eload_subf", "eload_muli", "eload_mulu",
+        "eload_mulf", "cmp_jeq", "cmp_jne", "loadc_cmp_jeq", "loadc_cmp_jne",
+        "addi_cmp_jeq", "addi_cmp_jne", "addu_cmp_jeq", "addu_cmp_jne",
+        "addi_imm_cmp_jeq", "addi_imm_cmp_jne", "cmp_imm_jeq", "cmp_imm_jne",
+    };
+    static_assert(sizeof(instruction_names) / sizeof(instruction_names[0]) ==
+                      static_cast<size_t>(instruction::Count),
+                  "Name table is out of sync with minivm::instruction");
+
+    const char* get_instruction_name(instruction instr)
+    {
+        if (instr >= instruction::Count) return "[invalid]";
+        return instruction_names[static_cast<size_t>(instr)];
+    }
+
     constant_value::constant_value()
-        : value({0}), is_data_offset(false), is_pointer(false)
+        : value({0}), is_data_offset(false)
     {
     }
 
@@ -66,11 +121,60 @@ namespace minivm
         return c >= '0' && c <= '9';
     }
 
+    static bool is_float_arith(instruction instr)
+    {
+        return instr == instruction::addf || instr == instruction::subf ||
+               instr == instruction::mulf || instr == instruction::divf;
+    }
+
+    static bool is_signed_arith(instruction instr)
+    {
+        return instr == instruction::addi || instr == instruction::subi ||
+               instr == instruction::muli || instr == instruction::divi;
+    }
+
+    static instruction arith_imm_form(instruction instr)
+    {
+        switch (instr)
+        {
+            case instruction::addi:
+                return instruction::addi_imm;
+            case instruction::addu:
+                return instruction::addu_imm;
+            case instruction::subi:
+                return instruction::subi_imm;
+            case instruction::subu:
+                return instruction::subu_imm;
+            case instruction::muli:
+                return instruction::muli_imm;
+            case instruction::mulu:
+                return instruction::mulu_imm;
+            case instruction::divi:
+                return instruction::divi_imm;
+            case instruction::divu:
+                return instruction::divu_imm;
+            default:
+                return instr;
+        }
+    }
+
+    static instruction arith_const_form(instruction instr)
+    {
+        // addi..divf and addi_const..divf_const are declared in the same order
+        auto index = static_cast<uint32_t>(instr) -
+                     static_cast<uint32_t>(instruction::addi);
+        return static_cast<instruction>(
+            static_cast<uint32_t>(instruction::addi_const) + index);
+    }
+
     struct asm_parser
     {
-        asm_parser(program& prog, const std::string_view& source)
+        asm_parser(minivm::program& prog, const std::string_view& source)
             : source(source), program(prog), offset(0)
         {
+            // Generated sources average well over 8 bytes per instruction, so
+            // this avoids regrowing the opcode array on large inputs
+            program.opcodes.reserve(source.size() / 8);
         }
 
         char peekchar()
@@ -267,34 +371,34 @@ namespace minivm
 
         bool read_external(token& label)
         {
-            char start = label.source[0];
-
-            std::string name(label.source);
-            if (program.extern_map.count(name))
+            auto idx = uint32_t(program.externs.size());
+            if (!externMap.insert({label.source, idx}).second)
             {
-                error = "Duplicate external " + name;
+                error = "Duplicate external " + std::string(label.source);
                 return false;
             }
 
-            auto idx = program.externs.size();
             program.externs.push_back({0});
-            program.extern_map[name] = idx;
+            program.extern_names.push_back(
+                program.write_static_string(label.source));
             return true;
         }
 
         bool read_label(token& label)
         {
-            std::string str(label.source);
-            if (program.label_map.count(str))
+            auto idx = uint32_t(program.labels.size());
+            if (!labelMap.insert({label.source, idx}).second)
             {
-                error = "Duplicate label " + str + " detected";
+                error = "Duplicate label " + std::string(label.source) +
+                        " detected";
                 return false;
             }
 
             program_label newLabel;
-            newLabel.offset = program.write_static_string(label.source);
+            newLabel.name = program.write_static_string(label.source);
             newLabel.pc = program.opcodes.size();
             newLabel.stackalloc = 0;
+            newLabel.save_mask = 0;
 
             // Check to see if a number is next
             skip_whitespace();
@@ -305,39 +409,50 @@ namespace minivm
                 {
                     error =
                         "Unexpected EOF while reading stackalloc for label " +
-                        str;
+                        std::string(label.source);
                     return false;
                 }
 
                 if (!read_number(numtok.source, newLabel.stackalloc))
                 {
-                    error = "Failed to read stackalloc for label " + str +
-                            " - " + error;
+                    error = "Failed to read stackalloc for label " +
+                            std::string(label.source) + " - " + error;
                     return false;
                 }
             }
 
             program.labels.push_back(newLabel);
-            program.label_map.insert(
-                {str, uint32_t(program.labels.size() - 1)});
 
             return true;
         }
 
         uint8_t read_opcode_register_arg(bool& success)
+        {
+            return read_opcode_register_arg('r', "register", success);
+        }
+
+        uint8_t read_opcode_vector_arg(bool& success)
+        {
+            return read_opcode_register_arg('v', "vector register", success);
+        }
+
+        // Reads a register named by prefix followed by its index
+        uint8_t read_opcode_register_arg(char prefix, const char* kind,
+                                         bool& success)
         {
             token rtok;
             if (!gettok(rtok))
             {
-                error = "Expected register, got EOF";
+                error = std::string("Expected ") + kind + ", got EOF";
                 success = false;
                 return 0;
             }
 
             uint8_t reg;
-            if (rtok.source[0] != 'r')
+            if (rtok.source[0] != prefix)
             {
-                error = "Expected register, got " + std::string(rtok.source);
+                error = std::string("Expected ") + kind + ", got " +
+                        std::string(rtok.source);
                 success = false;
                 return 0;
             }
@@ -353,6 +468,92 @@ namespace minivm
             return reg;
         }
 
+        enum class operand_kind
+        {
+            reg,
+            immediate,
+            constant,
+        };
+
+        // Reads the last operand of an arithmetic or cmp instruction, which
+        // may be a register, a literal that fits in the 16 bit immediate
+        // slot, or anything else that can be loaded with loadc.
+        bool read_opcode_operand(opcode& op, bool isSigned, bool isFloat,
+                                 operand_kind& kind)
+        {
+            auto ogOffset = offset;
+
+            token otok;
+            if (!gettok(otok))
+            {
+                error = "Expected register or constant, got EOF";
+                return false;
+            }
+
+            char start = otok.source[0];
+            if (start == 'r')
+            {
+                uint8_t reg;
+                if (!read_number(otok.source.substr(1), reg))
+                {
+                    error =
+                        "Invalid register index " + std::string(otok.source);
+                    return false;
+                }
+                op.reg2 = reg;
+                kind = operand_kind::reg;
+                return true;
+            }
+
+            if (!isFloat && otok.type == token::toktype::ident &&
+                (is_signed_start(start) || is_unsigned_start(start)))
+            {
+                auto digits = otok.source.substr(1);
+                if (isSigned)
+                {
+                    int64_t value;
+                    auto res = std::from_chars(
+                        digits.data(), digits.data() + digits.size(), value);
+                    if (res.ec == std::errc() &&
+                        res.ptr == digits.data() + digits.size() &&
+                        value >= INT16_MIN && value <= INT16_MAX)
+                    {
+                        op.arg1 = uint16_t(int16_t(value));
+                        kind = operand_kind::immediate;
+                        return true;
+                    }
+                }
+                else
+                {
+                    uint64_t value;
+                    auto res = std::from_chars(
+                        digits.data(), digits.data() + digits.size(), value);
+                    if (res.ec == std::errc() &&
+                        res.ptr == digits.data() + digits.size() &&
+                        value <= UINT16_MAX)
+                    {
+                        op.arg1 = uint16_t(value);
+                        kind = operand_kind::immediate;
+                        return true;
+                    }
+                }
+            }
+
+            // Everything else goes through the constant table
+            offset = ogOffset;
+            if (!read_opcode_constant_arg(op.arg1)) return false;
+
+            if (program.constants[op.arg1].is_data_offset)
+            {
+                error =
+                    "String constants can't be used as operands - load them "
+                    "into a register with loadc first";
+                return false;
+            }
+            kind = operand_kind::constant;
+            return true;
+        }
+
         bool read_opcode_constant_arg(uint16_t& target)
         {
             // Kind of hacky, but we can use this to read the constant value
@@ -367,54 +568,45 @@ namespace minivm
             }
 
             std::string_view constant = ctok.source;
-            std::string ctokSrc(ctok.source);
             if (ctok.type == token::toktype::cname)
             {
-                if (!constantMap.count(ctokSrc))
+                auto it = constantMap.find(constant);
+                if (it == constantMap.end())
                 {
                     error =
                         "Instruction attempted to use unknown "
                         "constant [" +
-                        ctokSrc + "]";
+                        std::string(constant) + "]";
                     return false;
                 }
-                target = constantMap[ctokSrc];
+                target = it->second;
             }
             else if (is_signed_start(constant[0]) ||
                      is_unsigned_start(constant[0]) ||
                      is_float_start(constant[0]) ||
-                     is_string_terminal(constant[0]) ||
-                     is_unsigned_start(constant[0]))
+                     is_string_terminal(constant[0]))
             {
+                // Inline constants are keyed on their spelling in the source,
+                // so repeated uses share a single constant table entry
                 offset = ogOffset;
+                skip_whitespace();
 
-                std::string key;
-                if (is_string_terminal(constant[0]))
-                {
-                    auto prevOffset = offset;
-                    if (!read_string_literal(key))
-                    {
-                        error = "Failed to read inline constant - " + error;
-                        return false;
-                    }
-                    offset = prevOffset;
-                }
-                else
-                {
-                    key = ctok.source;
-                }
-
-                key = "%_impl_" + key;
-
-                token nametok;
-                nametok.source = key;
-                if (!read_constant(nametok, true))
+                auto start = offset;
+                constant_value val;
+                if (!read_constant(val))
                 {
                     error = "Failed to read inline constant - " + error;
                     return false;
                 }
 
-                target = constantMap[key];
+                auto key = source.substr(start, offset - start);
+                auto idx = uint32_t(program.constants.size());
+                auto inserted = inlineConstantMap.insert({key, idx});
+                if (inserted.second)
+                {
+                    program.constants.push_back(val);
+                }
+                target = inserted.first->second;
             }
             else
             {
@@ -425,6 +617,37 @@ namespace minivm
             return true;
         }
 
+        // Reads a signed literal that fits in 16 bits
+        bool read_opcode_offset(uint16_t& target)
+        {
+            token otok;
+            if (!gettok(otok))
+            {
+                error = "Expected offset, got EOF";
+                return false;
+            }
+
+            if (otok.type == token::toktype::ident &&
+                is_signed_start(otok.source[0]))
+            {
+                auto digits = otok.source.substr(1);
+                int64_t value;
+                auto res = std::from_chars(
+                    digits.data(), digits.data() + digits.size(), value);
+                if (res.ec == std::errc() &&
+                    res.ptr == digits.data() + digits.size() &&
+                    value >= INT16_MIN && value <= INT16_MAX)
+                {
+                    target = uint16_t(int16_t(value));
+                    return true;
+                }
+            }
+
+            error = "Expected an offset between i-32768 and i32767, got " +
+                    std::string(otok.source);
+            return false;
+        }
+
         bool read_opcode_u16(uint16_t& target)
         {
             token ctok;
@@ -456,35 +679,41 @@ namespace minivm
                 return false;
             }
 
-            std::string label(labelTok.source);
-            if (program.label_map.count(label))
+            auto label = labelTok.source;
+            auto it = labelMap.find(label);
+            if (it != labelMap.end())
             {
-                target = program.get_label_id(label).idx;
+                target = it->second;
             }
             else
             {
-                target = 0;
-
-                for (size_t i = 0; i < future_labels.size(); ++i)
-                {
-                    if (future_labels[i] == label)
-                    {
-                        target = i + 1;
-                        break;
-                    }
-                }
-
-                if (target == 0)
+                // Forward references are numbered in order of first use and
+                // resolved once the whole source has been read
+                auto inserted = futureLabelMap.insert(
+                    {label, uint32_t(future_labels.size())});
+                if (inserted.second)
                 {
-                    target = uint32_t(future_labels.size());
                     future_labels.push_back(label);
                 }
-                else
-                {
-                    --target;
-                }
-                target |= (1 << 31);
+                target = inserted.first->second | (1u << 31);
+            }
+            return true;
+        }
+
+        bool read_opcode_branch_label(opcode& op)
+        {
+            uint32_t target;
+            if (!read_opcode_label(target)) return false;
+
+            if (target & (1 << 31))
+            {
+                pending_branches.push_back(
+                    {uint32_t(program.opcodes.size()), target & ~(1u << 31)});
+                set_branch_label(op, 0);
+                return true;
             }
+
+            set_branch_label(op, target);
             return true;
         }
 
@@ -503,16 +732,14 @@ namespace minivm
                 return false;
             }
 
-            std::string external(labelTok.source);
-            if (program.extern_map.count(external))
-            {
-                target = program.get_extern_id(external).idx;
-            }
-            else
+            auto it = externMap.find(labelTok.source);
+            if (it == externMap.end())
             {
-                error = "Failed to locate external " + external;
+                error = "Failed to locate external " +
+                        std::string(labelTok.source);
                 return false;
             }
+            target = it->second;
             return true;
         }
 
@@ -531,16 +758,14 @@ namespace minivm
                 return false;
             }
 
-            std::string external(labelTok.source);
-            if (program.extern_map.count(external))
+            auto it = externMap.find(labelTok.source);
+            if (it == externMap.end())
             {
-                target = program.get_extern_id(external).idx;
-            }
-            else
-            {
-                error = "Failed to locate external " + external;
+                error = "Failed to locate external " +
+                        std::string(labelTok.source);
                 return false;
             }
+            target = it->second;
             return true;
         }
 
@@ -592,6 +817,22 @@ namespace minivm
                     {"sloadi16", instruction::sloadi16},
                     {"sloadi8", instruction::sloadi8},
                     {"sloadf32", instruction::sloadf32},
+                    {"mstore", instruction::mstore},
+                    {"mstoreu32", instruction::mstoreu32},
+                    {"mstoreu16", instruction::mstoreu16},
+                    {"mstoreu8", instruction::mstoreu8},
+                    {"mstorei32", instruction::mstorei32},
+                    {"mstorei16", instruction::mstorei16},
+                    {"mstorei8", instruction::mstorei8},
+                    {"mstoref32", instruction::mstoref32},
+                    {"mload", instruction::mload},
+                    {"mloadu32", instruction::mloadu32},
+                    {"mloadu16", instruction::mloadu16},
+                    {"mloadu8", instruction::mloadu8},
+                    {"mloadi32", instruction::mloadi32},
+                    {"mloadi16", instruction::mloadi16},
+                    {"mloadi8", instruction::mloadi8},
+                    {"mloadf32", instruction::mloadf32},
                     {"mov", instruction::mov},
                     {"utoi", instruction::utoi},
                     {"utof", instruction::utof},
@@ -619,24 +860,66 @@ namespace minivm
                     {"jump", instruction::jump},
                     {"jeq", instruction::jeq},
                     {"jne", instruction::jne},
+                    {"jlti", instruction::jlti},
+                    {"jlei", instruction::jlei},
+                    {"jgti", instruction::jgti},
+                    {"jgei", instruction::jgei},
+                    {"jltu", instruction::jltu},
+                    {"jleu", instruction::jleu},
+                    {"jgtu", instruction::jgtu},
+                    {"jgeu", instruction::jgeu},
+                    {"jltf", instruction::jltf},
+                    {"jlef", instruction::jlef},
+                    {"jgtf", instruction::jgtf},
+                    {"jgef", instruction::jgef},
+                    {"jeqf", instruction::jeqf},
+                    {"jnef", instruction::jnef},
                     {"call", instruction::call},
+                    {"tailcall", instruction::tailcall},
                     {"callext", instruction::callext},
                     {"yield", instruction::yield},
                     {"ret", instruction::ret},
+                    {"vaddf32", instruction::vaddf32},
+                    {"vsubf32", instruction::vsubf32},
+                    {"vmulf32", instruction::vmulf32},
+                    {"vdivf32", instruction::vdivf32},
+                    {"vfmaf32", instruction::vfmaf32},
+                    {"vaddf64", instruction::vaddf64},
+                    {"vsubf64", instruction::vsubf64},
+                    {"vmulf64", instruction::vmulf64},
+                    {"vdivf64", instruction::vdivf64},
+                    {"vfmaf64", instruction::vfmaf64},
+                    {"vaddi32", instruction::vaddi32},
+                    {"vsubi32", instruction::vsubi32},
+                    {"vmuli32", instruction::vmuli32},
+                    {"vdivi32", instruction::vdivi32},
+                    {"vfmai32", instruction::vfmai32},
+                    {"vmov", instruction::vmov},
+                    {"vbroadcastf32", instruction::vbroadcastf32},
+                    {"vbroadcastf64", instruction::vbroadcastf64},
+                    {"vbroadcasti32", instruction::vbroadcasti32},
+                    {"vshuf32", instruction::vshuf32},
+                    {"vshuf64", instruction::vshuf64},
+                    {"vsstore", instruction::vsstore},
+                    {"vsstore128", instruction::vsstore128},
+                    {"vsload", instruction::vsload},
+                    {"vsload128", instruction::vsload128},
                     // End generated
                 };
 
+            // Unused operand bits are zeroed so identical sources produce
+            // identical opcodes (and binary images)
             opcode op;
-            if (map.count(instruction.source))
-            {
-                op.instruction = map[instruction.source];
-            }
-            else
+            op.warg0 = 0;
+            op.arg1 = 0;
+            auto it = map.find(instruction.source);
+            if (it == map.end())
             {
                 error =
                     "Unknown instruction " + std::string(instruction.source);
                 return false;
             }
+            op.instruction = it->second;
 
             bool success = true;
             switch (op.instruction)
@@ -671,13 +954,66 @@ namespace minivm
                 case instruction::sloadi8:
                 case instruction::sloadf32:
                 {
+                    // Value register, then a register holding the offset
+                    // from the start of the current stack frame
+                    op.reg0 = read_opcode_register_arg(success);
+                    if (!success) return false;
+
+                    op.reg1 = read_opcode_register_arg(success);
+                    if (!success) return false;
+                    break;
+                }
+                case instruction::mstore:
+                case instruction::mstoreu32:
+                case instruction::mstoreu16:
+                case instruction::mstoreu8:
+                case instruction::mstorei32:
+                case instruction::mstorei16:
+                case instruction::mstorei8:
+                case instruction::mstoref32:
+                case instruction::mload:
+                case instruction::mloadu32:
+                case instruction::mloadu16:
+                case instruction::mloadu8:
+                case instruction::mloadi32:
+                case instruction::mloadi16:
+                case instruction::mloadi8:
+                case instruction::mloadf32:
+                {
+                    // Value register, a register holding a pointer, then a
+                    // literal offset from it
                     op.reg0 = read_opcode_register_arg(success);
                     if (!success) return false;
 
-                    if (!read_opcode_number_value(op.arg1)) return false;
+                    op.reg1 = read_opcode_register_arg(success);
+                    if (!success) return false;
+
+                    if (!read_opcode_offset(op.arg1)) return false;
                     break;
                 }
                 case instruction::cmp:
+                {
+                    op.reg0 = read_opcode_register_arg(success);
+                    if (!success) return false;
+
+                    operand_kind kind;
+                    if (!read_opcode_operand(op, true, false, kind))
+                        return false;
+
+                    if (kind == operand_kind::reg)
+                    {
+                        op.reg1 = op.reg2;
+                        op.reg2 = 0;
+                    }
+                    else
+                    {
+                        op.instruction = kind == operand_kind::immediate
+                                             ? instruction::cmp_imm
+                                             : instruction::cmp_const;
+                    }
+                    break;
+                }
+
                 case instruction::mov:
                 {
                     op.reg0 = read_opcode_register_arg(success);
@@ -724,9 +1060,20 @@ namespace minivm
                     op.reg1 = read_opcode_register_arg(success);
                     if (!success) return false;
 
-                    op.reg2 = read_opcode_register_arg(success);
-                    if (!success) return false;
+                    operand_kind kind;
+                    if (!read_opcode_operand(op, is_signed_arith(op.instruction),
+                                             is_float_arith(op.instruction),
+                                             kind))
+                        return false;
 
+                    if (kind == operand_kind::immediate)
+                    {
+                        op.instruction = arith_imm_form(op.instruction);
+                    }
+                    else if (kind == operand_kind::constant)
+                    {
+                        op.instruction = arith_const_form(op.instruction);
+                    }
                     break;
                 }
 
@@ -747,7 +1094,32 @@ namespace minivm
                     if (!read_opcode_label(op.warg0)) return false;
                     break;
                 }
+                case instruction::jlti:
+                case instruction::jlei:
+                case instruction::jgti:
+                case instruction::jgei:
+                case instruction::jltu:
+                case instruction::jleu:
+                case instruction::jgtu:
+                case instruction::jgeu:
+                case instruction::jltf:
+                case instruction::jlef:
+                case instruction::jgtf:
+                case instruction::jgef:
+                case instruction::jeqf:
+                case instruction::jnef:
+                {
+                    op.reg0 = read_opcode_register_arg(success);
+                    if (!success) return false;
+
+                    op.reg1 = read_opcode_register_arg(success);
+                    if (!success) return false;
+
+                    if (!read_opcode_branch_label(op)) return false;
+                    break;
+                }
                 case instruction::call:
+                case instruction::tailcall:
                     if (!read_opcode_label(op.warg0)) return false;
                     break;
                 case instruction::callext:
@@ -757,6 +1129,177 @@ namespace minivm
                 case instruction::ret:
                     // No arguments
                     break;
+                case instruction::vaddf32:
+                case instruction::vsubf32:
+                case instruction::vmulf32:
+                case instruction::vdivf32:
+                case instruction::vaddf64:
+                case instruction::vsubf64:
+                case instruction::vmulf64:
+                case instruction::vdivf64:
+                case instruction::vaddi32:
+                case instruction::vsubi32:
+                case instruction::vmuli32:
+                case instruction::vdivi32:
+                {
+                    op.reg0 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg1 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg2 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+                    break;
+                }
+                case instruction::vfmaf32:
+                case instruction::vfmaf64:
+                case instruction::vfmai32:
+                {
+                    op.reg0 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg1 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg2 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg3 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+                    break;
+                }
+                case instruction::vmov:
+                {
+                    op.reg0 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg1 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+                    break;
+                }
+                case instruction::vshuf32:
+                case instruction::vshuf64:
+                {
+                    // Destination, source, then a register holding the
+                    // source lane of each destination lane
+                    op.reg0 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg1 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg2 = read_opcode_register_arg(success);
+                    if (!success) return false;
+                    break;
+                }
+                case instruction::vbroadcastf32:
+                case instruction::vbroadcastf64:
+                case instruction::vbroadcasti32:
+                case instruction::vsstore:
+                case instruction::vsstore128:
+                case instruction::vsload:
+                case instruction::vsload128:
+                {
+                    // Vector register, then a scalar register holding the
+                    // value to broadcast or the stack offset
+                    op.reg0 = read_opcode_vector_arg(success);
+                    if (!success) return false;
+
+                    op.reg1 = read_opcode_register_arg(success);
+                    if (!success) return false;
+                    break;
+                }
+                case instruction::halt:
+                case instruction::loadc_data:
+                case instruction::addi_imm:
+                case instruction::addu_imm:
+                case instruction::subi_imm:
+                case instruction::subu_imm:
+                case instruction::muli_imm:
+                case instruction::mulu_imm:
+                case instruction::divi_imm:
+                case instruction::divu_imm:
+                case instruction::addi_const:
+                case instruction::addu_const:
+                case instruction::addf_const:
+                case instruction::subi_const:
+                case instruction::subu_const:
+                case instruction::subf_const:
+                case instruction::muli_const:
+                case instruction::mulu_const:
+                case instruction::mulf_const:
+                case instruction::divi_const:
+                case instruction::divu_const:
+                case instruction::divf_const:
+                case instruction::cmp_imm:
+                case instruction::cmp_const:
+                case instruction::loadc_addi:
+                case instruction::loadc_addu:
+                case instruction::loadc_addf:
+                case instruction::loadc_subi:
+                case instruction::loadc_subu:
+                case instruction::loadc_subf:
+                case instruction::loadc_muli:
+                case instruction::loadc_mulu:
+                case instruction::loadc_mulf:
+                case instruction::eload_addi:
+                case instruction::eload_addu:
+                case instruction::eload_addf:
+                case instruction::eload_subi:
+                case instruction::eload_subu:
+                case instruction::eload_subf:
+                case instruction::eload_muli:
+                case instruction::eload_mulu:
+                case instruction::eload_mulf:
+                case instruction::cmp_jeq:
+                case instruction::cmp_jne:
+                case instruction::loadc_cmp_jeq:
+                case instruction::loadc_cmp_jne:
+                case instruction::addi_cmp_jeq:
+                case instruction::addi_cmp_jne:
+                case instruction::addu_cmp_jeq:
+                case instruction::addu_cmp_jne:
+                case instruction::addi_imm_cmp_jeq:
+                case instruction::addi_imm_cmp_jne:
+                case instruction::cmp_imm_jeq:
+                case instruction::cmp_imm_jne:
+                case instruction::sstore_checked:
+                case instruction::sstoreu32_checked:
+                case instruction::sstoreu16_checked:
+                case instruction::sstoreu8_checked:
+                case instruction::sstorei32_checked:
+                case instruction::sstorei16_checked:
+                case instruction::sstorei8_checked:
+                case instruction::sstoref32_checked:
+                case instruction::sload_checked:
+                case instruction::sloadu32_checked:
+                case instruction::sloadu16_checked:
+                case instruction::sloadu8_checked:
+                case instruction::sloadi32_checked:
+                case instruction::sloadi16_checked:
+                case instruction::sloadi8_checked:
+                case instruction::sloadf32_checked:
+                case instruction::vsstore_checked:
+                case instruction::vsstore128_checked:
+                case instruction::vsload_checked:
+                case instruction::vsload128_checked:
+                case instruction::mstore_checked:
+                case instruction::mstoreu32_checked:
+                case instruction::mstoreu16_checked:
+                case instruction::mstoreu8_checked:
+                case instruction::mstorei32_checked:
+                case instruction::mstorei16_checked:
+                case instruction::mstorei8_checked:
+                case instruction::mstoref32_checked:
+                case instruction::mload_checked:
+                case instruction::mloadu32_checked:
+                case instruction::mloadu16_checked:
+                case instruction::mloadu8_checked:
+                case instruction::mloadi32_checked:
+                case instruction::mloadi16_checked:
+                case instruction::mloadi8_checked:
+                case instruction::mloadf32_checked:
                 case instruction::Count:
                 {
                     error = "Loader for instruction " +
@@ -803,23 +1346,25 @@ namespace minivm
 
         inline bool read_string_into_constant_value(constant_value& val)
         {
-            std::string str;
-            if (!read_string_literal(str))
+            auto start = offset;
+            if (!read_string_literal(literal))
             {
                 return false;
             }
 
-            // If it's in the string table already, then don't duplicate it.
-            if (constantStringTable.count(str))
+            // Identical literals share their static data.  They are keyed on
+            // the raw source so the lookup doesn't need to own the string.
+            auto raw = source.substr(start, offset - start);
+            auto it = constantStringTable.find(raw);
+            if (it != constantStringTable.end())
             {
-                val.value.ureg = constantStringTable[str];
+                val.value.ureg = it->second;
             }
             else
             {
-                // Copy if it isn't in the string table
-                auto start = program.write_static_string(str);
-                val.value.ureg = start;
-                constantStringTable[str] = start;
+                auto dataOffset = program.write_static_string(literal);
+                val.value.ureg = dataOffset;
+                constantStringTable.insert({raw, dataOffset});
             }
             val.is_data_offset = true;
             return true;
@@ -905,99 +1450,100 @@ namespace minivm
             return true;
         }
 
-        bool read_constant(token& nameTok, constant_value& val,
-                           bool ignoreDuplicates)
+        bool read_constant(token& nameTok)
         {
-            bool hasDuplicate = false;
-            std::string name = std::string(nameTok.source);
-            if (constantMap.count(name))
+            auto idx = uint32_t(program.constants.size());
+            if (!constantMap.insert({nameTok.source, idx}).second)
             {
-                hasDuplicate = true;
-                if (!ignoreDuplicates)
-                {
-                    error =
-                        "Constant redefinition: [" + name + "] already exists";
-                    return false;
-                }
+                error = "Constant redefinition: [" +
+                        std::string(nameTok.source) + "] already exists";
+                return false;
             }
 
             skip_whitespace();
 
+            constant_value val;
             if (!read_constant(val))
             {
-                error = "Failed to read constant [" + name + "]: " + error;
+                error = "Failed to read constant [" +
+                        std::string(nameTok.source) + "]: " + error;
+                return false;
             }
 
-            if (!hasDuplicate)
-            {
-                constantMap.insert({name, uint32_t(program.constants.size())});
-                program.constants.push_back(val);
-            }
+            program.constants.push_back(val);
             return true;
         }
 
-        bool read_constant(token& nameTok, bool ignoreDuplicates = false)
+        bool postprocess_label_references()
         {
-            constant_value val;
-            return read_constant(nameTok, val, ignoreDuplicates);
-        }
+            if (future_labels.size() == 0) return true;
 
-        bool postprocess_labels()
-        {
-            for (auto& label : program.labels)
+            // Resolve each forward reference once rather than per use
+            std::vector<uint32_t> resolved(future_labels.size());
+            for (size_t i = 0; i < future_labels.size(); ++i)
             {
-                label.name = &program._data[label.offset];
+                auto it = labelMap.find(future_labels[i]);
+                if (it == labelMap.end())
+                {
+                    error = "Jump to unknown label " +
+                            std::string(future_labels[i]);
+                    return false;
+                }
+                resolved[i] = it->second;
             }
-            return true;
-        }
 
-        bool postprocess_label_references()
-        {
-            if (future_labels.size() == 0) return true;
             for (auto& op : program.opcodes)
             {
                 switch (op.instruction)
                 {
                     case instruction::call:
+                    case instruction::tailcall:
                     case instruction::jump:
                     case instruction::jne:
                     case instruction::jeq:
                         if (op.warg0 & (1 << 31))
                         {
-                            op.warg0 &= ~(1 << 31);
-
-                            auto& label = future_labels[op.warg0];
-                            if (!program.label_map.count(label))
-                            {
-                                error = "Jump to unknown label " + label;
-                                return false;
-                            }
-                            op.warg0 = program.get_label_id(label).idx;
+                            op.warg0 = resolved[op.warg0 & ~(1u << 31)];
                         }
                         break;
                     default:
                         break;
                 }
             }
+
+            for (auto& pending : pending_branches)
+            {
+                set_branch_label(program.opcodes[pending.op],
+                                 resolved[pending.future_label]);
+            }
             return true;
         }
 
-        bool postprocess_constant_values()
+        // A call that is immediately followed by ret can reuse the current
+        // frame.  The ret is left in place in case it is a jump target.
+        bool postprocess_tailcalls()
         {
-            for (auto& cval : program.constants)
+            for (size_t i = 0; i + 1 < program.opcodes.size(); ++i)
             {
-                if (cval.is_data_offset)
+                if (program.opcodes[i].instruction == instruction::call &&
+                    program.opcodes[i + 1].instruction == instruction::ret)
                 {
-                    cval.value.ureg = reinterpret_cast<uint64_t>(
-                        &program._data[cval.value.ureg]);
-
-                    cval.is_data_offset = false;
-                    cval.is_pointer = true;
+                    program.opcodes[i].instruction = instruction::tailcall;
                 }
             }
             return true;
         }
 
+        bool postprocess_terminator()
+        {
+            opcode op;
+            op.warg0 = 0;
+            op.arg1 = 0;
+            op.instruction = instruction::halt;
+            program.opcodes.push_back(op);
+            return true;
+        }
+
         bool parse()
         {
             token tok;
@@ -1019,27 +1565,51 @@ namespace minivm
                         break;
                 }
             }
-            return postprocess_labels() && postprocess_label_references() &&
-                   postprocess_constant_values();
+            return postprocess_label_references() && postprocess_tailcalls() &&
+                   postprocess_terminator();
         }
 
-        std::unordered_map<std::string, uint64_t> constantStringTable;
-        std::unordered_map<std::string, uint32_t> constantMap;
+        // Every name the parser tracks is a view into the source, which
+        // outlives the parse, so lookups never allocate
+        std::unordered_map<std::string_view, uint32_t> constantStringTable;
+        std::unordered_map<std::string_view, uint32_t> constantMap;
+        std::unordered_map<std::string_view, uint32_t> inlineConstantMap;
+        std::unordered_map<std::string_view, uint32_t> labelMap;
+        std::unordered_map<std::string_view, uint32_t> externMap;
+        std::unordered_map<std::string_view, uint32_t> futureLabelMap;
+
+        // Scratch buffer for decoding string literals
+        std::string literal;
         std::string error;
         std::string_view source;
         uint64_t offset;
 
-        std::vector<std::string> future_labels;
-        std::string_view cur_label;
-        program& program;
+        struct pending_branch
+        {
+            uint32_t op;
+            uint32_t future_label;
+        };
+
+        std::vector<std::string_view> future_labels;
+        std::vector<pending_branch> pending_branches;
+        minivm::program& program;
     };
 
     bool program::load_assembly(const std::string_view& mvmaSrc)
     {
+        clear();
+
         asm_parser parser(*this, mvmaSrc);
         if (!parser.parse())
         {
             load_error = parser.error;
+            clear();
+            return false;
+        }
+
+        if (!finalize())
+        {
+            clear();
             return false;
         }
         return true;
@@ -1081,72 +1651,120 @@ namespace minivm
     bool program::set_unsigned_extern(const std::string_view& name,
                                       uint64_t value)
     {
-        auto namev = std::string(name);
-        if (extern_map.count(namev))
-        {
-            get_extern(extern_map[namev]).value.ureg = value;
-            return true;
-        }
-        return false;
+        program_extern_id_t id;
+        if (!get_extern_id(name, id)) return false;
+
+        set_unsigned_extern(id, value);
+        return true;
     }
 
     bool program::set_signed_extern(const std::string_view& name, int64_t value)
     {
-        auto namev = std::string(name);
-        if (extern_map.count(namev))
-        {
-            get_extern(extern_map[namev]).value.ireg = value;
-            return true;
-        }
-        return false;
+        program_extern_id_t id;
+        if (!get_extern_id(name, id)) return false;
+
+        set_signed_extern(id, value);
+        return true;
     }
 
     bool program::set_floating_extern(const std::string_view& name,
                                       double value)
     {
-        auto namev = std::string(name);
-        if (extern_map.count(namev))
-        {
-            get_extern(extern_map[namev]).value.freg = value;
-            return true;
-        }
-        return false;
+        program_extern_id_t id;
+        if (!get_extern_id(name, id)) return false;
+
+        set_floating_extern(id, value);
+        return true;
     }
 
     bool program::get_extern_ptr(const std::string_view& name, uint64_t** value)
     {
-        auto namev = std::string(name);
-        if (extern_map.count(namev))
+        program_extern_id_t id;
+        if (!get_extern_id(name, id))
         {
-            *value = &get_extern(extern_map[namev]).value.ureg;
-            return true;
+            *value = 0;
+            return false;
         }
-        *value = 0;
-        return false;
-    }
+
+        *value = get_unsigned_extern_ptr(id);
+        return true;
+    }
 
     bool program::get_extern_ptr(const std::string_view& name, int64_t** value)
     {
-        auto namev = std::string(name);
-        if (extern_map.count(namev))
+        program_extern_id_t id;
+        if (!get_extern_id(name, id))
         {
-            *value = &get_extern(extern_map[namev]).value.ireg;
-            return true;
+            *value = 0;
+            return false;
         }
-        *value = 0;
-        return false;
+
+        *value = get_signed_extern_ptr(id);
+        return true;
     }
 
     bool program::get_extern_ptr(const std::string_view& name, double** value)
     {
-        auto namev = std::string(name);
-        if (extern_map.count(namev))
+        program_extern_id_t id;
+        if (!get_extern_id(name, id))
         {
-            *value = &get_extern(extern_map[namev]).value.freg;
-            return true;
+            *value = 0;
+            return false;
         }
-        *value = 0;
-        return false;
+
+        *value = get_floating_extern_ptr(id);
+        return true;
+    }
+
+    void program::set_extern_function_ptr(program_extern_id_t id,
+                                          extern_program_func_t func)
+    {
+        set_extern_pointer(id, func);
+    }
+
+    void program::set_unsigned_extern(program_extern_id_t id, uint64_t value)
+    {
+        get_extern(id).value.ureg = value;
+    }
+
+    void program::set_signed_extern(program_extern_id_t id, int64_t value)
+    {
+        get_extern(id).value.ireg = value;
+    }
+
+    void program::set_floating_extern(program_extern_id_t id, double value)
+    {
+        get_extern(id).value.freg = value;
+    }
+
+    uint64_t* program::get_unsigned_extern_ptr(program_extern_id_t id)
+    {
+        return &get_extern(id).value.ureg;
+    }
+
+    int64_t* program::get_signed_extern_ptr(program_extern_id_t id)
+    {
+        return &get_extern(id).value.ireg;
+    }
+
+    double* program::get_floating_extern_ptr(program_extern_id_t id)
+    {
+        return &get_extern(id).value.freg;
+    }
+
+    const opcode* program::get_opcodes() const
+    {
+        return _image ? _image->opcodes : opcodes.data();
+    }
+
+    size_t program::get_opcode_count() const
+    {
+        return _image ? _image->opcode_count : opcodes.size();
+    }
+
+    const char* program::get_data() const
+    {
+        return _image ? _image->data : _data.data();
     }
 
     uint32_t program::write_static_string(const std::string_view& str)
@@ -1166,31 +1784,1018 @@ namespace minivm
         return start;
     }
 
-    program_label_id_t program::get_label_id(const std::string_view& label)
+    // Returns a mask of the registers an instruction writes to
+    static uint16_t get_written_registers(const opcode& op)
     {
-        // TODO: This doesn't need to allocate
-        return label_map[std::string(label)];
+        switch (op.instruction)
+        {
+            case instruction::estore:
+            case instruction::sstore:
+            case instruction::sstoreu32:
+            case instruction::sstoreu16:
+            case instruction::sstoreu8:
+            case instruction::sstorei32:
+            case instruction::sstorei16:
+            case instruction::sstorei8:
+            case instruction::sstoref32:
+            case instruction::mstore:
+            case instruction::mstoreu32:
+            case instruction::mstoreu16:
+            case instruction::mstoreu8:
+            case instruction::mstorei32:
+            case instruction::mstorei16:
+            case instruction::mstorei8:
+            case instruction::mstoref32:
+            case instruction::printi:
+            case instruction::printu:
+            case instruction::printf:
+            case instruction::prints:
+            case instruction::cmp:
+            case instruction::cmp_imm:
+            case instruction::cmp_const:
+            case instruction::jump:
+            case instruction::jeq:
+            case instruction::jne:
+            case instruction::jlti:
+            case instruction::jlei:
+            case instruction::jgti:
+            case instruction::jgei:
+            case instruction::jltu:
+            case instruction::jleu:
+            case instruction::jgtu:
+            case instruction::jgeu:
+            case instruction::jltf:
+            case instruction::jlef:
+            case instruction::jgtf:
+            case instruction::jgef:
+            case instruction::jeqf:
+            case instruction::jnef:
+            case instruction::yield:
+            case instruction::ret:
+            case instruction::halt:
+                return 0;
+
+            // Vector instructions only write vector registers, which calls
+            // don't preserve
+            case instruction::vaddf32:
+            case instruction::vsubf32:
+            case instruction::vmulf32:
+            case instruction::vdivf32:
+            case instruction::vfmaf32:
+            case instruction::vaddf64:
+            case instruction::vsubf64:
+            case instruction::vmulf64:
+            case instruction::vdivf64:
+            case instruction::vfmaf64:
+            case instruction::vaddi32:
+            case instruction::vsubi32:
+            case instruction::vmuli32:
+            case instruction::vdivi32:
+            case instruction::vfmai32:
+            case instruction::vmov:
+            case instruction::vbroadcastf32:
+            case instruction::vbroadcastf64:
+            case instruction::vbroadcasti32:
+            case instruction::vshuf32:
+            case instruction::vshuf64:
+            case instruction::vsstore:
+            case instruction::vsstore128:
+            case instruction::vsload:
+            case instruction::vsload128:
+                return 0;
+
+            // The callee's mask is merged into the frame when it is entered
+            case instruction::tailcall:
+                return 0;
+
+            // Calls preserve callee-saved registers themselves, and
+            // external functions return their result in r0
+            case instruction::call:
+            case instruction::callext:
+                return 1;
+
+            default:
+                return uint16_t(1 << op.reg0);
+        }
     }
 
-    program_label& program::get_label(const std::string_view& label)
+    void program::compute_save_masks()
     {
-        return get_label(get_label_id(label));
+        const opcode* ops = get_opcodes();
+        size_t opCount = get_opcode_count();
+
+        // Walks everything reachable from each label without leaving it
+        // through a ret, collecting the callee-saved registers written along
+        // the way.
+        //
+        // Only labels that are the target of a call get a precise mask.
+        // Anything else can only be entered from the host, whose outermost
+        // frame saves nothing; the full mask only matters when the host
+        // calls in while a yielded run is still on the call stack.
+        std::vector<bool> isCallTarget(labels.size(), false);
+        for (size_t i = 0; i < opCount; ++i)
+        {
+            auto& op = ops[i];
+            if (op.instruction == instruction::call ||
+                op.instruction == instruction::tailcall)
+            {
+                isCallTarget[op.warg0] = true;
+            }
+        }
+
+        std::vector<uint32_t> visited(opCount, UINT32_MAX);
+        std::vector<uint32_t> pending;
+
+        for (uint32_t labelIdx = 0; labelIdx < labels.size(); ++labelIdx)
+        {
+            auto& label = labels[labelIdx];
+            if (!isCallTarget[labelIdx])
+            {
+                label.save_mask = 0xFF00;
+                continue;
+            }
+
+            uint16_t mask = 0;
+
+            pending.clear();
+            pending.push_back(label.pc);
+            while (pending.size() > 0)
+            {
+                uint32_t pc = pending.back();
+                pending.pop_back();
+
+                while (pc < opCount && visited[pc] != labelIdx)
+                {
+                    visited[pc] = labelIdx;
+
+                    auto& op = ops[pc];
+                    mask |= get_written_registers(op);
+
+                    bool fallsThrough = true;
+                    switch (op.instruction)
+                    {
+                        case instruction::jump:
+                            pending.push_back(labels[op.warg0].pc);
+                            fallsThrough = false;
+                            break;
+                        case instruction::jeq:
+                        case instruction::jne:
+                            pending.push_back(labels[op.warg0].pc);
+                            break;
+                        case instruction::jlti:
+                        case instruction::jlei:
+                        case instruction::jgti:
+                        case instruction::jgei:
+                        case instruction::jltu:
+                        case instruction::jleu:
+                        case instruction::jgtu:
+                        case instruction::jgeu:
+                        case instruction::jltf:
+                        case instruction::jlef:
+                        case instruction::jgtf:
+                        case instruction::jgef:
+                        case instruction::jeqf:
+                        case instruction::jnef:
+                            pending.push_back(labels[get_branch_label(op)].pc);
+                            break;
+                        case instruction::ret:
+                        case instruction::tailcall:
+                        case instruction::halt:
+                            fallsThrough = false;
+                            break;
+                        default:
+                            break;
+                    }
+
+                    if (!fallsThrough) break;
+                    ++pc;
+                }
+            }
+
+            label.save_mask = mask & 0xFF00;
+        }
     }
 
-    program_label& program::get_label(program_label_id_t id)
+    // Label operand of a branch, call or tailcall
+    static bool get_label_operand(const opcode& op, uint32_t& label)
     {
-        return labels[id.idx];
+        switch (op.instruction)
+        {
+            case instruction::jump:
+            case instruction::jeq:
+            case instruction::jne:
+            case instruction::call:
+            case instruction::tailcall:
+                label = op.warg0;
+                return true;
+            case instruction::jlti:
+            case instruction::jlei:
+            case instruction::jgti:
+            case instruction::jgei:
+            case instruction::jltu:
+            case instruction::jleu:
+            case instruction::jgtu:
+            case instruction::jgeu:
+            case instruction::jltf:
+            case instruction::jlef:
+            case instruction::jgtf:
+            case instruction::jgef:
+            case instruction::jeqf:
+            case instruction::jnef:
+                label = get_branch_label(op);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool uses_constant(instruction instr)
+    {
+        switch (instr)
+        {
+            case instruction::loadc:
+            case instruction::addi_const:
+            case instruction::addu_const:
+            case instruction::addf_const:
+            case instruction::subi_const:
+            case instruction::subu_const:
+            case instruction::subf_const:
+            case instruction::muli_const:
+            case instruction::mulu_const:
+            case instruction::mulf_const:
+            case instruction::divi_const:
+            case instruction::divu_const:
+            case instruction::divf_const:
+            case instruction::cmp_const:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Bytes touched by a stack access, or 0 for anything else
+    static uint32_t get_stack_access_width(instruction instr)
+    {
+        switch (instr)
+        {
+            case instruction::vsstore:
+            case instruction::vsload:
+                return 32;
+            case instruction::vsstore128:
+            case instruction::vsload128:
+                return 16;
+            case instruction::sstore:
+            case instruction::sload:
+                return 8;
+            case instruction::sstoreu32:
+            case instruction::sstorei32:
+            case instruction::sstoref32:
+            case instruction::sloadu32:
+            case instruction::sloadi32:
+            case instruction::sloadf32:
+                return 4;
+            case instruction::sstoreu16:
+            case instruction::sstorei16:
+            case instruction::sloadu16:
+            case instruction::sloadi16:
+                return 2;
+            case instruction::sstoreu8:
+            case instruction::sstorei8:
+            case instruction::sloadu8:
+            case instruction::sloadi8:
+                return 1;
+            default:
+                return 0;
+        }
+    }
+
+    // Bounds checked form of a stack access
+    static instruction get_checked_stack_access(instruction instr)
+    {
+        switch (instr)
+        {
+            case instruction::vsstore:
+                return instruction::vsstore_checked;
+            case instruction::vsstore128:
+                return instruction::vsstore128_checked;
+            case instruction::vsload:
+                return instruction::vsload_checked;
+            case instruction::vsload128:
+                return instruction::vsload128_checked;
+            default:
+                return static_cast<instruction>(
+                    uint32_t(instr) - uint32_t(instruction::sstore) +
+                    uint32_t(instruction::sstore_checked));
+        }
+    }
+
+    bool program::verify(std::vector<bool>& checkedAccesses)
+    {
+        const opcode* ops = get_opcodes();
+        uint32_t opCount = uint32_t(get_opcode_count());
+
+        auto fail = [&](const char* message, uint32_t pc)
+        {
+            load_error = std::string(message) + " at pc " + std::to_string(pc);
+            return false;
+        };
+
+        // Operands first, since everything after this indexes with them.
+        // Registers are 4 bit fields and can't be out of range.
+        for (uint32_t pc = 0; pc + 1 < opCount; ++pc)
+        {
+            auto& op = ops[pc];
+            if (op.instruction >= instruction::halt)
+            {
+                return fail("Invalid instruction", pc);
+            }
+
+            uint32_t label;
+            if (get_label_operand(op, label) && label >= labels.size())
+            {
+                return fail("Invalid label index", pc);
+            }
+
+            if (uses_constant(op.instruction) && op.arg1 >= constants.size())
+            {
+                return fail("Invalid constant index", pc);
+            }
+
+            bool usesExtern = op.instruction == instruction::eload ||
+                              op.instruction == instruction::estore;
+            if ((usesExtern && op.arg1 >= externs.size()) ||
+                (op.instruction == instruction::callext &&
+                 op.warg0 >= externs.size()))
+            {
+                return fail("Invalid extern index", pc);
+            }
+        }
+
+        if (opCount == 0 || ops[opCount - 1].instruction != instruction::halt)
+        {
+            load_error = "Program is missing its terminator";
+            return false;
+        }
+
+        for (auto& label : labels)
+        {
+            if (label.pc >= opCount)
+            {
+                load_error = "Label is out of range";
+                return false;
+            }
+        }
+
+        // The terminator is only there to stop the dispatch loop.  Running
+        // into it means the last label is missing its ret.
+        if (opCount > 1)
+        {
+            switch (ops[opCount - 2].instruction)
+            {
+                case instruction::jump:
+                case instruction::tailcall:
+                case instruction::ret:
+                    break;
+                default:
+                    return fail("Control falls off the end of the program",
+                                opCount - 2);
+            }
+        }
+
+        // Every pc gets the smallest frame it can run with.  Called labels
+        // allocate their own frame, and that frame stays in place through
+        // every jump until a ret or tailcall.  Labels that are never called
+        // can only be entered from the host, so they only get a frame of
+        // their own when no called label's code reaches them.
+        std::vector<uint32_t> frames(opCount, UINT32_MAX);
+        std::vector<uint32_t> pending;
+
+        auto seed = [&](uint32_t pc, uint32_t size)
+        {
+            if (size < frames[pc])
+            {
+                frames[pc] = size;
+                pending.push_back(pc);
+            }
+        };
+
+        auto propagate = [&]()
+        {
+            while (pending.size() > 0)
+            {
+                uint32_t pc = pending.back();
+                pending.pop_back();
+
+                auto& op = ops[pc];
+                uint32_t size = frames[pc];
+                uint32_t label;
+                bool fallsThrough = true;
+                switch (op.instruction)
+                {
+                    case instruction::jump:
+                    case instruction::ret:
+                    case instruction::tailcall:
+                    case instruction::halt:
+                        fallsThrough = false;
+                        break;
+                    default:
+                        break;
+                }
+
+                if (op.instruction != instruction::call &&
+                    op.instruction != instruction::tailcall &&
+                    get_label_operand(op, label))
+                {
+                    seed(labels[label].pc, size);
+                }
+
+                if (fallsThrough)
+                {
+                    seed(pc + 1, size);
+                }
+            }
+        };
+
+        for (uint32_t pc = 0; pc + 1 < opCount; ++pc)
+        {
+            auto& op = ops[pc];
+            if (op.instruction == instruction::call ||
+                op.instruction == instruction::tailcall)
+            {
+                auto& label = labels[op.warg0];
+                seed(label.pc, label.stackalloc);
+            }
+        }
+        propagate();
+
+        std::vector<uint32_t> order(labels.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(),
+                         [&](uint32_t a, uint32_t b)
+                         { return labels[a].pc < labels[b].pc; });
+
+        std::vector<bool> isLabel(opCount, false);
+        for (auto i : order)
+        {
+            auto& label = labels[i];
+            isLabel[label.pc] = true;
+            if (frames[label.pc] == UINT32_MAX)
+            {
+                seed(label.pc, label.stackalloc);
+                propagate();
+            }
+            label.stackalloc = std::max(label.stackalloc, frames[label.pc]);
+        }
+
+        // Stack offsets are proven by tracking registers holding known
+        // values through straight-line code.  Nothing is assumed across a
+        // label, and externs (or the host, while yielded) may change any
+        // register.
+        uint16_t known = 0;
+        uint64_t values[16];
+
+        checkedAccesses.assign(opCount, false);
+        for (uint32_t pc = 0; pc + 1 < opCount; ++pc)
+        {
+            auto& op = ops[pc];
+            if (isLabel[pc])
+            {
+                known = 0;
+            }
+
+            auto isKnown = [&](uint8_t reg)
+            { return (known & (1 << reg)) != 0; };
+
+            uint32_t width = get_stack_access_width(op.instruction);
+            if (width > 0 && frames[pc] != UINT32_MAX)
+            {
+                uint64_t frame = frames[pc];
+                bool proven = isKnown(op.reg1) && frame >= width &&
+                              values[op.reg1] <= frame - width;
+                checkedAccesses[pc] = !proven;
+            }
+
+            // Folds reg0 = reg1 oper rhs when reg1 is known
+            bool folded = false;
+            auto fold = [&](bool rhsKnown, uint64_t rhs, char oper)
+            {
+                if (!isKnown(op.reg1) || !rhsKnown) return;
+                uint64_t lhs = values[op.reg1];
+                values[op.reg0] =
+                    oper == '+' ? lhs + rhs
+                                : (oper == '-' ? lhs - rhs : lhs * rhs);
+                folded = true;
+            };
+
+            uint64_t imm = op.arg1;
+            uint64_t simm = uint64_t(int64_t(int16_t(op.arg1)));
+            switch (op.instruction)
+            {
+                case instruction::loadc:
+                {
+                    auto& cval = constants[op.arg1];
+                    if (!cval.is_data_offset)
+                    {
+                        values[op.reg0] = cval.value.ureg;
+                        folded = true;
+                    }
+                    break;
+                }
+                case instruction::mov:
+                case instruction::utoi:
+                case instruction::itou:
+                    fold(true, 0, '+');
+                    break;
+                case instruction::addi:
+                case instruction::addu:
+                    fold(isKnown(op.reg2), values[op.reg2], '+');
+                    break;
+                case instruction::subi:
+                case instruction::subu:
+                    fold(isKnown(op.reg2), values[op.reg2], '-');
+                    break;
+                case instruction::muli:
+                case instruction::mulu:
+                    fold(isKnown(op.reg2), values[op.reg2], '*');
+                    break;
+                case instruction::addi_imm:
+                    fold(true, simm, '+');
+                    break;
+                case instruction::addu_imm:
+                    fold(true, imm, '+');
+                    break;
+                case instruction::subi_imm:
+                    fold(true, simm, '-');
+                    break;
+                case instruction::subu_imm:
+                    fold(true, imm, '-');
+                    break;
+                case instruction::muli_imm:
+                    fold(true, simm, '*');
+                    break;
+                case instruction::mulu_imm:
+                    fold(true, imm, '*');
+                    break;
+                case instruction::addi_const:
+                case instruction::addu_const:
+                    fold(true, constants[op.arg1].value.ureg, '+');
+                    break;
+                case instruction::subi_const:
+                case instruction::subu_const:
+                    fold(true, constants[op.arg1].value.ureg, '-');
+                    break;
+                case instruction::muli_const:
+                case instruction::mulu_const:
+                    fold(true, constants[op.arg1].value.ureg, '*');
+                    break;
+                case instruction::call:
+                case instruction::callext:
+                case instruction::yield:
+                    known = 0;
+                    break;
+                default:
+                    break;
+            }
+
+            if (folded)
+            {
+                known |= uint16_t(1 << op.reg0);
+            }
+            else
+            {
+                known &= ~get_written_registers(op);
+            }
+        }
+
+        return true;
     }
 
-    program_extern_id_t program::get_extern_id(const std::string_view& label)
+    bool program::finalize()
     {
-        // TODO: This doesn't need to allocate
-        return extern_map[std::string(label)];
+        build_name_tables();
+
+        std::vector<bool> checkedAccesses;
+        if (!verify(checkedAccesses))
+        {
+            return false;
+        }
+
+        compute_save_masks();
+
+        const opcode* ops = get_opcodes();
+        size_t opCount = get_opcode_count();
+
+        auto dispatchTable = execution_context::get_dispatch_table();
+
+        _code.resize(opCount);
+        for (size_t i = 0; i < opCount; ++i)
+        {
+            auto& op = ops[i];
+            auto& decoded = _code[i];
+
+            decoded.instruction = op.instruction;
+            decoded.handler =
+                dispatchTable
+                    ? dispatchTable[static_cast<size_t>(op.instruction)]
+                    : nullptr;
+            decoded.reg0 = op.reg0;
+            decoded.reg1 = op.reg1;
+            decoded.reg2 = op.reg2;
+            decoded.reg3 = op.reg3;
+            decoded.reg4 = 0;
+            decoded.arg = 0;
+            decoded.target = 0;
+
+            if (checkedAccesses[i])
+            {
+                decoded.instruction = get_checked_stack_access(op.instruction);
+                decoded.handler =
+                    dispatchTable ? dispatchTable[static_cast<size_t>(
+                                        decoded.instruction)]
+                                  : nullptr;
+            }
+
+            if (_checkMemory && op.instruction >= instruction::mstore &&
+                op.instruction <= instruction::mloadf32)
+            {
+                decoded.instruction = static_cast<instruction>(
+                    uint32_t(op.instruction) - uint32_t(instruction::mstore) +
+                    uint32_t(instruction::mstore_checked));
+                decoded.handler =
+                    dispatchTable ? dispatchTable[static_cast<size_t>(
+                                        decoded.instruction)]
+                                  : nullptr;
+            }
+
+            switch (op.instruction)
+            {
+                case instruction::loadc:
+                {
+                    auto& cval = constants[op.arg1];
+                    if (cval.is_data_offset)
+                    {
+                        decoded.instruction = instruction::loadc_data;
+                        decoded.handler =
+                            dispatchTable
+                                ? dispatchTable[static_cast<size_t>(
+                                      instruction::loadc_data)]
+                                : nullptr;
+                        decoded.arg = uint32_t(cval.value.ureg);
+                    }
+                    else
+                    {
+                        decoded.arg = op.arg1;
+                    }
+                    break;
+                }
+                case instruction::eload:
+                case instruction::estore:
+                case instruction::addi_const:
+                case instruction::addu_const:
+                case instruction::addf_const:
+                case instruction::subi_const:
+                case instruction::subu_const:
+                case instruction::subf_const:
+                case instruction::muli_const:
+                case instruction::mulu_const:
+                case instruction::mulf_const:
+                case instruction::divi_const:
+                case instruction::divu_const:
+                case instruction::divf_const:
+                case instruction::cmp_const:
+                case instruction::addu_imm:
+                case instruction::subu_imm:
+                case instruction::mulu_imm:
+                case instruction::divu_imm:
+                    decoded.arg = op.arg1;
+                    break;
+                case instruction::addi_imm:
+                case instruction::subi_imm:
+                case instruction::muli_imm:
+                case instruction::divi_imm:
+                case instruction::cmp_imm:
+                case instruction::mstore:
+                case instruction::mstoreu32:
+                case instruction::mstoreu16:
+                case instruction::mstoreu8:
+                case instruction::mstorei32:
+                case instruction::mstorei16:
+                case instruction::mstorei8:
+                case instruction::mstoref32:
+                case instruction::mload:
+                case instruction::mloadu32:
+                case instruction::mloadu16:
+                case instruction::mloadu8:
+                case instruction::mloadi32:
+                case instruction::mloadi16:
+                case instruction::mloadi8:
+                case instruction::mloadf32:
+                    decoded.arg = uint32_t(int32_t(int16_t(op.arg1)));
+                    break;
+                case instruction::callext:
+                    decoded.arg = op.warg0;
+                    break;
+                case instruction::jump:
+                case instruction::jeq:
+                case instruction::jne:
+                case instruction::call:
+                case instruction::tailcall:
+                    decoded.arg = op.warg0;
+                    decoded.target = labels[op.warg0].pc;
+                    break;
+                case instruction::jlti:
+                case instruction::jlei:
+                case instruction::jgti:
+                case instruction::jgei:
+                case instruction::jltu:
+                case instruction::jleu:
+                case instruction::jgtu:
+                case instruction::jgeu:
+                case instruction::jltf:
+                case instruction::jlef:
+                case instruction::jgtf:
+                case instruction::jgef:
+                case instruction::jeqf:
+                case instruction::jnef:
+                    decoded.arg = get_branch_label(op);
+                    decoded.target = labels[decoded.arg].pc;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        _aot = nullptr;
+
+        // The JIT works from the unfused stream
+        _native.reset();
+        if (_jit)
+        {
+            _native = native_runtime::compile(*this);
+        }
+
+        _fusions.clear();
+        if (_fuse)
+        {
+            fuse_superinstructions();
+        }
+        return true;
     }
 
-    program_extern_value& program::get_extern(const std::string_view& label)
+    static bool is_fusable_arith(instruction instr)
     {
-        return get_extern(get_extern_id(label));
+        switch (instr)
+        {
+            case instruction::addi:
+            case instruction::addu:
+            case instruction::addf:
+            case instruction::subi:
+            case instruction::subu:
+            case instruction::subf:
+            case instruction::muli:
+            case instruction::mulu:
+            case instruction::mulf:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Maps addi..mulf onto the matching loadc_/eload_ superinstruction
+    static instruction fused_arith(instruction first, instruction arith)
+    {
+        auto base = first == instruction::loadc ? instruction::loadc_addi
+                                                : instruction::eload_addi;
+        auto index = static_cast<uint32_t>(arith) -
+                     static_cast<uint32_t>(instruction::addi);
+        return static_cast<instruction>(static_cast<uint32_t>(base) + index);
+    }
+
+    void program::fuse_superinstructions()
+    {
+        const opcode* ops = get_opcodes();
+        size_t opCount = get_opcode_count();
+
+        // Instructions that can be entered from anywhere other than their
+        // predecessor can't be folded into the instruction before them.
+        // Return addresses never need marking, since call and yield never
+        // start a fused sequence.
+        std::vector<bool> isEntry(opCount, false);
+        for (auto& label : labels)
+        {
+            isEntry[label.pc] = true;
+        }
+
+        auto dispatchTable = execution_context::get_dispatch_table();
+        auto emit = [&](size_t pc, instruction fused)
+        {
+            auto& decoded = _code[pc];
+            decoded.instruction = fused;
+            decoded.handler =
+                dispatchTable ? dispatchTable[static_cast<size_t>(fused)]
+                              : nullptr;
+            _fusions.push_back({uint32_t(pc), fused});
+        };
+
+        auto isBranch = [](instruction instr)
+        { return instr == instruction::jeq || instr == instruction::jne; };
+
+        // The final opcode is always halt, so size - 1 is never fused into
+        size_t count = opCount - 1;
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto& first = ops[i];
+            auto& second = ops[i + 1];
+            if (isEntry[i + 1]) continue;
+
+            // Static data constants are resolved by loadc_data
+            if (first.instruction == instruction::loadc &&
+                constants[first.arg1].is_data_offset)
+                continue;
+
+            // Triples: {loadc, addi, addu, addi_imm} -> cmp -> jeq/jne
+            if (i + 2 < count && !isEntry[i + 2] &&
+                second.instruction == instruction::cmp &&
+                isBranch(ops[i + 2].instruction))
+            {
+                auto& branch = ops[i + 2];
+                bool eq = branch.instruction == instruction::jeq;
+                auto& decoded = _code[i];
+
+                if (first.instruction == instruction::loadc)
+                {
+                    decoded.reg1 = second.reg0;
+                    decoded.reg2 = second.reg1;
+                    decoded.target = labels[branch.warg0].pc;
+                    emit(i, eq ? instruction::loadc_cmp_jeq
+                               : instruction::loadc_cmp_jne);
+                    i += 2;
+                    continue;
+                }
+
+                if (first.instruction == instruction::addi_imm)
+                {
+                    decoded.reg3 = second.reg0;
+                    decoded.reg4 = second.reg1;
+                    decoded.target = labels[branch.warg0].pc;
+                    emit(i, eq ? instruction::addi_imm_cmp_jeq
+                               : instruction::addi_imm_cmp_jne);
+                    i += 2;
+                    continue;
+                }
+
+                if (first.instruction == instruction::addi ||
+                    first.instruction == instruction::addu)
+                {
+                    decoded.reg3 = second.reg0;
+                    decoded.reg4 = second.reg1;
+                    decoded.target = labels[branch.warg0].pc;
+                    if (first.instruction == instruction::addi)
+                    {
+                        emit(i, eq ? instruction::addi_cmp_jeq
+                                   : instruction::addi_cmp_jne);
+                    }
+                    else
+                    {
+                        emit(i, eq ? instruction::addu_cmp_jeq
+                                   : instruction::addu_cmp_jne);
+                    }
+                    i += 2;
+                    continue;
+                }
+            }
+
+            // Pairs
+            if ((first.instruction == instruction::loadc ||
+                 first.instruction == instruction::eload) &&
+                is_fusable_arith(second.instruction))
+            {
+                auto& decoded = _code[i];
+                decoded.reg1 = second.reg0;
+                decoded.reg2 = second.reg1;
+                decoded.reg3 = second.reg2;
+                emit(i, fused_arith(first.instruction, second.instruction));
+                ++i;
+                continue;
+            }
+
+            if (first.instruction == instruction::cmp &&
+                isBranch(second.instruction))
+            {
+                auto& decoded = _code[i];
+                decoded.arg = second.warg0;
+                decoded.target = labels[second.warg0].pc;
+                emit(i, second.instruction == instruction::jeq
+                            ? instruction::cmp_jeq
+                            : instruction::cmp_jne);
+                ++i;
+                continue;
+            }
+
+            if (first.instruction == instruction::cmp_imm &&
+                isBranch(second.instruction))
+            {
+                // arg already holds the immediate
+                auto& decoded = _code[i];
+                decoded.target = labels[second.warg0].pc;
+                emit(i, second.instruction == instruction::jeq
+                            ? instruction::cmp_imm_jeq
+                            : instruction::cmp_imm_jne);
+                ++i;
+                continue;
+            }
+        }
+    }
+
+    void program::set_superinstructions_enabled(bool enabled)
+    {
+        _fuse = enabled;
+    }
+
+    const std::vector<program_fusion>& program::get_fusions() const
+    {
+        return _fusions;
+    }
+
+    void program::set_memory_checks_enabled(bool enabled)
+    {
+        _checkMemory = enabled;
+    }
+
+    void program::set_jit_enabled(bool enabled)
+    {
+        _jit = enabled;
+    }
+
+    bool program::has_native_code() const
+    {
+        return _native != nullptr;
+    }
+
+    const char* program::get_label_name(program_label_id_t id) const
+    {
+        return get_data() + labels[id.idx].name;
+    }
+
+    const char* program::get_extern_name(program_extern_id_t id) const
+    {
+        return get_data() + extern_names[id.idx];
+    }
+
+    bool program::get_label_id(const std::string_view& name,
+                               program_label_id_t& id) const
+    {
+        return _label_table.find(get_data(), name, id.idx);
+    }
+
+    bool program::get_extern_id(const std::string_view& name,
+                                program_extern_id_t& id) const
+    {
+        return _extern_table.find(get_data(), name, id.idx);
+    }
+
+    void program::clear()
+    {
+        _image.reset();
+        opcodes.clear();
+        _data.clear();
+        constants.clear();
+        labels.clear();
+        externs.clear();
+        extern_names.clear();
+        _code.clear();
+        _fusions.clear();
+        _native.reset();
+        _aot = nullptr;
+        _label_table.reset(0);
+        _extern_table.reset(0);
+    }
+
+    void program::build_name_tables()
+    {
+        const char* data = get_data();
+
+        _label_table.reset(labels.size());
+        for (uint32_t i = 0; i < labels.size(); ++i)
+        {
+            _label_table.insert(data, labels[i].name, i);
+        }
+
+        _extern_table.reset(extern_names.size());
+        for (uint32_t i = 0; i < extern_names.size(); ++i)
+        {
+            _extern_table.insert(data, extern_names[i], i);
+        }
+    }
+
+    program_label& program::get_label(program_label_id_t id)
+    {
+        return labels[id.idx];
+    }
+
+    const program_label& program::get_label(program_label_id_t id) const
+    {
+        return labels[id.idx];
     }
 
     program_extern_value& program::get_extern(program_extern_id_t id)
@@ -1198,4 +2803,4 @@ namespace minivm
         return externs[id.idx];
     }
 
-}  // namespace minivm
\ No newline at end of file
+}  // namespace minivm
@@ -0,0 +1,127 @@
+#include <new>
+
+#include <minivm/vm.hpp>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define MINIVM_HAS_MMAP 1
+#endif
+
+namespace minivm
+{
+    static size_t get_page_size()
+    {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#elif MINIVM_HAS_MMAP
+        return size_t(sysconf(_SC_PAGESIZE));
+#else
+        return 4096;
+#endif
+    }
+
+    vm_stack::~vm_stack()
+    {
+        release();
+    }
+
+    bool vm_stack::allocate(size_t size, bool guarded)
+    {
+        release();
+
+        size_t page = get_page_size();
+        size = (size + page - 1) / page * page;
+
+        if (guarded)
+        {
+            // The memory is committed lazily by the OS, so untouched pages
+            // cost nothing
+            size_t mapped = size + page;
+#if defined(_WIN32)
+            void* memory = VirtualAlloc(nullptr, mapped,
+                                        MEM_RESERVE | MEM_COMMIT,
+                                        PAGE_READWRITE);
+            DWORD oldProtect;
+            if (memory &&
+                !VirtualProtect(static_cast<uint8_t*>(memory) + size, page,
+                                PAGE_NOACCESS, &oldProtect))
+            {
+                VirtualFree(memory, 0, MEM_RELEASE);
+                memory = nullptr;
+            }
+
+            if (!memory)
+            {
+                return false;
+            }
+#elif MINIVM_HAS_MMAP
+            void* memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
+            {
+                return false;
+            }
+
+            if (mprotect(static_cast<uint8_t*>(memory) + size, page,
+                         PROT_NONE) != 0)
+            {
+                munmap(memory, mapped);
+                return false;
+            }
+#else
+            // No way to protect a page, so this is an ordinary stack
+            void* memory = nullptr;
+            mapped = 0;
+#endif
+            if (mapped > 0)
+            {
+                _base = static_cast<uint8_t*>(memory);
+                _size = size;
+                _mapped = mapped;
+                return true;
+            }
+        }
+
+        _base = static_cast<uint8_t*>(
+            ::operator new(size, std::align_val_t(page), std::nothrow));
+        if (!_base)
+        {
+            return false;
+        }
+
+        _size = size;
+        _mapped = 0;
+        return true;
+    }
+
+    void vm_stack::release()
+    {
+        if (!_base)
+        {
+            return;
+        }
+
+        if (_mapped > 0)
+        {
+#if defined(_WIN32)
+            VirtualFree(_base, 0, MEM_RELEASE);
+#elif MINIVM_HAS_MMAP
+            munmap(_base, _mapped);
+#endif
+        }
+        else
+        {
+            ::operator delete(_base, std::align_val_t(get_page_size()));
+        }
+
+        _base = nullptr;
+        _size = 0;
+        _mapped = 0;
+    }
+}  // namespace minivm